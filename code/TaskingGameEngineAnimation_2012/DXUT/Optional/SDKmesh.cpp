@@ -11,6 +11,7 @@
 #include "DXUT.h"
 #include "SDKMesh.h"
 #include "SDKMisc.h"
+#include <malloc.h>
 
 //--------------------------------------------------------------------------------------
 void CDXUTSDKMesh::LoadMaterials( ID3D11Device* pd3dDevice, SDKMESH_MATERIAL* pMaterials, UINT numMaterials,
@@ -486,6 +487,9 @@ HRESULT CDXUTSDKMesh::CreateFromMemory( ID3D11Device* pDev11,
     m_pBindPoseFrameMatrices = new D3DXMATRIX[ m_pMeshHeader->NumFrames ];
     if( !m_pBindPoseFrameMatrices )
         goto Error;
+    m_pInvBindPoseFrameMatrices = new D3DXMATRIX[ m_pMeshHeader->NumFrames ];
+    if( !m_pInvBindPoseFrameMatrices )
+        goto Error;
 
     // Create a place to store our transformed frame matrices
     m_pTransformedFrameMatrices = new D3DXMATRIX[ m_pMeshHeader->NumFrames ];
@@ -495,6 +499,18 @@ HRESULT CDXUTSDKMesh::CreateFromMemory( ID3D11Device* pDev11,
     if( !m_pWorldPoseFrameMatrices )
         goto Error;
 
+    // Flatten the frame hierarchy
+    if( FAILED( hr = BuildFrameOrder() ) )
+        goto Error;
+
+    // Start from the bind pose in model space, so the inverse bind pose is valid even if
+    // the caller never calls TransformBindPose
+    {
+        D3DXMATRIX mIdentity;
+        D3DXMatrixIdentity( &mIdentity );
+        TransformBindPose( &mIdentity );
+    }
+
     SDKMESH_SUBSET* pSubset = NULL;
     D3D11_PRIMITIVE_TOPOLOGY PrimType;
 
@@ -598,76 +614,107 @@ Error:
 }
 
 //--------------------------------------------------------------------------------------
-// transform bind pose frame using a recursive traversal
+// flatten the frame hierarchy into a breadth-first order of the frames reachable from
+// frame 0, recording the parent of each.  Frames are usually stored parent first, so the
+// order mostly walks the matrix arrays forward.
 //--------------------------------------------------------------------------------------
-void CDXUTSDKMesh::TransformBindPoseFrame( UINT iFrame, D3DXMATRIX* pParentWorld )
+HRESULT CDXUTSDKMesh::BuildFrameOrder()
 {
-    if( !m_pBindPoseFrameMatrices )
-        return;
+    HRESULT hr = S_OK;
+    UINT NumFrames = m_pMeshHeader->NumFrames;
+    bool* pVisited = NULL;
 
-    // Transform ourselves
-    D3DXMATRIX LocalWorld;
-    D3DXMatrixMultiply( &LocalWorld, &m_pFrameArray[iFrame].Matrix, pParentWorld );
-    m_pBindPoseFrameMatrices[iFrame] = LocalWorld;
+    m_NumOrderedFrames = 0;
+    if( 0 == NumFrames )
+        return S_OK;
 
-    // Transform our siblings
-    if( m_pFrameArray[iFrame].SiblingFrame != INVALID_FRAME )
-        TransformBindPoseFrame( m_pFrameArray[iFrame].SiblingFrame, pParentWorld );
+    m_pFrameOrder = new UINT[ NumFrames ];
+    m_pFrameOrderParents = new UINT[ NumFrames ];
+    pVisited = new bool[ NumFrames ];
+    if( !m_pFrameOrder || !m_pFrameOrderParents || !pVisited )
+    {
+        hr = E_OUTOFMEMORY;
+        goto Error;
+    }
+    ZeroMemory( pVisited, NumFrames * sizeof( bool ) );
 
-    // Transform our children
-    if( m_pFrameArray[iFrame].ChildFrame != INVALID_FRAME )
-        TransformBindPoseFrame( m_pFrameArray[iFrame].ChildFrame, &LocalWorld );
+    // The top level frames: frame 0 and its siblings
+    for( UINT iFrame = 0; iFrame != INVALID_FRAME; iFrame = m_pFrameArray[iFrame].SiblingFrame )
+    {
+        if( iFrame >= NumFrames || pVisited[iFrame] )
+        {
+            hr = E_FAIL;
+            goto Error;
+        }
+        pVisited[iFrame] = true;
+
+        m_pFrameOrder[m_NumOrderedFrames] = iFrame;
+        m_pFrameOrderParents[m_NumOrderedFrames] = INVALID_FRAME;
+        m_NumOrderedFrames++;
+    }
+
+    // The order doubles as the queue: append the children of each frame in turn
+    for( UINT i = 0; i < m_NumOrderedFrames; i++ )
+    {
+        UINT iParent = m_pFrameOrder[i];
+
+        for( UINT iFrame = m_pFrameArray[iParent].ChildFrame; iFrame != INVALID_FRAME;
+             iFrame = m_pFrameArray[iFrame].SiblingFrame )
+        {
+            // A frame linked twice would make the hierarchy a graph
+            if( iFrame >= NumFrames || pVisited[iFrame] )
+            {
+                hr = E_FAIL;
+                goto Error;
+            }
+            pVisited[iFrame] = true;
+
+            m_pFrameOrder[m_NumOrderedFrames] = iFrame;
+            m_pFrameOrderParents[m_NumOrderedFrames] = iParent;
+            m_NumOrderedFrames++;
+        }
+    }
+
+Error:
+    SAFE_DELETE_ARRAY( pVisited );
+
+    return hr;
 }
 
 //--------------------------------------------------------------------------------------
-// transform frame using a recursive traversal
+// transform the frames for time fTime in one pass over the flattened hierarchy.  Parents
+// come first, so each frame's parent world matrix is ready when the frame is reached.
+// Each frame's final transform, which moves it to the bind pose and then to its posed
+// position, is written in the same pass.
 //--------------------------------------------------------------------------------------
-void CDXUTSDKMesh::TransformFrame( UINT iFrame, D3DXMATRIX* pParentWorld, double fTime )
+void CDXUTSDKMesh::TransformFrames( D3DXMATRIX* pWorld, double fTime )
 {
     // Get the tick data
-    D3DXMATRIX LocalTransform;
     UINT iTick = GetAnimationKeyFromTime( fTime );
 
-    if( INVALID_ANIMATION_DATA != m_pFrameArray[iFrame].AnimationDataIndex )
+    for( UINT i = 0; i < m_NumOrderedFrames; i++ )
     {
-        SDKANIMATION_FRAME_DATA* pFrameData = &m_pAnimationFrameData[ m_pFrameArray[iFrame].AnimationDataIndex ];
-        SDKANIMATION_DATA* pData = &pFrameData->pAnimationData[ iTick ];
+        UINT iFrame = m_pFrameOrder[i];
+        UINT iParent = m_pFrameOrderParents[i];
+        const D3DXMATRIX* pParentWorld = ( INVALID_FRAME == iParent ) ? pWorld : &m_pWorldPoseFrameMatrices[iParent];
 
-        // turn it into a matrix (Ignore scaling for now)
-        D3DXVECTOR3 parentPos = pData->Translation;
-        D3DXMATRIX mTranslate;
-        D3DXMatrixTranslation( &mTranslate, parentPos.x, parentPos.y, parentPos.z );
-
-        D3DXQUATERNION quat;
-        D3DXMATRIX mQuat;
-        quat.w = pData->Orientation.w;
-        quat.x = pData->Orientation.x;
-        quat.y = pData->Orientation.y;
-        quat.z = pData->Orientation.z;
-        if( quat.w == 0 && quat.x == 0 && quat.y == 0 && quat.z == 0 )
-            D3DXQuaternionIdentity( &quat );
-        D3DXQuaternionNormalize( &quat, &quat );
-        D3DXMatrixRotationQuaternion( &mQuat, &quat );
-        LocalTransform = ( mQuat * mTranslate );
-    }
-    else
-    {
-        LocalTransform = m_pFrameArray[iFrame].Matrix;
-    }
-
-    // Transform ourselves
-    D3DXMATRIX LocalWorld;
-    D3DXMatrixMultiply( &LocalWorld, &LocalTransform, pParentWorld );
-    m_pTransformedFrameMatrices[iFrame] = LocalWorld;
-    m_pWorldPoseFrameMatrices[iFrame] = LocalWorld;
+        if( INVALID_ANIMATION_DATA != m_pFrameArray[iFrame].AnimationDataIndex )
+        {
+            SDKANIMATION_FRAME_DATA* pFrameData = &m_pAnimationFrameData[ m_pFrameArray[iFrame].AnimationDataIndex ];
+            SDKANIMATION_DATA* pData = &pFrameData->pAnimationData[ iTick ];
 
-    // Transform our siblings
-    if( m_pFrameArray[iFrame].SiblingFrame != INVALID_FRAME )
-        TransformFrame( m_pFrameArray[iFrame].SiblingFrame, pParentWorld, fTime );
+            // turn it into a matrix and transform ourselves (Ignore scaling for now)
+            SDKMeshComposeFrame( &m_pWorldPoseFrameMatrices[iFrame], &pData->Translation, &pData->Orientation,
+                                 pParentWorld );
+        }
+        else
+        {
+            SDKMeshMatrixMultiply( &m_pWorldPoseFrameMatrices[iFrame], &m_pFrameArray[iFrame].Matrix, pParentWorld );
+        }
 
-    // Transform our children
-    if( m_pFrameArray[iFrame].ChildFrame != INVALID_FRAME )
-        TransformFrame( m_pFrameArray[iFrame].ChildFrame, &LocalWorld, fTime );
+        SDKMeshMatrixMultiply( &m_pTransformedFrameMatrices[iFrame], &m_pInvBindPoseFrameMatrices[iFrame],
+                               &m_pWorldPoseFrameMatrices[iFrame] );
+    }
 }
 
 //--------------------------------------------------------------------------------------
@@ -983,8 +1030,12 @@ CDXUTSDKMesh::CDXUTSDKMesh() : m_NumOutstandingResources( 0 ),
                                m_ppVertices( NULL ),
                                m_ppIndices( NULL ),
                                m_pBindPoseFrameMatrices( NULL ),
+                               m_pInvBindPoseFrameMatrices( NULL ),
                                m_pTransformedFrameMatrices( NULL ),
                                m_pWorldPoseFrameMatrices( NULL ),
+                               m_pFrameOrder( NULL ),
+                               m_pFrameOrderParents( NULL ),
+                               m_NumOrderedFrames( 0 ),
                                m_pDev9( NULL ),
 							   m_pDev11( NULL )
 {
@@ -1165,8 +1216,12 @@ void CDXUTSDKMesh::Destroy()
     m_pStaticMeshData = NULL;
     SAFE_DELETE_ARRAY( m_pAnimationData );
     SAFE_DELETE_ARRAY( m_pBindPoseFrameMatrices );
+    SAFE_DELETE_ARRAY( m_pInvBindPoseFrameMatrices );
     SAFE_DELETE_ARRAY( m_pTransformedFrameMatrices );
     SAFE_DELETE_ARRAY( m_pWorldPoseFrameMatrices );
+    SAFE_DELETE_ARRAY( m_pFrameOrder );
+    SAFE_DELETE_ARRAY( m_pFrameOrderParents );
+    m_NumOrderedFrames = 0;
 
     SAFE_DELETE_ARRAY( m_ppVertices );
     SAFE_DELETE_ARRAY( m_ppIndices );
@@ -1185,11 +1240,120 @@ void CDXUTSDKMesh::Destroy()
 }
 
 //--------------------------------------------------------------------------------------
-// transform the bind pose
+// transform the bind pose, and cache its inverse for TransformMesh
 //--------------------------------------------------------------------------------------
 void CDXUTSDKMesh::TransformBindPose( D3DXMATRIX* pWorld )
 {
-    TransformBindPoseFrame( 0, pWorld );
+    if( !m_pBindPoseFrameMatrices )
+        return;
+
+    for( UINT i = 0; i < m_NumOrderedFrames; i++ )
+    {
+        UINT iFrame = m_pFrameOrder[i];
+        UINT iParent = m_pFrameOrderParents[i];
+
+        const D3DXMATRIX* pParentWorld = ( INVALID_FRAME == iParent ) ? pWorld : &m_pBindPoseFrameMatrices[iParent];
+        SDKMeshMatrixMultiply( &m_pBindPoseFrameMatrices[iFrame], &m_pFrameArray[iFrame].Matrix, pParentWorld );
+        D3DXMatrixInverse( &m_pInvBindPoseFrameMatrices[iFrame], NULL, &m_pBindPoseFrameMatrices[iFrame] );
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// allocate the pose buffers for a group of instances of this mesh
+//--------------------------------------------------------------------------------------
+HRESULT CDXUTSDKMesh::CreatePoseGroup( SDKMESH_POSE_GROUP* pGroup )
+{
+    ZeroMemory( pGroup, sizeof( SDKMESH_POSE_GROUP ) );
+    if( !m_pMeshHeader )
+        return E_FAIL;
+    if( m_pAnimationHeader && FTT_RELATIVE != m_pAnimationHeader->FrameTransformType )
+        return E_NOTIMPL;
+
+    // Aligned to the widest vector so the kernels' loads never split a cache line
+    SIZE_T Bytes = m_pMeshHeader->NumFrames * sizeof( SDKMESH_MATRIX_LANES );
+    pGroup->pWorldPose = ( SDKMESH_MATRIX_LANES* )_aligned_malloc( Bytes, 64 );
+    pGroup->pTransformed = ( SDKMESH_MATRIX_LANES* )_aligned_malloc( Bytes, 64 );
+    if( !pGroup->pWorldPose || !pGroup->pTransformed )
+    {
+        DestroyPoseGroup( pGroup );
+        return E_OUTOFMEMORY;
+    }
+
+    pGroup->NumFrames = m_pMeshHeader->NumFrames;
+    return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+void CDXUTSDKMesh::DestroyPoseGroup( SDKMESH_POSE_GROUP* pGroup )
+{
+    if( pGroup->pWorldPose )
+        _aligned_free( pGroup->pWorldPose );
+    if( pGroup->pTransformed )
+        _aligned_free( pGroup->pTransformed );
+    ZeroMemory( pGroup, sizeof( SDKMESH_POSE_GROUP ) );
+}
+
+//--------------------------------------------------------------------------------------
+// TransformMesh for NumInstances instances at once, instance l at time pTimes[l].  The
+// mesh itself is only read, so several groups may be transformed concurrently.  Only
+// relative animation is supported.
+//--------------------------------------------------------------------------------------
+HRESULT CDXUTSDKMesh::TransformMeshGroup( SDKMESH_POSE_GROUP* pGroup, D3DXMATRIX* pWorld,
+                                          const double* pTimes, UINT NumInstances )
+{
+    if( m_pAnimationHeader && FTT_RELATIVE != m_pAnimationHeader->FrameTransformType )
+        return E_NOTIMPL;
+    if( pGroup->NumFrames != m_pMeshHeader->NumFrames || 0 == NumInstances ||
+        NumInstances > SDKMESH_POSE_LANES )
+        return E_INVALIDARG;
+
+    // Unused lanes repeat the last instance, so every lane holds a valid pose
+    UINT iTicks[ SDKMESH_POSE_LANES ];
+    for( UINT l = 0; l < SDKMESH_POSE_LANES; l++ )
+        iTicks[l] = GetAnimationKeyFromTime( pTimes[ l < NumInstances ? l : NumInstances - 1 ] );
+
+    SDKMESH_MATRIX_LANES WorldLanes;
+    for( UINT i = 0; i < 16; i++ )
+    {
+        for( UINT l = 0; l < SDKMESH_POSE_LANES; l++ )
+            WorldLanes.m[i][l] = ( ( float* )pWorld )[i];
+    }
+
+    SDKMESH_KEY_LANES Keys;
+    for( UINT i = 0; i < m_NumOrderedFrames; i++ )
+    {
+        UINT iFrame = m_pFrameOrder[i];
+        UINT iParent = m_pFrameOrderParents[i];
+        const SDKMESH_MATRIX_LANES* pParentWorld = ( INVALID_FRAME == iParent ) ? &WorldLanes :
+                                                                                 &pGroup->pWorldPose[iParent];
+
+        if( INVALID_ANIMATION_DATA != m_pFrameArray[iFrame].AnimationDataIndex )
+        {
+            SDKANIMATION_FRAME_DATA* pFrameData = &m_pAnimationFrameData[ m_pFrameArray[iFrame].AnimationDataIndex ];
+            for( UINT l = 0; l < SDKMESH_POSE_LANES; l++ )
+            {
+                SDKANIMATION_DATA* pData = &pFrameData->pAnimationData[ iTicks[l] ];
+                Keys.Translation[0][l] = pData->Translation.x;
+                Keys.Translation[1][l] = pData->Translation.y;
+                Keys.Translation[2][l] = pData->Translation.z;
+                Keys.Orientation[0][l] = pData->Orientation.x;
+                Keys.Orientation[1][l] = pData->Orientation.y;
+                Keys.Orientation[2][l] = pData->Orientation.z;
+                Keys.Orientation[3][l] = pData->Orientation.w;
+            }
+
+            SDKMeshComposeFrameLanes( &pGroup->pWorldPose[iFrame], &Keys, pParentWorld );
+        }
+        else
+        {
+            SDKMeshMatrixMultiplyLanes( &pGroup->pWorldPose[iFrame], &m_pFrameArray[iFrame].Matrix, pParentWorld );
+        }
+
+        SDKMeshMatrixMultiplyLanes( &pGroup->pTransformed[iFrame], &m_pInvBindPoseFrameMatrices[iFrame],
+                                    &pGroup->pWorldPose[iFrame] );
+    }
+
+    return S_OK;
 }
 
 //--------------------------------------------------------------------------------------
@@ -1199,18 +1363,9 @@ void CDXUTSDKMesh::TransformMesh( D3DXMATRIX* pWorld, double fTime )
 {
     if( m_pAnimationHeader == NULL || FTT_RELATIVE == m_pAnimationHeader->FrameTransformType )
     {
-        TransformFrame( 0, pWorld, fTime );
-
         // For each frame, move the transform to the bind pose, then
         // move it to the final position
-        D3DXMATRIX mInvBindPose;
-        D3DXMATRIX mFinal;
-        for( UINT i = 0; i < m_pMeshHeader->NumFrames; i++ )
-        {
-            D3DXMatrixInverse( &mInvBindPose, NULL, &m_pBindPoseFrameMatrices[i] );
-            mFinal = mInvBindPose * m_pTransformedFrameMatrices[i];
-            m_pTransformedFrameMatrices[i] = mFinal;
-        }
+        TransformFrames( pWorld, fTime );
     }
     else if( FTT_ABSOLUTE == m_pAnimationHeader->FrameTransformType )
     {
@@ -1686,6 +1841,21 @@ const D3DXMATRIX* CDXUTSDKMesh::GetMeshInfluenceMatrix( UINT iMesh, UINT iInflue
     return &m_pTransformedFrameMatrices[iFrame];
 }
 
+//--------------------------------------------------------------------------------------
+void CDXUTSDKMesh::GetTransposedInfluenceMatrices( UINT iMesh, D3DXMATRIX* pOut )
+{
+    SDKMeshTransposeGather( pOut, m_pTransformedFrameMatrices, m_pMeshArray[iMesh].pFrameInfluences,
+                            m_pMeshArray[iMesh].NumFrameInfluences );
+}
+
+//--------------------------------------------------------------------------------------
+void CDXUTSDKMesh::GetTransposedInfluenceMatricesGroup( UINT iMesh, const SDKMESH_POSE_GROUP* pGroup,
+                                                        D3DXMATRIX* const* ppOut, UINT NumInstances )
+{
+    SDKMeshTransposeGatherLanes( ppOut, NumInstances, pGroup->pTransformed, m_pMeshArray[iMesh].pFrameInfluences,
+                                 m_pMeshArray[iMesh].NumFrameInfluences );
+}
+
 const D3DXMATRIX* CDXUTSDKMesh::GetWorldMatrix( UINT iFrameIndex )
 {
     return &m_pWorldPoseFrameMatrices[iFrameIndex];
@@ -1726,6 +1896,99 @@ bool CDXUTSDKMesh::GetAnimationProperties( UINT* pNumKeys, FLOAT* pFrameTime )
 }
 
 
+//--------------------------------------------------------------------------------------
+// CDXUTSDKMeshCache
+//--------------------------------------------------------------------------------------
+
+//--------------------------------------------------------------------------------------
+CDXUTSDKMeshCache& WINAPI DXUTGetGlobalSDKMeshCache()
+{
+    // Using an accessor function gives control of the construction order
+    static CDXUTSDKMeshCache cache;
+    return cache;
+}
+
+//--------------------------------------------------------------------------------------
+CDXUTSDKMeshCache::~CDXUTSDKMeshCache()
+{
+    for( int i = 0; i < m_MeshCache.GetSize(); ++i )
+        SAFE_DELETE( m_MeshCache[i].pMesh );
+
+    m_MeshCache.RemoveAll();
+}
+
+//--------------------------------------------------------------------------------------
+// Returns the mesh loaded from szMeshFile with the animation in szAnimationFile (NULL
+// for none), loading them only if no one holds them yet.  Each successful call must be
+// matched by a Release.
+//--------------------------------------------------------------------------------------
+HRESULT CDXUTSDKMeshCache::Acquire( ID3D11Device* pDev11, LPCTSTR szMeshFile, LPCTSTR szAnimationFile,
+                                    bool bCreateAdjacencyIndices, CDXUTSDKMesh** ppMesh )
+{
+    HRESULT hr = S_OK;
+    LPCTSTR szAnimation = szAnimationFile ? szAnimationFile : L"";
+
+    *ppMesh = NULL;
+
+    // Search the cache for a matching entry.
+    for( int i = 0; i < m_MeshCache.GetSize(); ++i )
+    {
+        DXUTCache_SDKMesh& Entry = m_MeshCache[i];
+        if( !lstrcmpW( Entry.wszMesh, szMeshFile ) &&
+            !lstrcmpW( Entry.wszAnimation, szAnimation ) &&
+            Entry.bCreateAdjacencyIndices == bCreateAdjacencyIndices )
+        {
+            Entry.RefCount++;
+            *ppMesh = Entry.pMesh;
+            return S_OK;
+        }
+    }
+
+    DXUTCache_SDKMesh NewEntry;
+    wcscpy_s( NewEntry.wszMesh, MAX_PATH, szMeshFile );
+    wcscpy_s( NewEntry.wszAnimation, MAX_PATH, szAnimation );
+    NewEntry.bCreateAdjacencyIndices = bCreateAdjacencyIndices;
+    NewEntry.RefCount = 1;
+    NewEntry.pMesh = new CDXUTSDKMesh();
+    if( !NewEntry.pMesh )
+        return E_OUTOFMEMORY;
+
+    hr = NewEntry.pMesh->Create( pDev11, NewEntry.wszMesh, bCreateAdjacencyIndices );
+    if( SUCCEEDED( hr ) && szAnimationFile )
+        hr = NewEntry.pMesh->LoadAnimation( NewEntry.wszAnimation );
+    if( SUCCEEDED( hr ) )
+        hr = m_MeshCache.Add( NewEntry );
+    if( FAILED( hr ) )
+    {
+        SAFE_DELETE( NewEntry.pMesh );
+        return hr;
+    }
+
+    *ppMesh = NewEntry.pMesh;
+    return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+// Destroys the mesh once its last user releases it
+//--------------------------------------------------------------------------------------
+void CDXUTSDKMeshCache::Release( CDXUTSDKMesh* pMesh )
+{
+    for( int i = 0; i < m_MeshCache.GetSize(); ++i )
+    {
+        DXUTCache_SDKMesh& Entry = m_MeshCache[i];
+        if( Entry.pMesh == pMesh )
+        {
+            if( 0 == --Entry.RefCount )
+            {
+                SAFE_DELETE( Entry.pMesh );
+                m_MeshCache.Remove( i );
+            }
+            return;
+        }
+    }
+}
+
+
 //-------------------------------------------------------------------------------------
 // CDXUTXFileMesh implementation.
 //-------------------------------------------------------------------------------------
@@ -13,6 +13,8 @@
 #ifndef _SDKMESH_
 #define _SDKMESH_
 
+#include "SDKmeshMath.h"
+
 //--------------------------------------------------------------------------------------
 // Hard Defines for the various structures
 //--------------------------------------------------------------------------------------
@@ -291,6 +293,18 @@ struct SDKMESH_CALLBACKS11
     void* pContext;
 };
 
+//--------------------------------------------------------------------------------------
+// Poses of a group of up to SDKMESH_POSE_LANES instances of one mesh, one
+// SDKMESH_MATRIX_LANES per frame.  Created by CDXUTSDKMesh::CreatePoseGroup and filled
+// by CDXUTSDKMesh::TransformMeshGroup.
+//--------------------------------------------------------------------------------------
+struct SDKMESH_POSE_GROUP
+{
+    UINT NumFrames;
+    SDKMESH_MATRIX_LANES* pWorldPose;
+    SDKMESH_MATRIX_LANES* pTransformed;
+};
+
 //--------------------------------------------------------------------------------------
 // CDXUTSDKMesh class.  This class reads the sdkmesh file format for use by the samples
 //--------------------------------------------------------------------------------------
@@ -335,9 +349,17 @@ protected:
     SDKANIMATION_FILE_HEADER* m_pAnimationHeader;
     SDKANIMATION_FRAME_DATA* m_pAnimationFrameData;
     D3DXMATRIX* m_pBindPoseFrameMatrices;
+    D3DXMATRIX* m_pInvBindPoseFrameMatrices;
     D3DXMATRIX* m_pTransformedFrameMatrices;
     D3DXMATRIX* m_pWorldPoseFrameMatrices;
 
+    //Frames reachable from frame 0 in breadth-first order, so every frame comes after its
+    //parent, and the parent of each (INVALID_FRAME for top level frames).  Built at load
+    //time so the hierarchy is transformed with one forward loop instead of a recursion.
+    UINT* m_pFrameOrder;
+    UINT* m_pFrameOrderParents;
+    UINT m_NumOrderedFrames;
+
 protected:
     void                            LoadMaterials( ID3D11Device* pd3dDevice, SDKMESH_MATERIAL* pMaterials,
                                                    UINT NumMaterials, SDKMESH_CALLBACKS11* pLoaderCallbacks=NULL );
@@ -375,8 +397,8 @@ protected:
                                                       SDKMESH_CALLBACKS9* pLoaderCallbacks9 = NULL );
 
     //frame manipulation
-    void                            TransformBindPoseFrame( UINT iFrame, D3DXMATRIX* pParentWorld );
-    void                            TransformFrame( UINT iFrame, D3DXMATRIX* pParentWorld, double fTime );
+    HRESULT                         BuildFrameOrder();
+    void                            TransformFrames( D3DXMATRIX* pWorld, double fTime );
     void                            TransformFrameAbsolute( UINT iFrame, double fTime );
 
     //Direct3D 11 rendering helpers
@@ -431,6 +453,12 @@ public:
     void                            TransformBindPose( D3DXMATRIX* pWorld );
     void                            TransformMesh( D3DXMATRIX* pWorld, double fTime );
 
+    //Frame manipulation for groups of instances, each at its own time
+    HRESULT                         CreatePoseGroup( SDKMESH_POSE_GROUP* pGroup );
+    static void                     DestroyPoseGroup( SDKMESH_POSE_GROUP* pGroup );
+    HRESULT                         TransformMeshGroup( SDKMESH_POSE_GROUP* pGroup, D3DXMATRIX* pWorld,
+                                                        const double* pTimes, UINT NumInstances );
+
 
     //Direct3D 11 Rendering
     virtual void                    Render( ID3D11DeviceContext* pd3dDeviceContext,
@@ -504,12 +532,51 @@ public:
     //Animation
     UINT                            GetNumInfluences( UINT iMesh );
     const D3DXMATRIX*               GetMeshInfluenceMatrix( UINT iMesh, UINT iInfluence );
+    void                            GetTransposedInfluenceMatrices( UINT iMesh, D3DXMATRIX* pOut );
+    void                            GetTransposedInfluenceMatricesGroup( UINT iMesh, const SDKMESH_POSE_GROUP* pGroup,
+                                                                         D3DXMATRIX* const* ppOut, UINT NumInstances );
     UINT                            GetAnimationKeyFromTime( double fTime );
     const D3DXMATRIX*               GetWorldMatrix( UINT iFrameIndex );
     const D3DXMATRIX*               GetInfluenceMatrix( UINT iFrameIndex );
     bool                            GetAnimationProperties( UINT* pNumKeys, FLOAT* pFrameTime );
 };
 
+//--------------------------------------------------------------------------------------
+// CDXUTSDKMeshCache class.  Loads each sdkmesh and sdkmesh_anim pair once and shares the
+// mesh between everyone who acquires it, counting references.  Users must treat a shared
+// mesh as read only: pose it with TransformMeshGroup into their own SDKMESH_POSE_GROUP,
+// never with TransformMesh.  Not thread safe; acquire and release while loading.
+//--------------------------------------------------------------------------------------
+struct DXUTCache_SDKMesh
+{
+    WCHAR wszMesh[MAX_PATH];
+    WCHAR wszAnimation[MAX_PATH];
+    bool bCreateAdjacencyIndices;
+    UINT RefCount;
+    CDXUTSDKMesh* pMesh;
+};
+
+class CDXUTSDKMeshCache
+{
+public:
+                                    ~CDXUTSDKMeshCache();
+
+    HRESULT                         Acquire( ID3D11Device* pDev11, LPCTSTR szMeshFile, LPCTSTR szAnimationFile,
+                                             bool bCreateAdjacencyIndices, CDXUTSDKMesh** ppMesh );
+    void                            Release( CDXUTSDKMesh* pMesh );
+
+protected:
+    friend CDXUTSDKMeshCache& WINAPI DXUTGetGlobalSDKMeshCache();
+
+                                    CDXUTSDKMeshCache()
+                                    {
+                                    }
+
+    CGrowableArray <DXUTCache_SDKMesh> m_MeshCache;
+};
+
+CDXUTSDKMeshCache& WINAPI DXUTGetGlobalSDKMeshCache();
+
 //-----------------------------------------------------------------------------
 // Name: class CDXUTXFileMesh
 // Desc: Class for loading and rendering file-based meshes
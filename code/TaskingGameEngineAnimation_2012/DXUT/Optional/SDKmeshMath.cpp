@@ -0,0 +1,458 @@
+//--------------------------------------------------------------------------------------
+// File: SDKmeshMath.cpp
+//
+// SIMD matrix kernels for skeletal pose evaluation.  See SDKmeshMath.h.
+//--------------------------------------------------------------------------------------
+#include "DXUT.h"
+#include "SDKmeshMath.h"
+
+#include <emmintrin.h>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#if _MSC_VER >= 1700
+#define SDKMESH_MATH_AVX2
+#endif
+#if _MSC_VER >= 1910
+#define SDKMESH_MATH_AVX512
+#endif
+// MSVC lets any function use any instruction set
+#define SDKMESH_TARGET( isa )
+#else
+#include <immintrin.h>
+#define SDKMESH_MATH_AVX2
+#define SDKMESH_MATH_AVX512
+#define SDKMESH_TARGET( isa ) __attribute__(( target( isa ) ))
+#endif
+
+typedef void ( *LPSDKMESHMULTIPLY )( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB );
+typedef void ( *LPSDKMESHCOMPOSEFRAME )( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                                         const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent );
+typedef void ( *LPSDKMESHMULTIPLYLANES )( SDKMESH_MATRIX_LANES* pOut, const D3DXMATRIX* pA,
+                                          const SDKMESH_MATRIX_LANES* pB );
+typedef void ( *LPSDKMESHCOMPOSEFRAMELANES )( SDKMESH_MATRIX_LANES* pOut, const SDKMESH_KEY_LANES* pKeys,
+                                              const SDKMESH_MATRIX_LANES* pParent );
+
+struct SDKMESH_MATH_KERNELS
+{
+    LPSDKMESHMULTIPLY pMultiply;
+    LPSDKMESHCOMPOSEFRAME pComposeFrame;
+    LPSDKMESHMULTIPLYLANES pMultiplyLanes;
+    LPSDKMESHCOMPOSEFRAMELANES pComposeFrameLanes;
+};
+
+//--------------------------------------------------------------------------------------
+// Builds the rows of a local frame transform: the rotation by a quaternion in rows 0-2,
+// the translation in row 3.  Shared by every level; the multiply is what widens.
+//--------------------------------------------------------------------------------------
+static inline void LocalFromKey( __m128 Rows[4], const D3DXVECTOR3* pTranslation, const D3DXVECTOR4* pOrientation )
+{
+    const __m128 One110 = _mm_setr_ps( 1.0f, 1.0f, 1.0f, 0.0f );
+    const __m128 Mask3 = _mm_castsi128_ps( _mm_setr_epi32( -1, -1, -1, 0 ) );
+
+    __m128 Q = _mm_loadu_ps( ( const float* )pOrientation );
+
+    // Normalize, taking an all zero quaternion as the identity
+    __m128 LengthSq = _mm_mul_ps( Q, Q );
+    LengthSq = _mm_add_ps( LengthSq, _mm_shuffle_ps( LengthSq, LengthSq, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    LengthSq = _mm_add_ps( LengthSq, _mm_shuffle_ps( LengthSq, LengthSq, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    if( 0.0f == _mm_cvtss_f32( LengthSq ) )
+        Q = _mm_setr_ps( 0.0f, 0.0f, 0.0f, 1.0f );
+    else
+        Q = _mm_div_ps( Q, _mm_sqrt_ps( LengthSq ) );
+
+    __m128 Q2 = _mm_add_ps( Q, Q );
+
+    // Diagonal: 1 - 2yy - 2zz, 1 - 2xx - 2zz, 1 - 2xx - 2yy
+    __m128 Squares = _mm_mul_ps( Q, Q2 );
+    __m128 V0 = _mm_and_ps( _mm_shuffle_ps( Squares, Squares, _MM_SHUFFLE( 3, 0, 0, 1 ) ), Mask3 );
+    __m128 V1 = _mm_and_ps( _mm_shuffle_ps( Squares, Squares, _MM_SHUFFLE( 3, 1, 2, 2 ) ), Mask3 );
+    __m128 Diagonal = _mm_sub_ps( _mm_sub_ps( One110, V0 ), V1 );
+
+    // 2xz, 2xy, 2yz and 2wy, 2wz, 2wx
+    V0 = _mm_mul_ps( _mm_shuffle_ps( Q, Q, _MM_SHUFFLE( 3, 1, 0, 0 ) ),
+                     _mm_shuffle_ps( Q2, Q2, _MM_SHUFFLE( 3, 2, 1, 2 ) ) );
+    V1 = _mm_mul_ps( _mm_shuffle_ps( Q2, Q2, _MM_SHUFFLE( 3, 3, 3, 3 ) ),
+                     _mm_shuffle_ps( Q, Q, _MM_SHUFFLE( 3, 0, 2, 1 ) ) );
+    __m128 Sum = _mm_add_ps( V0, V1 );
+    __m128 Difference = _mm_sub_ps( V0, V1 );
+
+    // 2xy + 2wz, 2xz - 2wy, 2xy - 2wz, 2yz + 2wx
+    V0 = _mm_shuffle_ps( Sum, Difference, _MM_SHUFFLE( 1, 0, 2, 1 ) );
+    V0 = _mm_shuffle_ps( V0, V0, _MM_SHUFFLE( 1, 3, 2, 0 ) );
+    // 2xz + 2wy, 2yz - 2wx, 2xz + 2wy, 2yz - 2wx
+    V1 = _mm_shuffle_ps( Sum, Difference, _MM_SHUFFLE( 2, 2, 0, 0 ) );
+    V1 = _mm_shuffle_ps( V1, V1, _MM_SHUFFLE( 2, 0, 2, 0 ) );
+
+    __m128 Row = _mm_shuffle_ps( Diagonal, V0, _MM_SHUFFLE( 1, 0, 3, 0 ) );
+    Rows[0] = _mm_shuffle_ps( Row, Row, _MM_SHUFFLE( 1, 3, 2, 0 ) );
+    Row = _mm_shuffle_ps( Diagonal, V0, _MM_SHUFFLE( 3, 2, 3, 1 ) );
+    Rows[1] = _mm_shuffle_ps( Row, Row, _MM_SHUFFLE( 1, 3, 0, 2 ) );
+    Rows[2] = _mm_shuffle_ps( V1, Diagonal, _MM_SHUFFLE( 3, 2, 1, 0 ) );
+    Rows[3] = _mm_setr_ps( pTranslation->x, pTranslation->y, pTranslation->z, 1.0f );
+}
+
+//--------------------------------------------------------------------------------------
+// SSE2: one row of the result at a time
+//--------------------------------------------------------------------------------------
+static inline __m128 MultiplyRow_SSE2( __m128 A, const __m128 B[4] )
+{
+    __m128 Result = _mm_mul_ps( _mm_shuffle_ps( A, A, _MM_SHUFFLE( 0, 0, 0, 0 ) ), B[0] );
+    Result = _mm_add_ps( Result, _mm_mul_ps( _mm_shuffle_ps( A, A, _MM_SHUFFLE( 1, 1, 1, 1 ) ), B[1] ) );
+    Result = _mm_add_ps( Result, _mm_mul_ps( _mm_shuffle_ps( A, A, _MM_SHUFFLE( 2, 2, 2, 2 ) ), B[2] ) );
+    Result = _mm_add_ps( Result, _mm_mul_ps( _mm_shuffle_ps( A, A, _MM_SHUFFLE( 3, 3, 3, 3 ) ), B[3] ) );
+    return Result;
+}
+
+static void MultiplyRows_SSE2( float* pOut, const __m128 A[4], const float* pB )
+{
+    __m128 B[4];
+    for( UINT i = 0; i < 4; i++ )
+        B[i] = _mm_loadu_ps( pB + 4 * i );
+
+    // Computed before storing so pOut may alias pB
+    __m128 Result[4];
+    for( UINT i = 0; i < 4; i++ )
+        Result[i] = MultiplyRow_SSE2( A[i], B );
+    for( UINT i = 0; i < 4; i++ )
+        _mm_storeu_ps( pOut + 4 * i, Result[i] );
+}
+
+static void Multiply_SSE2( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB )
+{
+    __m128 A[4];
+    for( UINT i = 0; i < 4; i++ )
+        A[i] = _mm_loadu_ps( ( const float* )pA + 4 * i );
+
+    MultiplyRows_SSE2( ( float* )pOut, A, ( const float* )pB );
+}
+
+static void ComposeFrame_SSE2( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                               const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent )
+{
+    __m128 Local[4];
+    LocalFromKey( Local, pTranslation, pOrientation );
+
+    MultiplyRows_SSE2( ( float* )pOut, Local, ( const float* )pParent );
+}
+
+#define LANE_ISA "sse2"
+#define LANE_NAME( Name ) Name##_SSE2
+#define LANE_WIDTH 4
+#define LANE_VEC __m128
+#define LANE_MASK __m128
+#define LANE_LOAD( p ) _mm_loadu_ps( p )
+#define LANE_STORE( p, v ) _mm_storeu_ps( p, v )
+#define LANE_SET1( f ) _mm_set1_ps( f )
+#define LANE_ADD( a, b ) _mm_add_ps( a, b )
+#define LANE_SUB( a, b ) _mm_sub_ps( a, b )
+#define LANE_MUL( a, b ) _mm_mul_ps( a, b )
+#define LANE_DIV( a, b ) _mm_div_ps( a, b )
+#define LANE_FMADD( a, b, c ) _mm_add_ps( _mm_mul_ps( a, b ), c )
+#define LANE_SQRT( a ) _mm_sqrt_ps( a )
+#define LANE_ISZERO( a ) _mm_cmpeq_ps( a, _mm_setzero_ps() )
+#define LANE_BLEND( m, a, b ) _mm_or_ps( _mm_and_ps( m, b ), _mm_andnot_ps( m, a ) )
+#include "SDKmeshMathLanes.inl"
+
+#ifdef SDKMESH_MATH_AVX2
+//--------------------------------------------------------------------------------------
+// AVX2: two rows of the result per instruction, with the rows of B repeated in both
+// 128-bit lanes
+//--------------------------------------------------------------------------------------
+SDKMESH_TARGET( "avx2,fma" )
+static inline void MultiplyRows_AVX2( float* pOut, __m256 A01, __m256 A23, const float* pB )
+{
+    __m256 B0 = _mm256_broadcast_ps( ( const __m128* )( pB + 0 ) );
+    __m256 B1 = _mm256_broadcast_ps( ( const __m128* )( pB + 4 ) );
+    __m256 B2 = _mm256_broadcast_ps( ( const __m128* )( pB + 8 ) );
+    __m256 B3 = _mm256_broadcast_ps( ( const __m128* )( pB + 12 ) );
+
+    __m256 R01 = _mm256_mul_ps( _mm256_permute_ps( A01, 0x00 ), B0 );
+    __m256 R23 = _mm256_mul_ps( _mm256_permute_ps( A23, 0x00 ), B0 );
+    R01 = _mm256_fmadd_ps( _mm256_permute_ps( A01, 0x55 ), B1, R01 );
+    R23 = _mm256_fmadd_ps( _mm256_permute_ps( A23, 0x55 ), B1, R23 );
+    R01 = _mm256_fmadd_ps( _mm256_permute_ps( A01, 0xAA ), B2, R01 );
+    R23 = _mm256_fmadd_ps( _mm256_permute_ps( A23, 0xAA ), B2, R23 );
+    R01 = _mm256_fmadd_ps( _mm256_permute_ps( A01, 0xFF ), B3, R01 );
+    R23 = _mm256_fmadd_ps( _mm256_permute_ps( A23, 0xFF ), B3, R23 );
+
+    _mm256_storeu_ps( pOut + 0, R01 );
+    _mm256_storeu_ps( pOut + 8, R23 );
+}
+
+SDKMESH_TARGET( "avx2,fma" )
+static void Multiply_AVX2( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB )
+{
+    __m256 A01 = _mm256_loadu_ps( ( const float* )pA + 0 );
+    __m256 A23 = _mm256_loadu_ps( ( const float* )pA + 8 );
+
+    MultiplyRows_AVX2( ( float* )pOut, A01, A23, ( const float* )pB );
+}
+
+SDKMESH_TARGET( "avx2,fma" )
+static void ComposeFrame_AVX2( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                               const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent )
+{
+    __m128 Local[4];
+    LocalFromKey( Local, pTranslation, pOrientation );
+
+    __m256 A01 = _mm256_insertf128_ps( _mm256_castps128_ps256( Local[0] ), Local[1], 1 );
+    __m256 A23 = _mm256_insertf128_ps( _mm256_castps128_ps256( Local[2] ), Local[3], 1 );
+
+    MultiplyRows_AVX2( ( float* )pOut, A01, A23, ( const float* )pParent );
+}
+
+#define LANE_ISA "avx2,fma"
+#define LANE_NAME( Name ) Name##_AVX2
+#define LANE_WIDTH 8
+#define LANE_VEC __m256
+#define LANE_MASK __m256
+#define LANE_LOAD( p ) _mm256_loadu_ps( p )
+#define LANE_STORE( p, v ) _mm256_storeu_ps( p, v )
+#define LANE_SET1( f ) _mm256_set1_ps( f )
+#define LANE_ADD( a, b ) _mm256_add_ps( a, b )
+#define LANE_SUB( a, b ) _mm256_sub_ps( a, b )
+#define LANE_MUL( a, b ) _mm256_mul_ps( a, b )
+#define LANE_DIV( a, b ) _mm256_div_ps( a, b )
+#define LANE_FMADD( a, b, c ) _mm256_fmadd_ps( a, b, c )
+#define LANE_SQRT( a ) _mm256_sqrt_ps( a )
+#define LANE_ISZERO( a ) _mm256_cmp_ps( a, _mm256_setzero_ps(), _CMP_EQ_OQ )
+#define LANE_BLEND( m, a, b ) _mm256_blendv_ps( a, b, m )
+#include "SDKmeshMathLanes.inl"
+#endif
+
+#ifdef SDKMESH_MATH_AVX512
+//--------------------------------------------------------------------------------------
+// AVX-512: the whole result in one register, with the rows of B in all four lanes
+//--------------------------------------------------------------------------------------
+SDKMESH_TARGET( "avx512f" )
+static inline void MultiplyRows_AVX512( float* pOut, __m512 A, const float* pB )
+{
+    __m512 B0 = _mm512_broadcast_f32x4( _mm_loadu_ps( pB + 0 ) );
+    __m512 B1 = _mm512_broadcast_f32x4( _mm_loadu_ps( pB + 4 ) );
+    __m512 B2 = _mm512_broadcast_f32x4( _mm_loadu_ps( pB + 8 ) );
+    __m512 B3 = _mm512_broadcast_f32x4( _mm_loadu_ps( pB + 12 ) );
+
+    __m512 R = _mm512_mul_ps( _mm512_permute_ps( A, 0x00 ), B0 );
+    R = _mm512_fmadd_ps( _mm512_permute_ps( A, 0x55 ), B1, R );
+    R = _mm512_fmadd_ps( _mm512_permute_ps( A, 0xAA ), B2, R );
+    R = _mm512_fmadd_ps( _mm512_permute_ps( A, 0xFF ), B3, R );
+
+    _mm512_storeu_ps( pOut, R );
+}
+
+SDKMESH_TARGET( "avx512f" )
+static void Multiply_AVX512( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB )
+{
+    MultiplyRows_AVX512( ( float* )pOut, _mm512_loadu_ps( ( const float* )pA ), ( const float* )pB );
+}
+
+SDKMESH_TARGET( "avx512f" )
+static void ComposeFrame_AVX512( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                                 const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent )
+{
+    __m128 Local[4];
+    LocalFromKey( Local, pTranslation, pOrientation );
+
+    __m512 A = _mm512_castps128_ps512( Local[0] );
+    A = _mm512_insertf32x4( A, Local[1], 1 );
+    A = _mm512_insertf32x4( A, Local[2], 2 );
+    A = _mm512_insertf32x4( A, Local[3], 3 );
+
+    MultiplyRows_AVX512( ( float* )pOut, A, ( const float* )pParent );
+}
+
+#define LANE_ISA "avx512f"
+#define LANE_NAME( Name ) Name##_AVX512
+#define LANE_WIDTH 16
+#define LANE_VEC __m512
+#define LANE_MASK __mmask16
+#define LANE_LOAD( p ) _mm512_loadu_ps( p )
+#define LANE_STORE( p, v ) _mm512_storeu_ps( p, v )
+#define LANE_SET1( f ) _mm512_set1_ps( f )
+#define LANE_ADD( a, b ) _mm512_add_ps( a, b )
+#define LANE_SUB( a, b ) _mm512_sub_ps( a, b )
+#define LANE_MUL( a, b ) _mm512_mul_ps( a, b )
+#define LANE_DIV( a, b ) _mm512_div_ps( a, b )
+#define LANE_FMADD( a, b, c ) _mm512_fmadd_ps( a, b, c )
+#define LANE_SQRT( a ) _mm512_sqrt_ps( a )
+#define LANE_ISZERO( a ) _mm512_cmp_ps_mask( a, _mm512_setzero_ps(), _CMP_EQ_OQ )
+#define LANE_BLEND( m, a, b ) _mm512_mask_blend_ps( m, a, b )
+#include "SDKmeshMathLanes.inl"
+#endif
+
+//--------------------------------------------------------------------------------------
+// Returns the best level the CPU, the OS (which must save the wider registers) and the
+// compiler support
+//--------------------------------------------------------------------------------------
+static SDKMESH_MATH_LEVEL DetectLevel()
+{
+#if !defined( SDKMESH_MATH_AVX2 )
+    // No wider kernels to pick, and compilers this old lack _xgetbv
+    return SMML_SSE2;
+#elif defined( _MSC_VER )
+    int Info[4];
+    __cpuid( Info, 0 );
+    if( Info[0] < 7 )
+        return SMML_SSE2;
+
+    __cpuid( Info, 1 );
+    bool bOSXSave = ( Info[2] & ( 1 << 27 ) ) != 0;
+    bool bAVX = ( Info[2] & ( 1 << 28 ) ) != 0;
+    bool bFMA = ( Info[2] & ( 1 << 12 ) ) != 0;
+    if( !bOSXSave || !bAVX || !bFMA )
+        return SMML_SSE2;
+
+    // XMM and YMM state, then opmask and ZMM state
+    unsigned __int64 XCR0 = _xgetbv( 0 );
+    if( ( XCR0 & 0x06 ) != 0x06 )
+        return SMML_SSE2;
+
+    __cpuidex( Info, 7, 0 );
+#ifdef SDKMESH_MATH_AVX512
+    if( ( Info[1] & ( 1 << 16 ) ) && ( XCR0 & 0xE6 ) == 0xE6 )
+        return SMML_AVX512;
+#endif
+#ifdef SDKMESH_MATH_AVX2
+    if( Info[1] & ( 1 << 5 ) )
+        return SMML_AVX2;
+#endif
+    return SMML_SSE2;
+#else
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx512f" ) )
+        return SMML_AVX512;
+    if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+        return SMML_AVX2;
+    return SMML_SSE2;
+#endif
+}
+
+static SDKMESH_MATH_KERNELS GetKernels( SDKMESH_MATH_LEVEL Level )
+{
+    SDKMESH_MATH_KERNELS Kernels = { Multiply_SSE2, ComposeFrame_SSE2, MultiplyLanes_SSE2, ComposeFrameLanes_SSE2 };
+
+    switch( Level )
+    {
+#ifdef SDKMESH_MATH_AVX512
+        case SMML_AVX512:
+            Kernels.pMultiply = Multiply_AVX512;
+            Kernels.pComposeFrame = ComposeFrame_AVX512;
+            Kernels.pMultiplyLanes = MultiplyLanes_AVX512;
+            Kernels.pComposeFrameLanes = ComposeFrameLanes_AVX512;
+            break;
+#endif
+#ifdef SDKMESH_MATH_AVX2
+        case SMML_AVX2:
+            Kernels.pMultiply = Multiply_AVX2;
+            Kernels.pComposeFrame = ComposeFrame_AVX2;
+            Kernels.pMultiplyLanes = MultiplyLanes_AVX2;
+            Kernels.pComposeFrameLanes = ComposeFrameLanes_AVX2;
+            break;
+#endif
+        default:
+            break;
+    }
+
+    return Kernels;
+}
+
+//--------------------------------------------------------------------------------------
+// Selected during static initialization, before any mesh can be loaded
+//--------------------------------------------------------------------------------------
+static SDKMESH_MATH_LEVEL s_SupportedLevel = DetectLevel();
+static SDKMESH_MATH_LEVEL s_Level = s_SupportedLevel;
+static SDKMESH_MATH_KERNELS s_Kernels = GetKernels( s_SupportedLevel );
+
+//--------------------------------------------------------------------------------------
+SDKMESH_MATH_LEVEL SDKMeshMathGetLevel()
+{
+    return s_Level;
+}
+
+//--------------------------------------------------------------------------------------
+SDKMESH_MATH_LEVEL SDKMeshMathSetLevel( SDKMESH_MATH_LEVEL Level )
+{
+    s_Level = ( Level < s_SupportedLevel ) ? Level : s_SupportedLevel;
+    s_Kernels = GetKernels( s_Level );
+    return s_Level;
+}
+
+//--------------------------------------------------------------------------------------
+void SDKMeshMatrixMultiply( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB )
+{
+    s_Kernels.pMultiply( pOut, pA, pB );
+}
+
+//--------------------------------------------------------------------------------------
+void SDKMeshComposeFrame( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                          const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent )
+{
+    s_Kernels.pComposeFrame( pOut, pTranslation, pOrientation, pParent );
+}
+
+//--------------------------------------------------------------------------------------
+void SDKMeshMatrixMultiplyLanes( SDKMESH_MATRIX_LANES* pOut, const D3DXMATRIX* pA, const SDKMESH_MATRIX_LANES* pB )
+{
+    s_Kernels.pMultiplyLanes( pOut, pA, pB );
+}
+
+//--------------------------------------------------------------------------------------
+void SDKMeshComposeFrameLanes( SDKMESH_MATRIX_LANES* pOut, const SDKMESH_KEY_LANES* pKeys,
+                               const SDKMESH_MATRIX_LANES* pParent )
+{
+    s_Kernels.pComposeFrameLanes( pOut, pKeys, pParent );
+}
+
+//--------------------------------------------------------------------------------------
+// Memory bound, so one SSE2 version serves every level
+//--------------------------------------------------------------------------------------
+void SDKMeshTransposeGather( D3DXMATRIX* pOut, const D3DXMATRIX* pIn, const UINT* pIndices, UINT Count )
+{
+    for( UINT i = 0; i < Count; i++ )
+    {
+        const float* pSource = ( const float* )&pIn[ pIndices[i] ];
+        float* pDest = ( float* )&pOut[i];
+
+        __m128 Row0 = _mm_loadu_ps( pSource + 0 );
+        __m128 Row1 = _mm_loadu_ps( pSource + 4 );
+        __m128 Row2 = _mm_loadu_ps( pSource + 8 );
+        __m128 Row3 = _mm_loadu_ps( pSource + 12 );
+        _MM_TRANSPOSE4_PS( Row0, Row1, Row2, Row3 );
+        _mm_storeu_ps( pDest + 0, Row0 );
+        _mm_storeu_ps( pDest + 4, Row1 );
+        _mm_storeu_ps( pDest + 8, Row2 );
+        _mm_storeu_ps( pDest + 12, Row3 );
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Four instances at a time: column r of four matrices, transposed, is row r of each
+// one's transpose.  Memory bound like SDKMeshTransposeGather, so SSE2 only.
+//--------------------------------------------------------------------------------------
+void SDKMeshTransposeGatherLanes( D3DXMATRIX* const* ppOut, UINT NumLanes, const SDKMESH_MATRIX_LANES* pIn,
+                                  const UINT* pIndices, UINT Count )
+{
+    for( UINT i = 0; i < Count; i++ )
+    {
+        const SDKMESH_MATRIX_LANES* pSource = &pIn[ pIndices[i] ];
+
+        for( UINT l = 0; l < NumLanes; l += 4 )
+        {
+            UINT NumStores = ( NumLanes - l < 4 ) ? NumLanes - l : 4;
+
+            for( UINT r = 0; r < 4; r++ )
+            {
+                __m128 Rows[4];
+                Rows[0] = _mm_loadu_ps( &pSource->m[r][l] );
+                Rows[1] = _mm_loadu_ps( &pSource->m[4 + r][l] );
+                Rows[2] = _mm_loadu_ps( &pSource->m[8 + r][l] );
+                Rows[3] = _mm_loadu_ps( &pSource->m[12 + r][l] );
+                _MM_TRANSPOSE4_PS( Rows[0], Rows[1], Rows[2], Rows[3] );
+
+                for( UINT k = 0; k < NumStores; k++ )
+                    _mm_storeu_ps( &ppOut[l + k][i].m[r][0], Rows[k] );
+            }
+        }
+    }
+}
@@ -0,0 +1,84 @@
+//--------------------------------------------------------------------------------------
+// File: SDKmeshMath.h
+//
+// SIMD matrix kernels for skeletal pose evaluation in CDXUTSDKMesh.  Each kernel has an
+// SSE2, an AVX2/FMA and (where the compiler supports it) an AVX-512 version, picked once
+// at startup from the CPU features.  Matrices follow the D3DX row vector convention and
+// need no particular alignment.
+//--------------------------------------------------------------------------------------
+#pragma once
+#ifndef SDKMESHMATH_H
+#define SDKMESHMATH_H
+
+enum SDKMESH_MATH_LEVEL
+{
+    SMML_SSE2 = 0,
+    SMML_AVX2,
+    SMML_AVX512,
+};
+
+//--------------------------------------------------------------------------------------
+// Returns the instruction set the kernels use.  SDKMeshMathSetLevel selects another one,
+// for comparing them; levels the CPU or compiler does not support fall back to the best
+// one that is.  Returns the level selected.  Not thread safe with running kernels.
+//--------------------------------------------------------------------------------------
+SDKMESH_MATH_LEVEL SDKMeshMathGetLevel();
+SDKMESH_MATH_LEVEL SDKMeshMathSetLevel( SDKMESH_MATH_LEVEL Level );
+
+//--------------------------------------------------------------------------------------
+// pOut = pA * pB
+//--------------------------------------------------------------------------------------
+void SDKMeshMatrixMultiply( D3DXMATRIX* pOut, const D3DXMATRIX* pA, const D3DXMATRIX* pB );
+
+//--------------------------------------------------------------------------------------
+// pOut = R * T * pParent, where R rotates by the normalized pOrientation (x, y, z, w; an
+// all zero quaternion is taken as the identity) and T translates by pTranslation.  This
+// is D3DXMatrixRotationQuaternion, D3DXMatrixTranslation and two D3DXMatrixMultiply in one.
+//--------------------------------------------------------------------------------------
+void SDKMeshComposeFrame( D3DXMATRIX* pOut, const D3DXVECTOR3* pTranslation,
+                          const D3DXVECTOR4* pOrientation, const D3DXMATRIX* pParent );
+
+//--------------------------------------------------------------------------------------
+// pOut[i] = transpose( pIn[ pIndices[i] ] ) for i in [0, Count), for copying bone
+// palettes into shader constants.  pOut must not overlap pIn.
+//--------------------------------------------------------------------------------------
+void SDKMeshTransposeGather( D3DXMATRIX* pOut, const D3DXMATRIX* pIn, const UINT* pIndices, UINT Count );
+
+//--------------------------------------------------------------------------------------
+// Poses of several instances of one skeleton are kept a bone at a time with the
+// instances side by side: element i of the bone matrix for instance l is m[i][l].  Each
+// kernel below then treats SDKMESH_POSE_LANES instances as one, 4, 8 or 16 at a time
+// per instruction depending on the level.
+//--------------------------------------------------------------------------------------
+#define SDKMESH_POSE_LANES 16
+
+struct SDKMESH_MATRIX_LANES
+{
+    float m[16][SDKMESH_POSE_LANES];
+};
+
+struct SDKMESH_KEY_LANES
+{
+    float Translation[3][SDKMESH_POSE_LANES];
+    float Orientation[4][SDKMESH_POSE_LANES];
+};
+
+//--------------------------------------------------------------------------------------
+// pOut = pA * pB for each lane, with the same pA in every lane.  pOut may be pB.
+//--------------------------------------------------------------------------------------
+void SDKMeshMatrixMultiplyLanes( SDKMESH_MATRIX_LANES* pOut, const D3DXMATRIX* pA, const SDKMESH_MATRIX_LANES* pB );
+
+//--------------------------------------------------------------------------------------
+// SDKMeshComposeFrame for each lane.  pOut may be pParent.
+//--------------------------------------------------------------------------------------
+void SDKMeshComposeFrameLanes( SDKMESH_MATRIX_LANES* pOut, const SDKMESH_KEY_LANES* pKeys,
+                               const SDKMESH_MATRIX_LANES* pParent );
+
+//--------------------------------------------------------------------------------------
+// ppOut[l][i] = transpose( lane l of pIn[ pIndices[i] ] ) for each of the first NumLanes
+// lanes and i in [0, Count).  SDKMeshTransposeGather for a group of instances.
+//--------------------------------------------------------------------------------------
+void SDKMeshTransposeGatherLanes( D3DXMATRIX* const* ppOut, UINT NumLanes, const SDKMESH_MATRIX_LANES* pIn,
+                                  const UINT* pIndices, UINT Count );
+
+#endif
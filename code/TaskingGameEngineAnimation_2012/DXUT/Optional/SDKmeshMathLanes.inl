@@ -0,0 +1,135 @@
+//--------------------------------------------------------------------------------------
+// File: SDKmeshMathLanes.inl
+//
+// The instance group kernels of SDKmeshMath.cpp, written once over vectors of LANE_WIDTH
+// lanes.  SDKmeshMath.cpp includes this once per level, with the LANE_ macros defined
+// for that level's instruction set; they are undefined again at the end.
+//--------------------------------------------------------------------------------------
+
+SDKMESH_TARGET( LANE_ISA )
+static void LANE_NAME( MultiplyLanes )( SDKMESH_MATRIX_LANES* pOut, const D3DXMATRIX* pA,
+                                        const SDKMESH_MATRIX_LANES* pB )
+{
+    for( UINT l = 0; l < SDKMESH_POSE_LANES; l += LANE_WIDTH )
+    {
+        // All of B is loaded before anything is stored, so pOut may alias pB
+        LANE_VEC B[16];
+        for( UINT i = 0; i < 16; i++ )
+            B[i] = LANE_LOAD( &pB->m[i][l] );
+
+        for( UINT r = 0; r < 4; r++ )
+        {
+            LANE_VEC A0 = LANE_SET1( pA->m[r][0] );
+            LANE_VEC A1 = LANE_SET1( pA->m[r][1] );
+            LANE_VEC A2 = LANE_SET1( pA->m[r][2] );
+            LANE_VEC A3 = LANE_SET1( pA->m[r][3] );
+
+            for( UINT c = 0; c < 4; c++ )
+            {
+                LANE_VEC Result = LANE_MUL( A0, B[c] );
+                Result = LANE_FMADD( A1, B[4 + c], Result );
+                Result = LANE_FMADD( A2, B[8 + c], Result );
+                Result = LANE_FMADD( A3, B[12 + c], Result );
+                LANE_STORE( &pOut->m[4 * r + c][l], Result );
+            }
+        }
+    }
+}
+
+SDKMESH_TARGET( LANE_ISA )
+static void LANE_NAME( ComposeFrameLanes )( SDKMESH_MATRIX_LANES* pOut, const SDKMESH_KEY_LANES* pKeys,
+                                            const SDKMESH_MATRIX_LANES* pParent )
+{
+    const LANE_VEC Zero = LANE_SET1( 0.0f );
+    const LANE_VEC One = LANE_SET1( 1.0f );
+
+    for( UINT l = 0; l < SDKMESH_POSE_LANES; l += LANE_WIDTH )
+    {
+        LANE_VEC X = LANE_LOAD( &pKeys->Orientation[0][l] );
+        LANE_VEC Y = LANE_LOAD( &pKeys->Orientation[1][l] );
+        LANE_VEC Z = LANE_LOAD( &pKeys->Orientation[2][l] );
+        LANE_VEC W = LANE_LOAD( &pKeys->Orientation[3][l] );
+
+        // Normalize, taking an all zero quaternion as the identity
+        LANE_VEC LengthSq = LANE_MUL( X, X );
+        LengthSq = LANE_FMADD( Y, Y, LengthSq );
+        LengthSq = LANE_FMADD( Z, Z, LengthSq );
+        LengthSq = LANE_FMADD( W, W, LengthSq );
+        LANE_MASK Identity = LANE_ISZERO( LengthSq );
+        LANE_VEC InvLength = LANE_DIV( One, LANE_SQRT( LengthSq ) );
+        X = LANE_BLEND( Identity, LANE_MUL( X, InvLength ), Zero );
+        Y = LANE_BLEND( Identity, LANE_MUL( Y, InvLength ), Zero );
+        Z = LANE_BLEND( Identity, LANE_MUL( Z, InvLength ), Zero );
+        W = LANE_BLEND( Identity, LANE_MUL( W, InvLength ), One );
+
+        LANE_VEC X2 = LANE_ADD( X, X );
+        LANE_VEC Y2 = LANE_ADD( Y, Y );
+        LANE_VEC Z2 = LANE_ADD( Z, Z );
+        LANE_VEC XX = LANE_MUL( X, X2 );
+        LANE_VEC YY = LANE_MUL( Y, Y2 );
+        LANE_VEC ZZ = LANE_MUL( Z, Z2 );
+        LANE_VEC XY = LANE_MUL( X, Y2 );
+        LANE_VEC XZ = LANE_MUL( X, Z2 );
+        LANE_VEC YZ = LANE_MUL( Y, Z2 );
+        LANE_VEC WX = LANE_MUL( W, X2 );
+        LANE_VEC WY = LANE_MUL( W, Y2 );
+        LANE_VEC WZ = LANE_MUL( W, Z2 );
+
+        // The rotation, as D3DXMatrixRotationQuaternion lays it out
+        LANE_VEC R[9];
+        R[0] = LANE_SUB( LANE_SUB( One, YY ), ZZ );
+        R[1] = LANE_ADD( XY, WZ );
+        R[2] = LANE_SUB( XZ, WY );
+        R[3] = LANE_SUB( XY, WZ );
+        R[4] = LANE_SUB( LANE_SUB( One, XX ), ZZ );
+        R[5] = LANE_ADD( YZ, WX );
+        R[6] = LANE_ADD( XZ, WY );
+        R[7] = LANE_SUB( YZ, WX );
+        R[8] = LANE_SUB( LANE_SUB( One, XX ), YY );
+
+        // All of the parent is loaded before anything is stored, so pOut may alias it
+        LANE_VEC P[16];
+        for( UINT i = 0; i < 16; i++ )
+            P[i] = LANE_LOAD( &pParent->m[i][l] );
+
+        // Rows 0-2 rotate the parent's rows, row 3 translates along them
+        for( UINT r = 0; r < 3; r++ )
+        {
+            for( UINT c = 0; c < 4; c++ )
+            {
+                LANE_VEC Result = LANE_MUL( R[3 * r], P[c] );
+                Result = LANE_FMADD( R[3 * r + 1], P[4 + c], Result );
+                Result = LANE_FMADD( R[3 * r + 2], P[8 + c], Result );
+                LANE_STORE( &pOut->m[4 * r + c][l], Result );
+            }
+        }
+
+        LANE_VEC TX = LANE_LOAD( &pKeys->Translation[0][l] );
+        LANE_VEC TY = LANE_LOAD( &pKeys->Translation[1][l] );
+        LANE_VEC TZ = LANE_LOAD( &pKeys->Translation[2][l] );
+        for( UINT c = 0; c < 4; c++ )
+        {
+            LANE_VEC Result = LANE_FMADD( TX, P[c], P[12 + c] );
+            Result = LANE_FMADD( TY, P[4 + c], Result );
+            Result = LANE_FMADD( TZ, P[8 + c], Result );
+            LANE_STORE( &pOut->m[12 + c][l], Result );
+        }
+    }
+}
+
+#undef LANE_ISA
+#undef LANE_NAME
+#undef LANE_WIDTH
+#undef LANE_VEC
+#undef LANE_MASK
+#undef LANE_LOAD
+#undef LANE_STORE
+#undef LANE_SET1
+#undef LANE_ADD
+#undef LANE_SUB
+#undef LANE_MUL
+#undef LANE_DIV
+#undef LANE_FMADD
+#undef LANE_SQRT
+#undef LANE_ISZERO
+#undef LANE_BLEND
@@ -0,0 +1,106 @@
+/*!
+    \file FramePipeline.cpp
+
+    Implementation of FramePipeline.  See FramePipeline.h.
+*/
+#include "FramePipeline.h"
+
+FramePipeline::FramePipeline()
+    : muFrames( 0 )
+    , muRendered( 0 )
+    , muLatency( 1 )
+{
+    for( UINT uSlot = 0; uSlot < FRAME_PIPELINE_SLOTS; ++uSlot )
+    {
+        mhSlotSets[ uSlot ] = TASKSETHANDLE_INVALID;
+    }
+}
+
+VOID
+FramePipeline::SetLatency(
+    UINT                    uLatency )
+{
+    muLatency = uLatency > FRAME_PIPELINE_MAX_LATENCY ? FRAME_PIPELINE_MAX_LATENCY : uLatency;
+}
+
+UINT
+FramePipeline::BeginSimulation()
+{
+    UINT                    uSlot = muFrames % FRAME_PIPELINE_SLOTS;
+
+    //  The frame in the slot is at least FRAME_PIPELINE_SLOTS old, so it
+    //  has been rendered or skipped.
+    RetireSlot( uSlot );
+
+    ++muFrames;
+
+    return uSlot;
+}
+
+VOID
+FramePipeline::EndSimulation(
+    TASKSETHANDLE           hSet )
+{
+    mhSlotSets[ ( muFrames - 1 ) % FRAME_PIPELINE_SLOTS ] = hSet;
+}
+
+TASKSETHANDLE
+FramePipeline::GetLastSimulation()
+{
+    if( 0 == muFrames )
+    {
+        return TASKSETHANDLE_INVALID;
+    }
+
+    return mhSlotSets[ ( muFrames - 1 ) % FRAME_PIPELINE_SLOTS ];
+}
+
+UINT
+FramePipeline::BeginRender()
+{
+    UINT                    uFrame;
+
+    if( 0 == muFrames )
+    {
+        return FRAME_PIPELINE_NO_SLOT;
+    }
+
+    //
+    //  Render the frame muLatency frames behind the last one simulated, or
+    //  the first frame while the pipeline fills.  Never go back to a frame
+    //  older than the last one rendered when the latency is raised.
+    //
+    uFrame = muFrames - 1 > muLatency ? muFrames - 1 - muLatency : 0;
+
+    if( uFrame + 1 < muRendered )
+    {
+        uFrame = muRendered - 1;
+    }
+
+    muRendered = uFrame + 1;
+
+    RetireSlot( uFrame % FRAME_PIPELINE_SLOTS );
+
+    return uFrame % FRAME_PIPELINE_SLOTS;
+}
+
+VOID
+FramePipeline::Flush()
+{
+    for( UINT uSlot = 0; uSlot < FRAME_PIPELINE_SLOTS; ++uSlot )
+    {
+        RetireSlot( uSlot );
+    }
+}
+
+VOID
+FramePipeline::RetireSlot(
+    UINT                    uSlot )
+{
+    if( TASKSETHANDLE_INVALID != mhSlotSets[ uSlot ] )
+    {
+        gTaskMgr.WaitForSet( mhSlotSets[ uSlot ] );
+        gTaskMgr.ReleaseHandle( mhSlotSets[ uSlot ] );
+        mhSlotSets[ uSlot ] = TASKSETHANDLE_INVALID;
+    }
+}
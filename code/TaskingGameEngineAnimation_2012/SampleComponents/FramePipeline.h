@@ -0,0 +1,118 @@
+/*!
+    \file FramePipeline.h
+
+    FramePipeline lets the simulation of a frame run on the tasking system
+    while earlier frames are rendered.  The frame state the simulation writes
+    and the renderer reads is kept in FRAME_PIPELINE_SLOTS copies, one per
+    slot; frame N uses slot N % FRAME_PIPELINE_SLOTS.  Each frame:
+
+        UINT            uSlot = gPipeline.BeginSimulation();
+
+        //  Launch the taskset that writes slot uSlot.  Make it depend on
+        //  gPipeline.GetLastSimulation() if frames share simulation state.
+        gPipeline.EndSimulation( hSet );
+
+        ...
+
+        UINT            uRender = gPipeline.BeginRender();
+
+        //  Render from slot uRender.
+
+    With a latency of L frames, BeginRender returns the slot of the frame
+    simulated L frames ago and only waits for that frame, so the simulation
+    of the last L frames overlaps with rendering.  A latency of 0 renders the
+    frame just simulated, which waits for all of its simulation.
+
+    FramePipeline owns the taskset handles given to EndSimulation and
+    releases them once their frame has been rendered or skipped.  Call Flush
+    before the simulation state goes away.
+
+    Copyright 2010 Intel Corporation
+    All Rights Reserved
+
+    Permission is granted to use, copy, distribute and prepare derivative works of this
+    software for any purpose and without fee, provided, that the above copyright notice
+    and this statement appear in all copies.  Intel makes no representations about the
+    suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED ""AS IS.""
+    INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+    INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+    INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+    assume any responsibility for any errors which may appear in this software nor any
+    responsibility to update it.
+*/
+#pragma once
+
+#include "TaskMgrTBB.h"
+
+//
+//  Largest number of frames the simulation may run ahead of rendering.
+//
+#define FRAME_PIPELINE_MAX_LATENCY      2
+
+//
+//  Number of copies of the frame state.  A slot is reused only once the
+//  frame in it can no longer be rendered.
+//
+#define FRAME_PIPELINE_SLOTS            ( FRAME_PIPELINE_MAX_LATENCY + 1 )
+
+//
+//  Returned by BeginRender when no frame has been simulated yet.
+//
+#define FRAME_PIPELINE_NO_SLOT          0xFFFFFFFF
+
+class FramePipeline
+{
+public:
+    FramePipeline();
+
+    //  Sets the number of frames the simulation may run ahead of
+    //  rendering, clamped to FRAME_PIPELINE_MAX_LATENCY.
+    VOID
+        SetLatency( UINT uLatency );
+
+    UINT
+        GetLatency() { return muLatency; }
+
+    //  Starts a new frame.  Returns the slot its simulation writes.  Waits
+    //  for the frame that used the slot before, if it is still running.
+    UINT
+        BeginSimulation();
+
+    //  Hands the taskset simulating the frame started by BeginSimulation
+    //  to the pipeline, which releases it.  TASKSETHANDLE_INVALID if the
+    //  frame was simulated without tasks.
+    VOID
+        EndSimulation( TASKSETHANDLE hSet );
+
+    //  Returns the taskset of the last frame handed to EndSimulation, or
+    //  TASKSETHANDLE_INVALID if it has already completed and been released.
+    TASKSETHANDLE
+        GetLastSimulation();
+
+    //  Waits for the frame to render and returns its slot, or
+    //  FRAME_PIPELINE_NO_SLOT if no frame has been simulated yet.
+    UINT
+        BeginRender();
+
+    //  Waits for every frame in flight and releases its taskset.
+    VOID
+        Flush();
+
+private:
+
+    //  Waits for and releases the taskset of a slot.
+    VOID
+        RetireSlot( UINT uSlot );
+
+    //  Taskset simulating the frame in each slot.
+    TASKSETHANDLE                   mhSlotSets[ FRAME_PIPELINE_SLOTS ];
+
+    //  Frames started by BeginSimulation.
+    UINT                            muFrames;
+
+    //  Last frame returned by BeginRender, plus one.  0 if none.
+    UINT                            muRendered;
+
+    UINT                            muLatency;
+};
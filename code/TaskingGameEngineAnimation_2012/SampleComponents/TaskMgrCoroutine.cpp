@@ -0,0 +1,203 @@
+/*!
+    \file TaskMgrCoroutine.cpp
+
+    Implementation of the C++20 coroutine front-end for TaskMgrTbb.  See
+    TaskMgrCoroutine.h.
+*/
+#include "TaskMgrCoroutine.h"
+
+#ifdef TASKMGR_COROUTINES
+
+#include <mutex>
+#include <vector>
+
+//
+//  INTERNAL
+//  Coroutine frames are pooled in power of two size classes from 
+//  COROUTINE_FRAME_POOL_MIN_SIZE to COROUTINE_FRAME_POOL_MAX_SIZE.  Freed 
+//  frames are kept for reuse until the process exits, when the pools 
+//  release them.
+//
+#define COROUTINE_FRAME_POOL_MIN_SIZE   64
+#define COROUTINE_FRAME_POOL_CLASSES    7
+
+#if COROUTINE_FRAME_POOL_MIN_SIZE << ( COROUTINE_FRAME_POOL_CLASSES - 1 ) != COROUTINE_FRAME_POOL_MAX_SIZE
+#error COROUTINE_FRAME_POOL_CLASSES does not match COROUTINE_FRAME_POOL_MAX_SIZE
+#endif
+
+struct CoroutineFramePool
+{
+    ~CoroutineFramePool()
+    {
+        for( size_t uFrame = 0; uFrame < mFree.size(); ++uFrame )
+        {
+            ::operator delete( mFree[ uFrame ] );
+        }
+    }
+
+    std::mutex                  mLock;
+    std::vector< VOID* >        mFree;
+};
+
+static CoroutineFramePool       gFramePools[ COROUTINE_FRAME_POOL_CLASSES ];
+
+//
+//  INTERNAL
+//  Returns the size class for a frame size.
+//
+static UINT
+GetFrameClass(
+    size_t                      uSize )
+{
+    UINT                        uClass = 0;
+    size_t                      uClassSize = COROUTINE_FRAME_POOL_MIN_SIZE;
+
+    while( uClassSize < uSize )
+    {
+        uClassSize <<= 1;
+        ++uClass;
+    }
+
+    return uClass;
+}
+
+VOID*
+AllocateCoroutineFrame(
+    size_t                      uSize )
+{
+    if( uSize > COROUTINE_FRAME_POOL_MAX_SIZE )
+    {
+        return ::operator new( uSize );
+    }
+
+    UINT                        uClass = GetFrameClass( uSize );
+    CoroutineFramePool&         Pool = gFramePools[ uClass ];
+
+    {
+        std::lock_guard< std::mutex > Lock( Pool.mLock );
+
+        if( !Pool.mFree.empty() )
+        {
+            VOID*               pFrame = Pool.mFree.back();
+
+            Pool.mFree.pop_back();
+            return pFrame;
+        }
+    }
+
+    return ::operator new( (size_t)COROUTINE_FRAME_POOL_MIN_SIZE << uClass );
+}
+
+VOID
+FreeCoroutineFrame(
+    VOID*                       pFrame,
+    size_t                      uSize )
+{
+    if( uSize > COROUTINE_FRAME_POOL_MAX_SIZE )
+    {
+        ::operator delete( pFrame );
+        return;
+    }
+
+    CoroutineFramePool&         Pool = gFramePools[ GetFrameClass( uSize ) ];
+    std::lock_guard< std::mutex > Lock( Pool.mLock );
+
+    Pool.mFree.push_back( pFrame );
+}
+
+//
+//  INTERNAL
+//  Taskset callback that resumes the coroutine passed as its argument.
+//
+static VOID
+ResumeCoroutine(
+    VOID*                       pvCoroutine,
+    INT                         iContextId,
+    UINT                        uTask,
+    UINT                        uTaskCount )
+{
+    UNREFERENCED_PARAMETER( iContextId );
+    UNREFERENCED_PARAMETER( uTask );
+    UNREFERENCED_PARAMETER( uTaskCount );
+
+    std::coroutine_handle<>::from_address( pvCoroutine ).resume();
+}
+
+BOOL
+TaskMgrCoroutine::Launch(
+    TASKSETHANDLE*              pDepends,
+    UINT                        uDepends,
+    OPTIONAL LPCSTR             szSetName,
+    OUT TASKSETHANDLE*          pOutHandle )
+{
+    promise_type&               Promise = mhCoroutine.promise();
+    TASKSETHANDLE               hStart;
+
+    if( !gTaskMgr.CreateSignalSet( szSetName, &Promise.mhDone ) )
+    {
+        return FALSE;
+    }
+
+    *pOutHandle = Promise.mhDone;
+
+    //
+    //  The coroutine may run to completion and free its frame before 
+    //  CreateTaskSet returns; nothing in the frame is touched after this.
+    //
+    if( !gTaskMgr.CreateTaskSet(
+        ResumeCoroutine,
+        mhCoroutine.address(),
+        1,
+        pDepends,
+        uDepends,
+        szSetName,
+        &hStart ) )
+    {
+        gTaskMgr.SignalSet( *pOutHandle );
+        gTaskMgr.ReleaseHandle( *pOutHandle );
+        *pOutHandle = TASKSETHANDLE_INVALID;
+
+        return FALSE;
+    }
+
+    gTaskMgr.ReleaseHandle( hStart );
+
+    //  The tasking system owns the coroutine now.
+    mhCoroutine = NULL;
+
+    return TRUE;
+}
+
+bool
+TaskSetAwaiter::await_suspend(
+    std::coroutine_handle<>     hCoroutine )
+{
+    TASKSETHANDLE               hResume;
+
+    if( !gTaskMgr.CreateTaskSet(
+        ResumeCoroutine,
+        hCoroutine.address(),
+        1,
+        mphSets ? mphSets : &mhSet,
+        muSets,
+        "Resume Coroutine",
+        &hResume ) )
+    {
+        //  The coroutine must not see unfinished results, so wait here.
+        //  Stale handles belong to sets that have already completed.
+        TASKSETHANDLE*          phSets = mphSets ? mphSets : &mhSet;
+
+        for( UINT uSet = 0; uSet < muSets; ++uSet )
+        {
+            gTaskMgr.WaitForSet( phSets[ uSet ] );
+        }
+
+        return false;
+    }
+
+    gTaskMgr.ReleaseHandle( hResume );
+
+    return true;
+}
+
+#endif // TASKMGR_COROUTINES
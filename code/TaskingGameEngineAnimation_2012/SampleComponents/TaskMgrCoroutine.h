@@ -0,0 +1,210 @@
+/*!
+    \file TaskMgrCoroutine.h
+
+    C++20 coroutine front-end for TaskMgrTbb.  A function returning
+    TaskMgrCoroutine can co_await tasksets instead of blocking in
+    WaitForSet, so a multi-stage pipeline is written as straight-line code:
+
+        TaskMgrCoroutine
+        AnimateFrame( double dTime )
+        {
+            TASKSETHANDLE   hSkin;
+
+            gTaskMgr.ParallelFor( Pose, &dTime, 0, guModels,
+                PARALLELFOR_GRAIN_AUTO, NULL, 0, "Pose", &hSkin );
+            co_await AwaitTaskSet( hSkin );
+            gTaskMgr.ReleaseHandle( hSkin );
+
+            //  ... next stage, on whichever worker completed the last task.
+        }
+
+        AnimateFrame( dTime ).Launch( NULL, 0, "Animate Frame", &hFrame );
+
+    Awaiting a taskset never blocks a thread: the coroutine is suspended and
+    a one-task taskset that depends on the awaited sets resumes it.  A
+    launched coroutine is represented by a signal set (see
+    TaskMgrTbb::CreateSignalSet) that completes when the coroutine returns,
+    so other tasksets can depend on it and the main thread can wait on it.
+
+    Coroutine frames are allocated from a pool owned by the tasking system,
+    so launching a coroutine a frame does not go to the heap in steady
+    state.
+
+    The front-end is only compiled if the compiler supports C++20
+    coroutines; TASKMGR_COROUTINES is defined if it is available.
+*/
+#pragma once
+
+#include "TaskMgrTBB.h"
+
+#if defined( __cpp_impl_coroutine ) && __cpp_impl_coroutine >= 201902L
+#define TASKMGR_COROUTINES
+#endif
+
+#ifdef TASKMGR_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <stddef.h>
+
+//  Frames larger than this are allocated from the heap instead of the pool.
+#define COROUTINE_FRAME_POOL_MAX_SIZE   4096
+
+//
+//  Allocate and free coroutine frames from the tasking system's pool.
+//
+VOID*
+AllocateCoroutineFrame( size_t uSize );
+
+VOID
+FreeCoroutineFrame( VOID* pFrame, size_t uSize );
+
+/*! Return type of a coroutine run by TaskMgrTbb.  The coroutine does not
+    start until Launch is called.  A TaskMgrCoroutine that is never
+    launched destroys the coroutine.
+*/
+class TaskMgrCoroutine
+{
+public:
+
+    struct promise_type
+    {
+        promise_type()
+            : mhDone( TASKSETHANDLE_INVALID )
+        {}
+
+        TaskMgrCoroutine
+        get_return_object()
+        {
+            return TaskMgrCoroutine(
+                std::coroutine_handle< promise_type >::from_promise( *this ) );
+        }
+
+        std::suspend_always
+        initial_suspend() noexcept { return std::suspend_always(); }
+
+        //  The frame is destroyed as soon as the coroutine returns.
+        std::suspend_never
+        final_suspend() noexcept { return std::suspend_never(); }
+
+        VOID
+        return_void()
+        {
+            gTaskMgr.SignalSet( mhDone );
+        }
+
+        VOID
+        unhandled_exception()
+        {
+            //  Tasks have no way to report an exception.
+            std::terminate();
+        }
+
+        static VOID*
+        operator new( size_t uSize )
+        {
+            return AllocateCoroutineFrame( uSize );
+        }
+
+        static VOID
+        operator delete( VOID* pFrame, size_t uSize )
+        {
+            FreeCoroutineFrame( pFrame, uSize );
+        }
+
+        //  Signal set completed when the coroutine returns.
+        TASKSETHANDLE               mhDone;
+    };
+
+    TaskMgrCoroutine( TaskMgrCoroutine&& Other )
+        : mhCoroutine( Other.mhCoroutine )
+    {
+        Other.mhCoroutine = NULL;
+    }
+
+    ~TaskMgrCoroutine()
+    {
+        if( mhCoroutine )
+        {
+            mhCoroutine.destroy();
+        }
+    }
+
+    //  Schedules the coroutine to start once the tasksets in pDepends
+    //  complete.  pOutHandle receives a taskset that completes when the
+    //  coroutine returns; the caller must release it.  The coroutine is
+    //  owned by the tasking system from here on.
+    BOOL
+    Launch(
+        TASKSETHANDLE*              pDepends,
+        UINT                        uDepends,
+        OPTIONAL LPCSTR             szSetName,
+        OUT TASKSETHANDLE*          pOutHandle );
+
+private:
+
+    explicit TaskMgrCoroutine( std::coroutine_handle< promise_type > hCoroutine )
+        : mhCoroutine( hCoroutine )
+    {}
+
+    TaskMgrCoroutine( const TaskMgrCoroutine& );
+    TaskMgrCoroutine& operator=( const TaskMgrCoroutine& );
+
+    std::coroutine_handle< promise_type >   mhCoroutine;
+};
+
+/*! Awaitable returned by AwaitTaskSet and AwaitTaskSets.  The awaiting
+    coroutine is resumed on a worker once every taskset has completed.
+    The caller keeps ownership of the handles.
+*/
+class TaskSetAwaiter
+{
+public:
+    TaskSetAwaiter( TASKSETHANDLE* phSets, UINT uSets )
+        : mphSets( phSets )
+        , muSets( uSets )
+    {}
+
+    bool
+    await_ready() const { return 0 == muSets; }
+
+    //  If the resume taskset could not be created, waits for the tasksets
+    //  on this thread instead and returns false, resuming the coroutine
+    //  once they have completed.
+    bool
+    await_suspend( std::coroutine_handle<> hCoroutine );
+
+    VOID
+    await_resume() const {}
+
+private:
+
+    TASKSETHANDLE*                  mphSets;
+    UINT                            muSets;
+
+    //  Storage for AwaitTaskSet's single handle.
+    TASKSETHANDLE                   mhSet;
+
+    friend TaskSetAwaiter AwaitTaskSet( TASKSETHANDLE );
+};
+
+inline TaskSetAwaiter
+AwaitTaskSet(
+    TASKSETHANDLE                   hSet )
+{
+    TaskSetAwaiter                  Awaiter( NULL, 1 );
+
+    Awaiter.mhSet = hSet;
+
+    return Awaiter;
+}
+
+inline TaskSetAwaiter
+AwaitTaskSets(
+    TASKSETHANDLE*                  phSets,
+    UINT                            uSets )
+{
+    return TaskSetAwaiter( phSets, uSets );
+}
+
+#endif // TASKMGR_COROUTINES
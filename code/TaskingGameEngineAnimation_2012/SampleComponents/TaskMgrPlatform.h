@@ -0,0 +1,323 @@
+/*!
+    \file TaskMgrPlatform.h
+
+    Platform layer for TaskMgrTbb.  On Windows this pulls in the Win32 types
+    the TaskMgrTbb interface is written against.  On other platforms it
+    provides equivalent typedefs so the interface and the portable scheduler
+    (see TaskScheduler.h) compile unchanged.
+
+    The scheduler backend is selected at build time:
+
+    TASKMGR_SCHEDULER_PORTABLE  TaskMgrTbb runs on the std::thread work-stealing
+                                scheduler in TaskScheduler.cpp.  Always used on
+                                platforms other than Windows.
+
+    (default on Windows)        TaskMgrTbb runs on the bundled TBB binaries
+                                (TBBGraphicsSamples.lib).
+
+    TASKMGR_SCHEDULER_FIBERS    The portable scheduler runs tasks on fibers so 
+                                a task waiting on a taskset suspends instead of
+                                blocking its worker thread.  Implies 
+                                TASKMGR_SCHEDULER_PORTABLE.
+
+    The Atomic* helpers wrap the few interlocked operations the taskset
+    bookkeeping needs: the MSVC interlocked intrinsics on Windows and the
+    GCC/Clang __atomic builtins elsewhere.  All of them are full barriers,
+    which matches the Win32 semantics the TaskMgrTbb code was written for.
+*/
+#pragma once
+
+#if !defined( _WIN32 ) && !defined( TASKMGR_SCHEDULER_PORTABLE )
+#define TASKMGR_SCHEDULER_PORTABLE
+#endif
+
+#if defined( TASKMGR_SCHEDULER_FIBERS ) && !defined( TASKMGR_SCHEDULER_PORTABLE )
+#define TASKMGR_SCHEDULER_PORTABLE
+#endif
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#pragma warning ( push )
+#pragma warning ( disable : 4995 ) // skip deprecated warning on intrinsics.
+#include <intrin.h>
+#pragma warning ( pop )
+
+#else
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VOID                            void
+#define TRUE                            1
+#define FALSE                           0
+#define OPTIONAL
+#define IN
+#define OUT
+#define UNREFERENCED_PARAMETER( P )     (void)( P )
+#define ARRAYSIZE( A )                  ( sizeof( A ) / sizeof( ( A )[ 0 ] ) )
+
+typedef int                             BOOL;
+typedef char                            CHAR;
+typedef unsigned char                   BYTE;
+typedef int                             INT;
+typedef unsigned int                    UINT;
+typedef int32_t                         LONG;
+typedef uint32_t                        DWORD;
+typedef int64_t                         INT64;
+typedef uint64_t                        UINT64;
+typedef float                           FLOAT;
+typedef double                          DOUBLE;
+typedef const char*                     LPCSTR;
+
+#endif // _WIN32
+
+//
+//  Size of a cache line.  Counters written by many threads are padded
+//  apart by this much.
+//
+#define TASKMGR_CACHE_LINE_SIZE         64
+
+//
+//  Storage class for plain-old-data thread-local variables.
+//
+#ifdef _MSC_VER
+#define TASKMGR_THREAD_LOCAL            __declspec( thread )
+#else
+#define TASKMGR_THREAD_LOCAL            __thread
+#endif
+
+//
+//  Reads a value written by another thread with acquire semantics.
+//
+inline LONG
+AtomicLoad( volatile LONG* plValue )
+{
+#ifdef _MSC_VER
+    //  MSVC gives volatile reads acquire semantics.
+    return *plValue;
+#else
+    return __atomic_load_n( plValue, __ATOMIC_ACQUIRE );
+#endif
+}
+
+//
+//  64 bit version of AtomicLoad.  The 32 bit MSVC read can tear; callers 
+//  validate the value with AtomicCompareExchange64.
+//
+inline INT64
+AtomicLoad64( volatile INT64* pllValue )
+{
+#ifdef _MSC_VER
+    return *pllValue;
+#else
+    return __atomic_load_n( pllValue, __ATOMIC_ACQUIRE );
+#endif
+}
+
+//
+//  Pointer version of AtomicLoad.
+//
+inline VOID*
+AtomicLoadPointer( VOID* volatile* ppValue )
+{
+#ifdef _MSC_VER
+    return *ppValue;
+#else
+    return __atomic_load_n( ppValue, __ATOMIC_ACQUIRE );
+#endif
+}
+
+//
+//  Writes a value read by other threads with release semantics.
+//
+inline VOID
+AtomicStore( volatile LONG* plValue, LONG lValue )
+{
+#ifdef _MSC_VER
+    //  MSVC gives volatile writes release semantics.
+    *plValue = lValue;
+#else
+    __atomic_store_n( plValue, lValue, __ATOMIC_RELEASE );
+#endif
+}
+
+//
+//  Adds to a 64 bit counter that only the calling thread writes.  Other 
+//  threads may read it with AtomicLoad64 at any time; with a single writer
+//  no interlocked operation is needed.
+//
+inline VOID
+AtomicCounterAdd64( volatile INT64* pllValue, INT64 llAdd )
+{
+#ifdef _MSC_VER
+    *pllValue += llAdd;
+#else
+    __atomic_store_n( pllValue, __atomic_load_n( pllValue, __ATOMIC_RELAXED ) + llAdd, __ATOMIC_RELAXED );
+#endif
+}
+
+//
+//  Returns the incremented value.
+//
+inline LONG
+AtomicIncrement( volatile LONG* plValue )
+{
+#ifdef _MSC_VER
+    return _InterlockedIncrement( plValue );
+#else
+    return __atomic_add_fetch( plValue, 1, __ATOMIC_SEQ_CST );
+#endif
+}
+
+//
+//  Returns the decremented value.
+//
+inline LONG
+AtomicDecrement( volatile LONG* plValue )
+{
+#ifdef _MSC_VER
+    return _InterlockedDecrement( plValue );
+#else
+    return __atomic_sub_fetch( plValue, 1, __ATOMIC_SEQ_CST );
+#endif
+}
+
+//
+//  Returns the value before the add.
+//
+inline LONG
+AtomicExchangeAdd( volatile LONG* plValue, LONG lAdd )
+{
+#ifdef _MSC_VER
+    return _InterlockedExchangeAdd( plValue, lAdd );
+#else
+    return __atomic_fetch_add( plValue, lAdd, __ATOMIC_SEQ_CST );
+#endif
+}
+
+//
+//  Returns the value before the compare.  The exchange happened if the
+//  return value equals lComparand.
+//
+inline LONG
+AtomicCompareExchange( volatile LONG* plDest, LONG lExchange, LONG lComparand )
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange( plDest, lExchange, lComparand );
+#else
+    __atomic_compare_exchange_n( plDest, &lComparand, lExchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+    return lComparand;
+#endif
+}
+
+//
+//  64 bit version of AtomicCompareExchange.
+//
+inline INT64
+AtomicCompareExchange64( volatile INT64* pllDest, INT64 llExchange, INT64 llComparand )
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange64( pllDest, llExchange, llComparand );
+#else
+    __atomic_compare_exchange_n( pllDest, &llComparand, llExchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+    return llComparand;
+#endif
+}
+
+//
+//  Pointer versions of AtomicCompareExchange and an atomic exchange that
+//  returns the previous value.
+//
+inline VOID*
+AtomicCompareExchangePointer( VOID* volatile* ppDest, VOID* pExchange, VOID* pComparand )
+{
+#if defined( _MSC_VER ) && defined( _WIN64 )
+    return _InterlockedCompareExchangePointer( ppDest, pExchange, pComparand );
+#elif defined( _MSC_VER )
+    return (VOID*)_InterlockedCompareExchange( (volatile LONG*)ppDest, (LONG)pExchange, (LONG)pComparand );
+#else
+    __atomic_compare_exchange_n( ppDest, &pComparand, pExchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+    return pComparand;
+#endif
+}
+
+inline VOID*
+AtomicExchangePointer( VOID* volatile* ppDest, VOID* pExchange )
+{
+#if defined( _MSC_VER ) && defined( _WIN64 )
+    return _InterlockedExchangePointer( ppDest, pExchange );
+#elif defined( _MSC_VER )
+    return (VOID*)_InterlockedExchange( (volatile LONG*)ppDest, (LONG)pExchange );
+#else
+    return __atomic_exchange_n( ppDest, pExchange, __ATOMIC_SEQ_CST );
+#endif
+}
+
+//
+//  Hint to the CPU that the caller is in a spin-wait loop.
+//
+inline VOID
+CpuPause()
+{
+#if defined( _MSC_VER )
+    _mm_pause();
+#elif defined( __i386__ ) || defined( __x86_64__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ ) || defined( __arm__ )
+    __asm__ __volatile__( "yield" );
+#endif
+}
+
+//
+//  Gives up the rest of the calling thread's time slice.
+//
+inline VOID
+YieldThread()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+//
+//  Backoff for spin-waits that are expected to be short.  Each call to 
+//  Pause spins twice as many CpuPause instructions as the last, up to
+//  SPIN_BACKOFF_MAX_PAUSES, and from then on yields the thread so a waiter
+//  that turns out to be long does not hold on to a core.
+//
+#define SPIN_BACKOFF_MAX_PAUSES         64
+
+class SpinBackoff
+{
+public:
+    SpinBackoff()
+        : muPauses( 1 )
+    {}
+
+    VOID
+    Pause()
+    {
+        if( muPauses <= SPIN_BACKOFF_MAX_PAUSES )
+        {
+            for( UINT uPause = 0; uPause < muPauses; ++uPause )
+            {
+                CpuPause();
+            }
+
+            muPauses <<= 1;
+        }
+        else
+        {
+            YieldThread();
+        }
+    }
+
+private:
+
+    UINT                                muPauses;
+};
@@ -26,6 +26,25 @@
 
 */
 #include "TaskMgrTBB.h"
+#include "TaskMgrTrace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+
+#include "TaskScheduler.h"
+
+typedef SchedulerTask           task;
+
+#if TASKSET_PRIORITY_COUNT != TASKSCHEDULER_PRIORITY_COUNT
+#error TASKSET_PRIORITY_COUNT must match TASKSCHEDULER_PRIORITY_COUNT
+#endif
+
+#else
 
 //  TBB includes
 #include <tbb_stddef.h>
@@ -34,56 +53,44 @@
 #include <task_scheduler_init.h>
 #include <task_scheduler_observer.h>
 
-#include <strsafe.h>
-
-#pragma warning ( push )
-#pragma warning ( disable : 4995 ) // skip deprecated warning on intrinsics.
-#include <intrin.h>
-#pragma warning ( pop )
+#include "TaskMgrTopology.h"
 
 using namespace tbb_graphics_samples;
 
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+#ifdef _WIN32
+#include <windows.h>
+#include <strsafe.h>
+#else
+#include <chrono>
+#endif
+
 //
 //  Global TBB task mananger instance
 //
 TaskMgrTbb                      gTaskMgr;
 
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+
+//
+//  Global portable scheduler instance.  Started and stopped by
+//  TaskMgrTbb::Init and TaskMgrTbb::Shutdown.
+//
+TaskScheduler                   gScheduler;
+
 //
 //  INTERNAL
-//  The SpinLock class implements a simple spinlock using InterlockedCompareExchange.
-//  The lock is primarly used by the successor list for quick locking at the cost of
-//  spinning in the cases of contention.
+//  Returns the context id of the calling thread.  The portable scheduler
+//  assigns zero to n-1 ids itself when it creates its threads.
 //
-class SpinLock
+inline INT
+GetContextId()
 {
-public:
-    SpinLock()
-        : muLock( 0 ) 
-    {}
-
-    ~SpinLock()
-    {}
-
-    VOID
-    Lock()
-    {
-        while( _InterlockedCompareExchange(
-            (LONG*)&muLock,
-            1,
-            0 ) == 1 )
-        {}
-    }
-
-    VOID
-    Unlock()
-    {
-        muLock = 0;
-    }
-
-private:
+    return TaskScheduler::GetContextId();
+}
 
-    volatile UINT               muLock;
-};
+#else
 
 //
 //  Global counter to count whenever a thread registers with
@@ -94,6 +101,10 @@ private:
 atomic<INT>                gContextIdCount;
 enumerable_thread_specific<INT> gContextId;
 
+//  TRUE on threads TbbContextId gave an id of their own.  Other threads 
+//  read context 0 from gContextId and share it with its owner.
+static TASKMGR_THREAD_LOCAL BOOL    tlsOwnsContextId;
+
 //
 //  INTERNAL
 //  The TbbContextId class is an internal implemetation of the
@@ -103,6 +114,10 @@ enumerable_thread_specific<INT> gContextId;
 //  be used by tasks in the tasking system to access thread-local data
 //  in an efficient mannor.
 //
+//  If pinning is enabled each thread is also pinned to the processor of 
+//  its context (see TaskMgrTopology.h).  tbb picks which thread steals
+//  from which, so only the placement follows the topology.
+//
 class TbbContextId : public task_scheduler_observer
 {
     void 
@@ -110,477 +125,3606 @@ class TbbContextId : public task_scheduler_observer
     {
         INT iContext = gContextIdCount.fetch_and_increment();
         gContextId.local() = iContext;
+        tlsOwnsContextId = TRUE;
+
+        if( mbPinThreads )
+        {
+            mTopology.PinThread( (UINT)iContext );
+        }
     }
 
+    TaskMgrTopology         mTopology;
+    BOOL                    mbPinThreads;
+
 public:
-    TbbContextId()
+    TbbContextId( BOOL bPinThreads )
+        : mbPinThreads( bPinThreads )
     {
         gContextIdCount = 0;
+
+        if( mbPinThreads && !mTopology.Discover() )
+        {
+            printf( "Processor topology unavailable; threads are not pinned.\n" );
+            mbPinThreads = FALSE;
+        }
+
         observe( true );
     }
 };
 
 //
 //  INTERNAL
-//  GenericTask is the wrapper class for individual tbb tasks.  Tasks
-//  in TBB are the basic scheduling units.  The class contains all the
-//  information needed for the callback.  It also contains a pointer 
-//  to the parent tbb task. The parent task (TaskSetTbb defined below)
-//  is referenced by GenericTask in order to report completion of the 
-//  each GenericTask in the set.
+//  Returns the context id of the calling thread.
 //
-class GenericTask : public task
+inline INT
+GetContextId()
 {
-public:
-    GenericTask()
-    : mpFunc( 0 )
-    , mpvArg( 0 )
-    , muIdx( 0 )
-    , muSize( 0 )
-    , mpszSetName( NULL )
-    , mhTaskSet( TASKSETHANDLE_INVALID )
-    {
-    };
-
-    GenericTask( 
-        TASKSETFUNC         pFunc,
-        void*               pvArg,
-        UINT                uIdx,
-        UINT                uSize,
-        CHAR*               pszSetName,
-        TASKSETHANDLE       hSet ) 
-    : mpFunc( pFunc )
-    , mpvArg( pvArg )
-    , muIdx( uIdx )
-    , muSize( uSize )
-    , mpszSetName( pszSetName )
-    , mhTaskSet( hSet )
-    {
-    };
-
-    //  execute will call the app-defined task callback with the 
-    //  proper parameters
-    task* execute()
-    {
-        ProfileBeginTask( mpszSetName );
-
-        mpFunc( mpvArg, gContextId.local(), muIdx, muSize );
+    return gContextId.local();
+}
 
-        ProfileEndTask();
+#endif // TASKMGR_SCHEDULER_PORTABLE
 
-        //  Notify the taskmgr that this set completed one of its tasks.
-        gTaskMgr.CompleteTaskSet( mhTaskSet );
+//
+//  INTERNAL
+//  High resolution timer used to measure ParallelFor ranges and to collect
+//  the statistics returned by TaskMgrTbb::GetStats.
+//
+inline INT64
+GetTimerTicks()
+{
+#ifdef _WIN32
+    LARGE_INTEGER           llTicks;
 
-        return NULL;
-    }
+    QueryPerformanceCounter( &llTicks );
+    return llTicks.QuadPart;
+#else
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( 
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
 
-private:
+inline INT64
+GetTimerFrequency()
+{
+#ifdef _WIN32
+    LARGE_INTEGER           llFrequency;
 
-    TASKSETFUNC             mpFunc;
-    void*                   mpvArg;
-    UINT                    muIdx;
-    UINT                    muSize;
-    CHAR*                   mpszSetName;
+    QueryPerformanceFrequency( &llFrequency );
+    return llFrequency.QuadPart;
+#else
+    return 1000000000;
+#endif
+}
 
-    TASKSETHANDLE           mhTaskSet;
+//
+//  INTERNAL
+//  Statistics TaskMgrTbb collects itself, one per context.  Only the 
+//  context writes its entry, with AtomicCounterAdd64; TaskMgrTbb::GetStats
+//  reads them from any thread.
+//
+struct ContextStats
+{
+    volatile INT64          mllTasks;
+    volatile INT64          mllRunTicks;
+    volatile INT64          mllStartLatency[ TASKMGR_HISTOGRAM_BUCKETS ];
+    volatile INT64          mllRunLatency[ TASKMGR_HISTOGRAM_BUCKETS ];
+    CHAR                    mPad[ TASKMGR_CACHE_LINE_SIZE ];
 };
 
+static ContextStats*            gpContextStats;
+static UINT                     guContextStatsCount;
+static DOUBLE                   gdNanosecondsPerTick;
+
 //
 //  INTERNAL
-//  TaskSetTbb is the base tbb task that owns both spawning and tracking
-//  the taskset.  It owns the completion count and the successor array.
-//  TaskSetTbb will spawn GerericTask instances for each callback the 
-//  Application requeseted in TaskMgrTbb::CreateTaskSet.
+//  Returns the statistics of the calling context, or NULL on threads that
+//  are not scheduler contexts.  Under TBB that includes threads that only
+//  share context 0, since the entry must have a single writer.
 //
-class TaskSetTbb : public task
+static ContextStats*
+GetContextStats()
 {
-public:
-    TaskSetTbb() 
-    : mpFunc( NULL )
-    , mpvArg( 0 )
-    , muSize( 0 )
-    , mhTaskset( TASKSETHANDLE_INVALID )
-    , mbHasBeenWaitedOn( FALSE )
-    {
-        mszSetName[ 0 ] = 0;
-        memset( Successors, 0, sizeof( Successors ) ) ;
-    };
+    INT                     iContext = GetContextId();
 
-    task* execute()
+#ifndef TASKMGR_SCHEDULER_PORTABLE
+    if( !tlsOwnsContextId )
     {
-        //  set the tbb reference count for this TaskSetTbb to
-        //  one plus the task set count
-        set_ref_count( muSize + 1 );
-
-        //  Iterate for each task in the set and spawn a GenericTask
-        for( UINT uIdx = 0; uIdx < muSize; ++uIdx )
-        {
-            spawn( *new( allocate_child() ) GenericTask( 
-                mpFunc, 
-                mpvArg,
-                uIdx, 
-                muSize,
-                mszSetName,
-                mhTaskset ) );
-        }
+        return NULL;
+    }
+#endif // TASKMGR_SCHEDULER_PORTABLE
 
+    if( iContext < 0 || (UINT)iContext >= guContextStatsCount )
+    {
         return NULL;
     }
 
-    
-    TaskSetTbb*             Successors[ MAX_SUCCESSORS ];
-    TASKSETHANDLE           mhTaskset;
-    BOOL                    mbHasBeenWaitedOn;
+    return &gpContextStats[ iContext ];
+}
 
-    TASKSETFUNC             mpFunc;
-    void*                   mpvArg;
+//
+//  INTERNAL
+//  Returns the histogram bucket of a value in nanoseconds.  See 
+//  TASKMGR_HISTOGRAM_SUB_BUCKETS.
+//
+static UINT
+GetHistogramBucket(
+    UINT64                  ullNanoseconds )
+{
+    UINT                    uShift = 0;
+    UINT                    uBucket;
 
-    volatile UINT           muStartCount;
-    volatile UINT           muCompletionCount;
-    volatile UINT           muRefCount;
-    
-    UINT                    muSize;    
-    SpinLock                mSuccessorsLock;
+    while( ( ullNanoseconds >> uShift ) >= 2 * TASKMGR_HISTOGRAM_SUB_BUCKETS )
+    {
+        ++uShift;
+    }
 
+    uBucket = uShift * TASKMGR_HISTOGRAM_SUB_BUCKETS + (UINT)( ullNanoseconds >> uShift );
 
-    CHAR                    mszSetName[ MAX_TASKSETNAMELENGTH ];
-};
+    return uBucket < TASKMGR_HISTOGRAM_BUCKETS ? uBucket : TASKMGR_HISTOGRAM_BUCKETS - 1;
+}
 
-///////////////////////////////////////////////////////////////////////////////
 //
-//  Implementation of TaskMgrTbb
+//  INTERNAL
+//  Adds a latency in timer ticks to a histogram of the calling context.
 //
-///////////////////////////////////////////////////////////////////////////////
-
-TaskMgrTbb::TaskMgrTbb()
-    : mpTbbContextId( NULL )
-    , mpTbbInit( NULL )
-    , miDemoModeTBBThreadCountOverride( task_scheduler_init::automatic )
+static VOID
+RecordLatency(
+    volatile INT64*         pllBuckets,
+    INT64                   llTicks )
 {
-    memset(
-        mSets,
-        0x0,
-        sizeof( mSets ) );
-}
+    UINT64                  ullNanoseconds = llTicks > 0 ? (UINT64)( (DOUBLE)llTicks * gdNanosecondsPerTick ) : 0;
 
-TaskMgrTbb::~TaskMgrTbb()
-{
+    AtomicCounterAdd64( &pllBuckets[ GetHistogramBucket( ullNanoseconds ) ], 1 );
 }
 
-BOOL
-TaskMgrTbb::Init()
-{
-    mpTbbContextId = new TbbContextId();
-
-    mpTbbInit = new task_scheduler_init( miDemoModeTBBThreadCountOverride );
+//
+//  INTERNAL
+//  Schedule recording and replay state; see TaskMgrTbb::BeginRecording.
+//  glScheduleMode is SCHEDULE_NORMAL unless a recording or replay is in
+//  progress, so the normal path only pays for reading it once per range.
+//
+#define SCHEDULE_NORMAL         0
+#define SCHEDULE_RECORD         1
+#define SCHEDULE_REPLAY         2
 
-    //  Reset thread override demo variable.
-    miDemoModeTBBThreadCountOverride = -1;
+//  Passes a thread waiting on a replay makes without it moving on, while 
+//  tasks are held back, before the recorded tasksets are taken to be 
+//  missing and the replay is ended.
+#define REPLAY_STALL_PASSES     100000
 
-    return TRUE;
-}
+//  File format of a recording: a ScheduleFileHeader followed by its 
+//  events.
+#define SCHEDULE_FILE_MAGIC     0x52534D54      //  "TMSR"
+#define SCHEDULE_FILE_VERSION   2
 
-VOID
-TaskMgrTbb::Shutdown()
+struct ScheduleFileHeader
 {
-    //  
-    //  Release any left-over tasksets
-    for( UINT uSet = 0; uSet < MAX_TASKSETS; ++uSet )
-    {
-        if( mSets[ uSet ] )
-        {
-            WaitForSet( uSet );   
+    UINT                    muMagic;
+    UINT                    muVersion;
+    UINT                    muEvents;
+    UINT                    muContexts;
+    UINT                    muFuzzSeed;
+};
 
-            mSets[ uSet ]->set_ref_count( 0 );
-            mSets[ uSet ]->destroy( *mSets[ uSet ] );
-            mSets[ uSet ] = NULL;
-        }
-    }
-    
-    delete mpTbbInit;
-    delete mpTbbContextId;
-}
+//  A task start: which task of which taskset, on which context.
+struct ScheduleEvent
+{
+    UINT64                  mullOrdinal;
+    UINT                    muTask;
+    INT                     miContext;
+};
 
-BOOL
-TaskMgrTbb::CreateTaskSet(
-    TASKSETFUNC             pFunc,
-    VOID*                   pArg,
-    UINT                    uTaskCount,
-    TASKSETHANDLE*          pInDepends,
-    UINT                    uInDepends,
-    OPTIONAL LPCSTR         szSetName,
-    TASKSETHANDLE*          pOutHandle )
+//  Identifies a task of a taskset across a recording and its replay.
+struct ReplayKey
 {
-    TASKSETHANDLE           hSet;
-    TASKSETHANDLE           hSetParent = TASKSETHANDLE_INVALID;
-    TASKSETHANDLE*          pDepends = pInDepends;
-    UINT                    uDepends = uInDepends;
-    BOOL                    bResult = FALSE;
+    UINT64                  mullOrdinal;
+    UINT                    muTask;
 
-    //  Validate incomming parameters
-    if( 0 == uTaskCount || NULL == pFunc )
+    bool
+    operator<( const ReplayKey& Other ) const
     {
-        return FALSE;
+        return mullOrdinal < Other.mullOrdinal || 
+            ( mullOrdinal == Other.mullOrdinal && muTask < Other.muTask );
     }
 
-    //
-    //  Tasksets are spawned when their parents complete.  If no parent for a 
-    //  taskset is specified we need to create a fake one.
-    //
-    if( 0 == uDepends )
+    bool
+    operator==( const ReplayKey& Other ) const
     {
-        hSetParent = AllocateTaskSet();
-        mSets[ hSetParent ]->muCompletionCount = 0;
-        mSets[ hSetParent ]->muRefCount = 1;
-
-        //  Implicit starting task never needs to be waited on for TBB since
-        //  it is not a real tbb task.
-        mSets[ hSetParent ]->mbHasBeenWaitedOn = TRUE;
-
-        uDepends = 1;
-        pDepends = &hSetParent;
+        return mullOrdinal == Other.mullOrdinal && muTask == Other.muTask;
     }
 
-    //
-    //  Allocate and setup the internal taskset
-    //
-    hSet = AllocateTaskSet();
-
-    mSets[ hSet ]->muStartCount   = uDepends;
-
-    //  NOTE: one refcount is owned by the tasking system the other 
-    //  by the caller.
-    mSets[ hSet ]->muRefCount     = 2;
-
-    mSets[ hSet ]->mpFunc         = pFunc;
-    mSets[ hSet ]->mpvArg         = pArg;
-    mSets[ hSet ]->muSize         = uTaskCount;
-    mSets[ hSet ]->muCompletionCount = uTaskCount;
-    mSets[ hSet ]->mhTaskset      = hSet;
-
-#ifdef PROFILEGPA
-    //
-    //  Track task name if profiling is enabled
-    if( szSetName )
+    bool
+    operator!=( const ReplayKey& Other ) const
     {
-        StringCbCopyA(
-            mSets[ hSet ]->mszSetName,
-            sizeof( mSets[ hSet ]->mszSetName ),
-            szSetName );
+        return !( *this == Other );
     }
-    else
-    {
-        StringCbCopyA(
-            mSets[ hSet ]->mszSetName,
-            sizeof( mSets[ hSet ]->mszSetName ),
-            "Unnamed Task" );
-    }
-#else
-    UNREFERENCED_PARAMETER( szSetName );
-#endif // PROFILEGPA
+};
 
-    //
-    //  Iterate over the dependency list and setup the successor
-    //  pointers in each parent to point to this taskset.
-    //
-    for( UINT uDepend = 0; uDepend < uDepends; ++uDepend )
-    {
-        TASKSETHANDLE       hDependsOn = pDepends[ uDepend ];
-        TaskSetTbb*         pDependsOn = mSets[ hDependsOn ];
-        LONG                lPrevCompletion;
+//  The task a thread runs while a schedule is recorded or replayed, and 
+//  the number of tasksets it has created so far.
+struct ScheduleScope
+{
+    UINT64                  mullOrdinal;
+    UINT                    muTask;
+    UINT                    muCreated;
+};
 
-        //
-        //  A taskset with a new successor is consider incomplete even if it
-        //  already has completed.  This mechanism allows us tasksets that are
-        //  already done to appear active and capable of spawning successors.
-        //
-        lPrevCompletion = _InterlockedExchangeAdd( (LONG*)&pDependsOn->muCompletionCount, 1 );
+//  A task held back until its turn in the replay.
+struct ReplayTask
+{
+    TASKSETFUNC             mpFunc;
+    VOID*                   mpvArg;
+    TASKSETHANDLE           mhSet;
+    UINT64                  mullOrdinal;
+    UINT                    muTask;
+    UINT                    muSize;
 
-        if( 0 == lPrevCompletion && hSetParent != hDependsOn )
-        {
-            //  The dependency taskset was already completed.  This means we have,
-            //  or will soon, release the refcount for the tasking system.  Addref
-            //  the taskset since the next Completion will release it.
-            //  This does not apply to the system-created parent.  
-            //
-            //  NOTE: There is no race conditon here since the caller must still
-            //  hold a reference to the depenent taskset which was passed in.
-            _InterlockedIncrement( (LONG*)&pDependsOn->muRefCount );
-        }
+    //  Context the task ran on in the recording, if it holds the turn.
+    INT                     miRecordedContext;
 
-        pDependsOn->mSuccessorsLock.Lock();
+    //  TRUE if the task holds the replay turn, FALSE if it runs unordered.
+    BOOL                    mbTurn;
+};
 
-        UINT uSuccessor;
-        for( uSuccessor = 0; uSuccessor < MAX_SUCCESSORS; ++uSuccessor )
-        {
-            if( NULL == pDependsOn->Successors[ uSuccessor ] )
-            {
-                pDependsOn->Successors[ uSuccessor ] = mSets[ hSet ];
-                break;
-            }
-        }
+static volatile LONG            glScheduleMode;
 
-        //
-        //  If the successor list is full we have a problem.  The app
-        //  needs to give us more space by increasing MAX_SUCCESSORS
-        //
-        if( uSuccessor == MAX_SUCCESSORS )
-        {
-            printf( "Too many successors for this task set.\nIncrease MAX_SUCCESSORS\n" );
-            pDependsOn->mSuccessorsLock.Unlock();
-            goto Cleanup;
-        }
+//  Ordinal of the last taskset created outside of a task while recording
+//  or replaying.
+static volatile LONG            glSetOrdinal;
 
-        pDependsOn->mSuccessorsLock.Unlock();
+//  Recorded events, or the events being replayed.
+static ScheduleEvent*           gpScheduleEvents;
+static volatile LONG            glScheduleEvents;
+static UINT                     guFuzzSeed;
+static CHAR*                    gpszSchedulePath;
 
-        //  
-        //  Mark the set as completed for the successor adding operation.
-        //
-        CompleteTaskSet( hDependsOn );
-    }
+//  Replay state, protected by glReplayLock.  Only the task holding the
+//  turn, started from event guReplayCursor, advances the cursor.
+static volatile LONG            glReplayLock;
+static UINT                     guReplayCursor;
+static BOOL                     gbReplayTurnTaken;
+static std::vector< ReplayTask >    gReplayPending;
 
-    //  Set output taskset handle
-    *pOutHandle = hSet;
+//  Tasks that held the turn but ran on another context than recorded.
+static volatile LONG            glReplayContextMisses;
 
-    bResult = TRUE;
+//  Sorted keys of the replayed events.
+static std::vector< ReplayKey > gReplayKeys;
 
-Cleanup:
+//  TRUE on the thread running the task that holds the replay turn.
+static TASKMGR_THREAD_LOCAL BOOL    tlsReplayTurn;
 
-    return bResult;
+//  The task the thread runs while recording or replaying, or NULL.
+static TASKMGR_THREAD_LOCAL ScheduleScope*  tlsScheduleScope;
+
+//
+//  INTERNAL
+//  Set and take the calling thread's replay turn.  A task that waits can
+//  resume on another thread with fibers, so the thread-local variable is
+//  accessed through functions the compiler cannot inline and cache its 
+//  address across the wait.
+//
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static VOID
+SetReplayTurn(
+    BOOL                    bTurn )
+{
+    tlsReplayTurn = bTurn;
 }
 
-VOID
-TaskMgrTbb::ReleaseHandle(
-    TASKSETHANDLE           hSet )
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static BOOL
+TakeReplayTurn()
 {
-    _InterlockedDecrement( (LONG*)&mSets[ hSet ]->muRefCount );
+    BOOL                    bTurn = tlsReplayTurn;
 
-    //
-    //  Release cannot destroy the object since TBB may still be
-    //  referencing internal members.  Defer destruction until
-    //  we need to allocate a slot.    
+    tlsReplayTurn = FALSE;
+
+    return bTurn;
 }
 
+//
+//  INTERNAL
+//  Set and get the calling thread's schedule scope, for the same reason
+//  through functions the compiler cannot inline.  WaitForSet puts the 
+//  scope back after a wait.
+//
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static VOID
+SetScheduleScope(
+    ScheduleScope*          pScope )
+{
+    tlsScheduleScope = pScope;
+}
+
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static ScheduleScope*
+GetScheduleScope()
+{
+    return tlsScheduleScope;
+}
+
+static VOID
+LockReplay()
+{
+    SpinBackoff             Backoff;
+
+    while( 0 != AtomicCompareExchange( &glReplayLock, 1, 0 ) )
+    {
+        Backoff.Pause();
+    }
+}
+
+static VOID
+UnlockReplay()
+{
+    AtomicCompareExchange( &glReplayLock, 0, 1 );
+}
+
+inline ReplayKey
+GetReplayKey(
+    UINT64                  ullOrdinal,
+    UINT                    uTask )
+{
+    ReplayKey               Key;
+
+    Key.mullOrdinal = ullOrdinal;
+    Key.muTask = uTask;
+
+    return Key;
+}
+
+//
+//  INTERNAL
+//  Returns the ordinal of a taskset being created while a schedule is 
+//  recorded or replayed, 0 otherwise.  The order in which tasks create
+//  tasksets varies from run to run, so a set created by a task is numbered
+//  from that task and the number of sets it created before, with the top
+//  bit set to keep it apart from sets numbered in creation order.  Sets 
+//  created outside of tasks are numbered in creation order.
+//
+static UINT64
+NextSetOrdinal()
+{
+    ScheduleScope*          pScope;
+    UINT64                  ullHash;
+
+    if( SCHEDULE_NORMAL == AtomicLoad( &glScheduleMode ) )
+    {
+        return 0;
+    }
+
+    pScope = GetScheduleScope();
+
+    if( NULL == pScope )
+    {
+        return (UINT64)(UINT)AtomicIncrement( &glSetOrdinal );
+    }
+
+    //  splitmix64 of the creating task's ordinal, task and creation index.
+    ullHash = pScope->mullOrdinal + 
+        0x9E3779B97F4A7C15ull * ( ( ( (UINT64)pScope->muTask << 32 ) | pScope->muCreated++ ) + 1 );
+    ullHash = ( ullHash ^ ( ullHash >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+    ullHash = ( ullHash ^ ( ullHash >> 27 ) ) * 0x94D049BB133111EBull;
+    ullHash ^= ullHash >> 31;
+
+    return ullHash | 0x8000000000000000ull;
+}
+
+//
+//  INTERNAL
+//  Returns a pseudo-random value derived from the fuzzing seed and two 
+//  values identifying a task, so a seed perturbs the same tasks the same 
+//  way every run.
+//
+static UINT
+GetFuzzHash(
+    UINT64                  ullOrdinal,
+    UINT                    uTask )
+{
+    UINT                    uOrdinal = (UINT)ullOrdinal ^ (UINT)( ullOrdinal >> 32 );
+    UINT                    uHash = guFuzzSeed ^ ( uOrdinal * 0x9E3779B1u ) ^ ( uTask * 0x85EBCA77u );
+
+    uHash ^= uHash >> 16;
+    uHash *= 0x85EBCA6Bu;
+    uHash ^= uHash >> 13;
+    uHash *= 0xC2B2AE35u;
+    uHash ^= uHash >> 16;
+
+    return uHash;
+}
+
+//
+//  INTERNAL
+//  Delays a task by an amount picked by its hash: not at all, a short or
+//  long spin, or a yield of the thread.
+//
+static VOID
+FuzzDelay(
+    UINT                    uHash )
+{
+    UINT                    uPauses = 0;
+
+    switch( uHash & 3 )
+    {
+    case 1:
+        uPauses = ( uHash >> 8 ) & 63;
+        break;
+
+    case 2:
+        uPauses = ( uHash >> 8 ) & 1023;
+        break;
+
+    case 3:
+        YieldThread();
+        break;
+    }
+
+    for( UINT uPause = 0; uPause < uPauses; ++uPause )
+    {
+        CpuPause();
+    }
+}
+
+//
+//  INTERNAL
+//  Appends a task start to the recording.
+//
+static VOID
+RecordTaskStart(
+    UINT64                  ullOrdinal,
+    UINT                    uTask,
+    INT                     iContext )
+{
+    LONG                    lEvent = AtomicIncrement( &glScheduleEvents ) - 1;
+
+    if( lEvent < MAX_SCHEDULE_EVENTS )
+    {
+        gpScheduleEvents[ lEvent ].mullOrdinal = ullOrdinal;
+        gpScheduleEvents[ lEvent ].muTask = uTask;
+        gpScheduleEvents[ lEvent ].miContext = iContext;
+    }
+}
+
+//
+//  INTERNAL
+//  Decides whether a replayed task may start.  Returns TRUE if it is the 
+//  task's turn, with its recorded context filled in, or if the task is 
+//  not ordered by the replay.  Otherwise the task is held back until the
+//  task before it starts, and FALSE is returned.
+//
+static BOOL
+ClaimReplayTurn(
+    ReplayTask*             pTask )
+{
+    ReplayKey               Key = GetReplayKey( pTask->mullOrdinal, pTask->muTask );
+
+    pTask->mbTurn = FALSE;
+
+    if( !std::binary_search( gReplayKeys.begin(), gReplayKeys.end(), Key ) )
+    {
+        return TRUE;
+    }
+
+    LockReplay();
+
+    if( guReplayCursor < (UINT)glScheduleEvents )
+    {
+        ScheduleEvent*      pEvent = &gpScheduleEvents[ guReplayCursor ];
+
+        if( gbReplayTurnTaken || 
+            Key != GetReplayKey( pEvent->mullOrdinal, pEvent->muTask ) )
+        {
+            gReplayPending.push_back( *pTask );
+            UnlockReplay();
+
+            return FALSE;
+        }
+
+        gbReplayTurnTaken = TRUE;
+        pTask->mbTurn = TRUE;
+        pTask->miRecordedContext = pEvent->miContext;
+    }
+
+    UnlockReplay();
+
+    return TRUE;
+}
+
+//
+//  INTERNAL
+//  Finds the next held back task that may start: the task of the next 
+//  event once the turn is passed on (bPassTurn), or any task once the 
+//  replay has been played through.  Returns FALSE if there is none.
+//
+static BOOL
+NextReplayTask(
+    ReplayTask*             pNext,
+    BOOL                    bPassTurn )
+{
+    BOOL                    bFound = FALSE;
+
+    LockReplay();
+
+    if( bPassTurn )
+    {
+        ++guReplayCursor;
+        gbReplayTurnTaken = FALSE;
+    }
+
+    if( guReplayCursor >= (UINT)glScheduleEvents )
+    {
+        if( !gReplayPending.empty() )
+        {
+            *pNext = gReplayPending.back();
+            gReplayPending.pop_back();
+
+            pNext->mbTurn = FALSE;
+            bFound = TRUE;
+        }
+    }
+    else if( !gbReplayTurnTaken )
+    {
+        ScheduleEvent*      pEvent = &gpScheduleEvents[ guReplayCursor ];
+        ReplayKey           Key = GetReplayKey( pEvent->mullOrdinal, pEvent->muTask );
+
+        for( size_t uPending = 0; uPending < gReplayPending.size(); ++uPending )
+        {
+            if( Key == GetReplayKey( gReplayPending[ uPending ].mullOrdinal, gReplayPending[ uPending ].muTask ) )
+            {
+                *pNext = gReplayPending[ uPending ];
+                gReplayPending.erase( gReplayPending.begin() + uPending );
+
+                pNext->mbTurn = TRUE;
+                pNext->miRecordedContext = pEvent->miContext;
+
+                gbReplayTurnTaken = TRUE;
+                bFound = TRUE;
+                break;
+            }
+        }
+    }
+
+    UnlockReplay();
+
+    return bFound;
+}
+
+//
+//  INTERNAL
+//  Called on each pass of a thread waiting on a replay.  Counts the 
+//  passes in *puPasses during which the replay has stayed at event 
+//  *puCursor with tasks held back and nobody holding the turn; after 
+//  REPLAY_STALL_PASSES of them the task the replay is waiting for is taken
+//  to never start, the replay is ended and TRUE is returned.
+//
+static BOOL
+EndStalledReplay(
+    UINT*                   puCursor,
+    UINT*                   puPasses )
+{
+    BOOL                    bEnded = FALSE;
+
+    LockReplay();
+
+    if( guReplayCursor != *puCursor || gbReplayTurnTaken || gReplayPending.empty() )
+    {
+        *puCursor = guReplayCursor;
+        *puPasses = 0;
+    }
+    else if( ++*puPasses >= REPLAY_STALL_PASSES && guReplayCursor < (UINT)glScheduleEvents )
+    {
+        printf( "Schedule replay ended after %u of %u task starts.\n",
+            guReplayCursor,
+            (UINT)glScheduleEvents );
+
+        //  Everything from here on runs as usual.
+        guReplayCursor = (UINT)glScheduleEvents;
+        bEnded = TRUE;
+    }
+
+    UnlockReplay();
+
+    return bEnded;
+}
+
+//
+//  INTERNAL
+//  The taskset whose tasks the calling thread is running, for 
+//  TaskMgrTbb::IsCancelled.  A task that waits can resume on another thread
+//  with fibers, so the variable is only accessed through functions the 
+//  compiler cannot inline, and WaitForSet puts it back after the wait.
+//
+static TASKMGR_THREAD_LOCAL TaskSetTbb*     tlsRunningSet;
+
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static VOID
+SetRunningSet(
+    TaskSetTbb*             pSet )
+{
+    tlsRunningSet = pSet;
+}
+
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static TaskSetTbb*
+GetRunningSet()
+{
+    return tlsRunningSet;
+}
+
+//
+//  INTERNAL
+//  Short-lived records (portable scheduler tasks, ParallelFor ranges and
+//  profiling names) come from per-context frame arenas.  Each context owns
+//  FRAME_ARENA_BUFFERS buffers and bump-allocates from the buffer of the
+//  current frame, so allocation needs no lock and no atomic.  A buffer is
+//  rewound wholesale once every record in it has been freed.  Frees can 
+//  happen on any thread and only bump the buffer's free count.
+//
+//  TaskMgrTbb::BeginFrame moves every context to its next buffer.  A buffer
+//  that still holds live records (for example from a background taskset 
+//  spanning frames) is not rewound; the context keeps appending blocks to 
+//  its current buffer instead.  Running out of a block also moves on to the
+//  next buffer if it is free, so apps that never call BeginFrame still
+//  reuse their memory.
+//
+#define FRAME_ARENA_BUFFERS     3
+#define FRAME_ARENA_BLOCK_SIZE  ( 64 * 1024 )
+
+//  Allocations are prefixed by a header pointing at their buffer and
+//  rounded up to FRAME_ARENA_ALIGNMENT.
+#define FRAME_ARENA_ALIGNMENT   16
+
+struct FrameArenaBuffer
+{
+    FrameArenaBuffer()
+        : muBlock( 0 )
+        , muOffset( 0 )
+        , mlAllocs( 0 )
+        , mlFrees( 0 )
+    {
+    }
+
+    ~FrameArenaBuffer()
+    {
+        for( size_t uBlock = 0; uBlock < mBlocks.size(); ++uBlock )
+        {
+            delete [] mBlocks[ uBlock ];
+        }
+    }
+
+    //  TRUE if every record allocated from the buffer has been freed.
+    BOOL
+    IsIdle()
+    {
+        return mlAllocs == AtomicLoad( &mlFrees );
+    }
+
+    VOID
+    Rewind()
+    {
+        muBlock = 0;
+        muOffset = 0;
+    }
+
+    std::vector< CHAR* >    mBlocks;
+    UINT                    muBlock;
+    UINT                    muOffset;
+
+    //  Written by the owning context only.
+    LONG                    mlAllocs;
+
+    //  Written by whichever thread frees; kept off the owner's line.
+    CHAR                    mPad[ TASKMGR_CACHE_LINE_SIZE ];
+    volatile LONG           mlFrees;
+};
+
+struct FrameArena
+{
+    FrameArena()
+        : muBuffer( 0 )
+        , muFrame( 0 )
+    {
+    }
+
+    FrameArenaBuffer        mBuffers[ FRAME_ARENA_BUFFERS ];
+    UINT                    muBuffer;
+    UINT                    muFrame;
+
+    CHAR                    mPad[ TASKMGR_CACHE_LINE_SIZE ];
+};
+
+struct FrameArenaHeader
+{
+    //  NULL if the record came from the heap.
+    FrameArenaBuffer*       mpBuffer;
+    CHAR                    mPad[ FRAME_ARENA_ALIGNMENT - sizeof( FrameArenaBuffer* ) ];
+};
+
+static FrameArena*              gpFrameArenas;
+static UINT                     guFrameArenaCount;
+static volatile LONG            glFrame;
+
+//
+//  INTERNAL
+//  Moves a context's arena to its next buffer if that buffer is idle.
+//  Returns FALSE if the next buffer still has live records.
+//
+static BOOL
+AdvanceFrameArena(
+    FrameArena*             pArena )
+{
+    UINT                    uNext = ( pArena->muBuffer + 1 ) % FRAME_ARENA_BUFFERS;
+
+    if( !pArena->mBuffers[ uNext ].IsIdle() )
+    {
+        return FALSE;
+    }
+
+    pArena->muBuffer = uNext;
+    pArena->mBuffers[ uNext ].Rewind();
+
+    return TRUE;
+}
+
+//
+//  INTERNAL
+//  Allocates a short-lived record from the calling context's frame arena,
+//  or from the heap on threads that are not scheduler contexts.
+//
+static VOID*
+FrameAlloc(
+    size_t                  uSize )
+{
+    INT                     iContext = GetContextId();
+    FrameArenaHeader*       pHeader;
+
+    uSize = ( uSize + sizeof( FrameArenaHeader ) + FRAME_ARENA_ALIGNMENT - 1 ) & 
+            ~(size_t)( FRAME_ARENA_ALIGNMENT - 1 );
+
+    if( iContext < 0 || 
+        (UINT)iContext >= guFrameArenaCount ||
+        uSize > FRAME_ARENA_BLOCK_SIZE )
+    {
+        pHeader = (FrameArenaHeader*)new CHAR[ uSize ];
+        pHeader->mpBuffer = NULL;
+
+        return pHeader + 1;
+    }
+
+    FrameArena*             pArena = &gpFrameArenas[ iContext ];
+    UINT                    uFrame = (UINT)AtomicLoad( &glFrame );
+
+    if( uFrame != pArena->muFrame )
+    {
+        pArena->muFrame = uFrame;
+        AdvanceFrameArena( pArena );
+    }
+
+    FrameArenaBuffer*       pBuffer = &pArena->mBuffers[ pArena->muBuffer ];
+
+    if( pBuffer->muOffset + uSize > FRAME_ARENA_BLOCK_SIZE || pBuffer->mBlocks.empty() )
+    {
+        //
+        //  Out of room.  Rewind if everything in the buffer is dead, else 
+        //  move to the next buffer if it is, else take another block.
+        //
+        if( pBuffer->IsIdle() && !pBuffer->mBlocks.empty() )
+        {
+            pBuffer->Rewind();
+        }
+        else if( !pBuffer->mBlocks.empty() && AdvanceFrameArena( pArena ) )
+        {
+            pBuffer = &pArena->mBuffers[ pArena->muBuffer ];
+        }
+        else
+        {
+            if( !pBuffer->mBlocks.empty() )
+            {
+                ++pBuffer->muBlock;
+            }
+            pBuffer->muOffset = 0;
+        }
+
+        if( pBuffer->muBlock == pBuffer->mBlocks.size() )
+        {
+            pBuffer->mBlocks.push_back( new CHAR[ FRAME_ARENA_BLOCK_SIZE ] );
+        }
+    }
+
+    pHeader = (FrameArenaHeader*)( pBuffer->mBlocks[ pBuffer->muBlock ] + pBuffer->muOffset );
+    pHeader->mpBuffer = pBuffer;
+
+    pBuffer->muOffset += (UINT)uSize;
+    ++pBuffer->mlAllocs;
+
+    return pHeader + 1;
+}
+
+//
+//  INTERNAL
+//  Frees a record allocated by FrameAlloc.  May be called on any thread.
+//
+static VOID
+FrameFree(
+    VOID*                   pvRecord )
+{
+    FrameArenaHeader*       pHeader = (FrameArenaHeader*)pvRecord - 1;
+
+    if( NULL == pHeader->mpBuffer )
+    {
+        delete [] (CHAR*)pHeader;
+    }
+    else
+    {
+        AtomicIncrement( &pHeader->mpBuffer->mlFrees );
+    }
+}
+
+//
+//  INTERNAL
+//  GenericTask is the wrapper class for individual tbb tasks.  Tasks
+//  in TBB are the basic scheduling units.  The class contains all the
+//  information needed for the callback.  It also contains a pointer 
+//  to the parent tbb task. The parent task (TaskSetTbb defined below)
+//  is referenced by GenericTask in order to report completion of the 
+//  each GenericTask in the set.
+//
+//  A GenericTask starts out owning a range of task indices.  It splits off
+//  the upper half of its range as a new GenericTask until at most muGrain 
+//  indices are left, which it then runs back to back before reporting them
+//  complete with a single decrement.  The spawning of a taskset is therefore spread
+//  over the threads that steal the halves instead of done serially by the
+//  thread that launched the set.
+//
+//  If the taskset has an affinity table, the task records the context that
+//  runs it under its first index and sends each split-off half to the
+//  context that ran that half last time.
+//
+class GenericTask : public task
+{
+public:
+    GenericTask()
+    : mpFunc( 0 )
+    , mpvArg( 0 )
+    , muBegin( 0 )
+    , muEnd( 0 )
+    , muSize( 0 )
+    , muGrain( 1 )
+    , muPriority( TASKSET_PRIORITY_NORMAL )
+    , mpszSetName( NULL )
+    , mpuAffinity( NULL )
+    , mhTaskSet( TASKSETHANDLE_INVALID )
+    {
+    };
+
+    GenericTask( 
+        TASKSETFUNC         pFunc,
+        void*               pvArg,
+        UINT                uBegin,
+        UINT                uEnd,
+        UINT                uSize,
+        UINT                uGrain,
+        UINT                uPriority,
+        CHAR*               pszSetName,
+        UINT*               puAffinity,
+        TASKSETHANDLE       hSet ) 
+    : mpFunc( pFunc )
+    , mpvArg( pvArg )
+    , muBegin( uBegin )
+    , muEnd( uEnd )
+    , muSize( uSize )
+    , muGrain( uGrain )
+    , muPriority( uPriority )
+    , mpszSetName( pszSetName )
+    , mpuAffinity( puAffinity )
+    , mhTaskSet( hSet )
+    {
+    };
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    //  The scheduler deletes tasks once they have run; allocate them from
+    //  the frame arena.  tbb tasks use tbb's own task allocator.
+    static VOID*
+    operator new( size_t uSize )
+    {
+        return FrameAlloc( uSize );
+    }
+
+    static VOID
+    operator delete( VOID* pvTask )
+    {
+        FrameFree( pvTask );
+    }
+#else
+    //  tbb calls note_affinity before execute when the task runs on
+    //  another thread than its affinity, which includes stolen tasks.
+    VOID
+    note_affinity( affinity_id uId )
+    {
+        if( mpuAffinity )
+        {
+            mpuAffinity[ muBegin ] = uId;
+        }
+    }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    //  execute will split the task's range down to muGrain indices and
+    //  call the app-defined task callback with the proper parameters for
+    //  each of them
+    task* execute()
+    {
+        INT64               llRunStart = GetTimerTicks();
+        TaskSetTbb*         pSet = MarkStarted( mhTaskSet, llRunStart );
+        UINT                uTask;
+
+#ifdef TASKMGR_TRACE
+        const CHAR*         pszTraceName = GetTraceName( mhTaskSet );
+#endif // TASKMGR_TRACE
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+        if( mpuAffinity )
+        {
+            mpuAffinity[ muBegin ] = (UINT)( GetContextId() + 1 );
+        }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+        while( muEnd - muBegin > muGrain )
+        {
+            UINT            uMid = muBegin + ( muEnd - muBegin ) / 2;
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+            gScheduler.SpawnTo( 
+                new GenericTask( 
+                    mpFunc, 
+                    mpvArg,
+                    uMid,
+                    muEnd,
+                    muSize,
+                    muGrain,
+                    muPriority,
+                    mpszSetName,
+                    mpuAffinity,
+                    mhTaskSet ),
+                muPriority,
+                mpuAffinity ? (INT)mpuAffinity[ uMid ] - 1 : TASKSCHEDULER_CONTEXT_INVALID );
+#else
+            //  The split-off task is another child of the TaskSetTbb so
+            //  its wait_for_all covers it.
+            GenericTask*    pSplit = new( allocate_additional_child_of( *parent() ) ) GenericTask( 
+                mpFunc, 
+                mpvArg,
+                uMid,
+                muEnd,
+                muSize,
+                muGrain,
+                muPriority,
+                mpszSetName,
+                mpuAffinity,
+                mhTaskSet );
+
+            if( mpuAffinity )
+            {
+                pSplit->set_affinity( (affinity_id)mpuAffinity[ uMid ] );
+            }
+
+            if( TASKSET_PRIORITY_BACKGROUND == muPriority )
+            {
+                enqueue( *pSplit );
+            }
+            else
+            {
+                spawn( *pSplit );
+            }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+            muEnd = uMid;
+        }
+
+        SetRunningSet( pSet );
+
+        if( SCHEDULE_NORMAL != AtomicLoad( &glScheduleMode ) )
+        {
+            RunScheduled();
+            SetRunningSet( NULL );
+            return NULL;
+        }
+
+        for( uTask = muBegin; uTask < muEnd; ++uTask )
+        {
+            //  A task that waits can resume on another thread, so the
+            //  context is looked up for every task.
+            INT             iContext;
+
+            //  Once the set is cancelled the tasks not started yet are 
+            //  skipped, but still completed.
+            if( IsSetCancelled( pSet ) )
+            {
+                break;
+            }
+
+            iContext = GetContextId();
+
+            ProfileBeginTask( mpszSetName );
+            TraceBeginSpan( ullTraceStart );
+
+            mpFunc( mpvArg, iContext, uTask, muSize );
+
+            TraceEndSpan( pszTraceName, uTask, iContext, ullTraceStart );
+            ProfileEndTask();
+        }
+
+        SetRunningSet( NULL );
+
+        //  Charged to the context the range ends on, the only one that may
+        //  write its statistics.
+        ContextStats*       pStats = GetContextStats();
+
+        if( pStats )
+        {
+            AtomicCounterAdd64( &pStats->mllTasks, uTask - muBegin );
+            AtomicCounterAdd64( &pStats->mllRunTicks, GetTimerTicks() - llRunStart );
+        }
+
+        //  Notify the taskmgr that this set completed the range's tasks.
+        gTaskMgr.CompleteTaskSet( mhTaskSet, muEnd - muBegin );
+
+        return NULL;
+    }
+
+    //  Runs held back replay tasks, starting with pTask, for as long as the
+    //  turn comes back to the calling thread.
+    static VOID
+    RunReplayTasks( ReplayTask* pTask );
+
+    //  Passes the replay turn on if the calling thread holds it.  Called 
+    //  before a task waits, so the tasks it waits for can start.
+    static VOID
+    ReleaseReplayTurn();
+
+    //  Waits for pSet while a replay is in progress, ending the replay if
+    //  it stalls on a taskset that is never created.
+    static VOID
+    WaitForReplay( TaskSetTbb* pSet );
+
+    //  Returns TRUE if pSet has been cancelled or has missed its deadline.
+    static BOOL
+    IsSetCancelled( TaskSetTbb* pSet );
+
+private:
+
+    //  Runs the range's tasks while a recording or replay is in progress.
+    VOID
+    RunScheduled();
+
+    //  Runs one task with a schedule scope, so the tasksets it creates are
+    //  numbered from it.  See NextSetOrdinal.
+    static VOID
+    RunInScope( TASKSETFUNC pFunc, VOID* pvArg, INT iContext, UINT64 ullOrdinal, UINT uTask, UINT uSize );
+
+    //  Records when the first task of a taskset started, for the latency
+    //  statistics.
+    static TaskSetTbb*
+    MarkStarted( TASKSETHANDLE hSet, INT64 llTicks );
+
+#ifdef TASKMGR_TRACE
+    //  Returns the name the tasks of a taskset are recorded under.
+    static const CHAR*
+    GetTraceName( TASKSETHANDLE hSet );
+#endif // TASKMGR_TRACE
+
+    TASKSETFUNC             mpFunc;
+    void*                   mpvArg;
+    UINT                    muBegin;
+    UINT                    muEnd;
+    UINT                    muSize;
+    UINT                    muGrain;
+    UINT                    muPriority;
+    CHAR*                   mpszSetName;
+
+    //  Affinity table of the taskset, or NULL.  See TaskSetAffinity.
+    UINT*                   mpuAffinity;
+
+    TASKSETHANDLE           mhTaskSet;
+};
+
+//
+//  INTERNAL
+//  SuccessorLink is a node in a taskset's successor list.  The nodes are
+//  owned by the successor, one per dependency, so attaching a successor 
+//  never allocates once a slot has seen its largest dependency count.
+//
+struct SuccessorLink
+{
+    TaskSetTbb*             mpSuccessor;
+    SuccessorLink*          mpNext;
+};
+
+//
+//  INTERNAL
+//  Value of a successor list head once the taskset has completed.  Pushes
+//  onto a closed list fail, telling the caller the dependency is already
+//  satisfied.
+//
+static SuccessorLink            gClosedSuccessorList;
+#define SUCCESSORS_CLOSED       ( &gClosedSuccessorList )
+
+//
+//  INTERNAL
+//  Number of SuccessorLinks stored inline in each TaskSetTbb.  Tasksets
+//  with more dependencies than this allocate their links on the heap.
+//
+#define INLINE_SUCCESSOR_LINKS  4
+
+//
+//  INTERNAL
+//  TaskSetTbb is the base tbb task that owns both spawning and tracking
+//  the taskset.  It owns the completion count and the successor list.
+//  TaskSetTbb will spawn GerericTask instances for each callback the 
+//  Application requeseted in TaskMgrTbb::CreateTaskSet.
+//
+//  TaskSetTbb objects are owned by a slot in the taskset table and are
+//  reused for every taskset allocated in that slot.  They are only 
+//  destroyed by TaskMgrTbb::Shutdown.
+//
+class TaskSetTbb : public task
+{
+public:
+    TaskSetTbb() 
+    : mhTaskset( TASKSETHANDLE_INVALID )
+    , mbLaunched( FALSE )
+    , mpFunc( NULL )
+    , mpvArg( 0 )
+    , muSize( 0 )
+    , muPriority( TASKSET_PRIORITY_NORMAL )
+    , muGrain( 1 )
+    , mbSignalSet( FALSE )
+    , mpszSetName( NULL )
+#ifdef TASKMGR_TRACE
+    , mpszTraceName( NULL )
+#endif // TASKMGR_TRACE
+    , mpuAffinity( NULL )
+    , mullOrdinal( 0 )
+    , mlCancelled( 0 )
+    , mllDeadlineTicks( 0 )
+    , mpLinks( mInlineLinks )
+    , muLinkCapacity( INLINE_SUCCESSOR_LINKS )
+    , muGeneration( 0 )
+    , muNextFree( 0 )
+    , muNextBatch( 0 )
+    , muStartCount( 0 )
+    , mllReadyTicks( 0 )
+    , mllFirstTaskTicks( 0 )
+    , muCompletionCount( 0 )
+    , mpSuccessors( NULL )
+    , muRefCount( 0 )
+    , mlHandleReleased( 0 )
+    , mbHasBeenWaitedOn( FALSE )
+    , mlWaitClaimed( 0 )
+    {
+    };
+
+    ~TaskSetTbb()
+    {
+        if( mpLinks != mInlineLinks )
+        {
+            delete [] mpLinks;
+        }
+    }
+
+    //  Returns storage for one SuccessorLink per dependency.
+    SuccessorLink*
+    GetLinks( UINT uDepends )
+    {
+        if( uDepends > muLinkCapacity )
+        {
+            if( mpLinks != mInlineLinks )
+            {
+                delete [] mpLinks;
+            }
+
+            mpLinks = new SuccessorLink[ uDepends ];
+            muLinkCapacity = uDepends;
+        }
+
+        return mpLinks;
+    }
+
+    //  Pushes a successor onto this taskset's successor list.  Returns
+    //  FALSE if this taskset has already completed, in which case the 
+    //  dependency is satisfied and the link was not added.
+    BOOL
+    AddSuccessor( SuccessorLink* pLink )
+    {
+        for( ;; )
+        {
+            SuccessorLink*  pHead = (SuccessorLink*)AtomicLoadPointer( 
+                (VOID* volatile*)&mpSuccessors );
+
+            if( SUCCESSORS_CLOSED == pHead )
+            {
+                return FALSE;
+            }
+
+            pLink->mpNext = pHead;
+
+            if( pHead == AtomicCompareExchangePointer( 
+                    (VOID* volatile*)&mpSuccessors, 
+                    pLink, 
+                    pHead ) )
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    task* execute()
+    {
+        mbLaunched = TRUE;
+
+        mllReadyTicks = GetTimerTicks();
+        mllFirstTaskTicks = 0;
+
+        //  A set cancelled before it became ready completes without 
+        //  spawning anything.
+        if( GenericTask::IsSetCancelled( this ) )
+        {
+#ifndef TASKMGR_SCHEDULER_PORTABLE
+            //  No children, so wait_for_all has nothing to wait for.
+            set_ref_count( 1 );
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+            gTaskMgr.CompleteTaskSet( mhTaskset, muSize );
+
+            return NULL;
+        }
+
+        //
+        //  Spawn a single GenericTask for the whole set; it splits itself
+        //  recursively (see GenericTask::execute).
+        //
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+        //  The portable scheduler has no parent/child relationship;
+        //  completion is tracked by muCompletionCount alone.
+        gScheduler.SpawnTo( 
+            new GenericTask( 
+                mpFunc, 
+                mpvArg,
+                0,
+                muSize,
+                muSize,
+                muGrain,
+                muPriority,
+                mpszSetName,
+                mpuAffinity,
+                mhTaskset ),
+            muPriority,
+            mpuAffinity ? (INT)mpuAffinity[ 0 ] - 1 : TASKSCHEDULER_CONTEXT_INVALID );
+#else
+        //  set the tbb reference count for this TaskSetTbb to one plus
+        //  the first child.  Split-off children add their own reference.
+        set_ref_count( 2 );
+
+        GenericTask*        pTask = new( allocate_child() ) GenericTask( 
+            mpFunc, 
+            mpvArg,
+            0,
+            muSize,
+            muSize,
+            muGrain,
+            muPriority,
+            mpszSetName,
+            mpuAffinity,
+            mhTaskset );
+
+        if( mpuAffinity )
+        {
+            pTask->set_affinity( (affinity_id)mpuAffinity[ 0 ] );
+        }
+
+        if( TASKSET_PRIORITY_BACKGROUND == muPriority )
+        {
+            enqueue( *pTask );
+        }
+        else
+        {
+            spawn( *pTask );
+        }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+        return NULL;
+    }
+
+
+    //
+    //  The fields are grouped by who writes them.  Everything up to mPad0 
+    //  is written when the taskset is created and only read while it runs.
+    //  Each counter that other threads hammer gets a cache line of its own
+    //  so completions on one do not invalidate the others or the fields 
+    //  the tasks read.
+    //
+    TASKSETHANDLE           mhTaskset;
+    BOOL                    mbLaunched;
+
+    TASKSETFUNC             mpFunc;
+    void*                   mpvArg;
+
+    UINT                    muSize;    
+    UINT                    muPriority;
+
+    //  Number of task indices a GenericTask runs before reporting their
+    //  completion with one decrement; see GenericTask::execute.
+    UINT                    muGrain;
+
+    //  TRUE for sets created by CreateSignalSet, which have no tasks and
+    //  are never launched.
+    BOOL                    mbSignalSet;
+
+    //  Name for profiling, allocated from the frame arena.  NULL unless
+    //  PROFILEGPA is defined.
+    CHAR*                   mpszSetName;
+
+#ifdef TASKMGR_TRACE
+    //  Interned name the tasks are recorded under; see TaskMgrTrace.h.
+    const CHAR*             mpszTraceName;
+#endif // TASKMGR_TRACE
+
+    //  Table of the TaskSetAffinity the set was created with, or NULL.
+    UINT*                   mpuAffinity;
+
+    //  Identifies the set while a schedule is recorded or replayed; see 
+    //  NextSetOrdinal.
+    UINT64                  mullOrdinal;
+
+    //  Non-zero once the set is cancelled, and the timer tick after which
+    //  its tasks that have not started are skipped (0 for none).  Rarely
+    //  written, read before every task.
+    volatile LONG           mlCancelled;
+    volatile INT64          mllDeadlineTicks;
+
+    //  Links this taskset uses to attach itself to its dependencies.
+    SuccessorLink*          mpLinks;
+    UINT                    muLinkCapacity;
+    SuccessorLink           mInlineLinks[ INLINE_SUCCESSOR_LINKS ];
+
+    //  Bumped every time the slot is freed; the high bits of mhTaskset.
+    UINT                    muGeneration;
+
+    //  While the slot is free: the next slot in its batch, and on the
+    //  first slot of a batch, the first slot of the next batch on the 
+    //  global free list.
+    UINT                    muNextFree;
+    volatile UINT           muNextBatch;
+
+    CHAR                    mPad0[ TASKMGR_CACHE_LINE_SIZE ];
+
+    //  Decremented as dependencies complete.
+    volatile UINT           muStartCount;
+
+    //  When the set was launched and when its first task started; quiet by
+    //  the time the tasks run.
+    INT64                   mllReadyTicks;
+    volatile INT64          mllFirstTaskTicks;
+
+    CHAR                    mPad1[ TASKMGR_CACHE_LINE_SIZE ];
+
+    //  Decremented by the workers as ranges of tasks complete.
+    volatile UINT           muCompletionCount;
+
+    CHAR                    mPad2[ TASKMGR_CACHE_LINE_SIZE ];
+
+    //  Head of the lock-free successor list; SUCCESSORS_CLOSED once the
+    //  taskset has completed.
+    SuccessorLink* volatile mpSuccessors;
+
+    CHAR                    mPad3[ TASKMGR_CACHE_LINE_SIZE ];
+
+    //  Written by the threads releasing and waiting on the taskset.
+    volatile UINT           muRefCount;
+
+    //  Non-zero once the owner of the handle has released it, so a second
+    //  ReleaseHandle cannot drop the tasking system's reference.
+    volatile LONG           mlHandleReleased;
+    BOOL                    mbHasBeenWaitedOn;
+
+    //  Non-zero once a thread has claimed the tbb wait_for_all for this 
+    //  taskset.  tbb only allows one wait per launch.
+    volatile LONG           mlWaitClaimed;
+
+    //  Keeps the next taskset off the last line.
+    CHAR                    mPad4[ TASKMGR_CACHE_LINE_SIZE ];
+};
+
+VOID
+GenericTask::RunScheduled()
+{
+    UINT64                  ullOrdinal = gTaskMgr.GetTaskSet( mhTaskSet )->mullOrdinal;
+    UINT                    uCount = muEnd - muBegin;
+    UINT                    uRotate = 0;
+
+    if( SCHEDULE_REPLAY == AtomicLoad( &glScheduleMode ) )
+    {
+        //  Tasks held back are completed by the thread that runs them.
+        for( UINT uTask = muBegin; uTask < muEnd; ++uTask )
+        {
+            ReplayTask      Task;
+
+            Task.mpFunc = mpFunc;
+            Task.mpvArg = mpvArg;
+            Task.mhSet = mhTaskSet;
+            Task.mullOrdinal = ullOrdinal;
+            Task.muTask = uTask;
+            Task.muSize = muSize;
+
+            if( ClaimReplayTurn( &Task ) )
+            {
+                RunReplayTasks( &Task );
+            }
+        }
+
+        return;
+    }
+
+    if( 0 != guFuzzSeed )
+    {
+        uRotate = GetFuzzHash( ullOrdinal, ~muBegin ) % uCount;
+    }
+
+    for( UINT uIndex = 0; uIndex < uCount; ++uIndex )
+    {
+        UINT                uTask = muBegin + ( uIndex + uRotate ) % uCount;
+        INT                 iContext;
+
+        if( 0 != guFuzzSeed )
+        {
+            FuzzDelay( GetFuzzHash( ullOrdinal, uTask ) );
+        }
+
+        if( IsSetCancelled( gTaskMgr.GetTaskSet( mhTaskSet ) ) )
+        {
+            break;
+        }
+
+        iContext = GetContextId();
+
+        RecordTaskStart( ullOrdinal, uTask, iContext );
+
+        RunInScope( mpFunc, mpvArg, iContext, ullOrdinal, uTask, muSize );
+    }
+
+    gTaskMgr.CompleteTaskSet( mhTaskSet, uCount );
+}
+
+VOID
+GenericTask::RunInScope(
+    TASKSETFUNC             pFunc,
+    VOID*                   pvArg,
+    INT                     iContext,
+    UINT64                  ullOrdinal,
+    UINT                    uTask,
+    UINT                    uSize )
+{
+    //  A task that waits can run other tasks on this thread, each in a 
+    //  scope of its own.
+    ScheduleScope*          pOuterScope = GetScheduleScope();
+    ScheduleScope           Scope;
+
+    Scope.mullOrdinal = ullOrdinal;
+    Scope.muTask = uTask;
+    Scope.muCreated = 0;
+
+    SetScheduleScope( &Scope );
+    pFunc( pvArg, iContext, uTask, uSize );
+    SetScheduleScope( pOuterScope );
+}
+
+VOID
+GenericTask::RunReplayTasks(
+    ReplayTask*             pTask )
+{
+    ReplayTask              Task = *pTask;
+
+    for( ;; )
+    {
+        BOOL                bNext;
+        ReplayTask          Next;
+
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( Task.mhSet );
+
+        //  The task runs on whichever thread took or was passed the turn.
+        //  Passing it that thread's context keeps one task per context at a
+        //  time; a different context than recorded is only counted.
+        INT                 iContext = GetContextId();
+
+        if( Task.mbTurn && iContext != Task.miRecordedContext )
+        {
+            AtomicIncrement( &glReplayContextMisses );
+        }
+
+        SetReplayTurn( Task.mbTurn );
+        SetRunningSet( pSet );
+
+        if( !IsSetCancelled( pSet ) )
+        {
+            RunInScope( Task.mpFunc, Task.mpvArg, iContext, Task.mullOrdinal, Task.muTask, Task.muSize );
+        }
+
+        SetRunningSet( NULL );
+
+        //  If the task waited, it has passed the turn on already.
+        bNext = NextReplayTask( &Next, TakeReplayTurn() );
+
+        gTaskMgr.CompleteTaskSet( Task.mhSet, 1 );
+
+        if( !bNext )
+        {
+            break;
+        }
+
+        Task = Next;
+    }
+}
+
+VOID
+GenericTask::ReleaseReplayTurn()
+{
+    ReplayTask              Next;
+
+    if( TakeReplayTurn() && NextReplayTask( &Next, TRUE ) )
+    {
+        RunReplayTasks( &Next );
+    }
+}
+
+VOID
+GenericTask::WaitForReplay(
+    TaskSetTbb*             pSet )
+{
+    SpinBackoff             Backoff;
+    UINT                    uCursor = 0;
+    UINT                    uPasses = 0;
+    ReplayTask              Next;
+
+    while( 0 != AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) &&
+           SCHEDULE_REPLAY == AtomicLoad( &glScheduleMode ) )
+    {
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+        if( gScheduler.RunOneTask( pSet->muPriority ) )
+        {
+            continue;
+        }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+        if( EndStalledReplay( &uCursor, &uPasses ) )
+        {
+            //  The tasks held back can all start now.
+            while( NextReplayTask( &Next, FALSE ) )
+            {
+                RunReplayTasks( &Next );
+            }
+
+            break;
+        }
+
+        Backoff.Pause();
+    }
+}
+
+TaskSetTbb*
+GenericTask::MarkStarted(
+    TASKSETHANDLE           hSet,
+    INT64                   llTicks )
+{
+    TaskSetTbb*             pSet = gTaskMgr.GetTaskSet( hSet );
+
+    if( 0 == AtomicLoad64( &pSet->mllFirstTaskTicks ) )
+    {
+        AtomicCompareExchange64( &pSet->mllFirstTaskTicks, llTicks, 0 );
+    }
+
+    return pSet;
+}
+
+BOOL
+GenericTask::IsSetCancelled(
+    TaskSetTbb*             pSet )
+{
+    INT64                   llDeadlineTicks;
+
+    if( 0 != AtomicLoad( &pSet->mlCancelled ) )
+    {
+        return TRUE;
+    }
+
+    //  A set past its deadline stays cancelled, which also cancels its
+    //  successors.
+    llDeadlineTicks = AtomicLoad64( &pSet->mllDeadlineTicks );
+
+    if( 0 != llDeadlineTicks && GetTimerTicks() > llDeadlineTicks )
+    {
+        AtomicStore( &pSet->mlCancelled, 1 );
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+#ifdef TASKMGR_TRACE
+const CHAR*
+GenericTask::GetTraceName(
+    TASKSETHANDLE           hSet )
+{
+    return gTaskMgr.GetTaskSet( hSet )->mpszTraceName;
+}
+#endif // TASKMGR_TRACE
+
+//
+//  INTERNAL
+//  Layout of a TASKSETHANDLE: slot index in the low bits, slot generation
+//  in the high bits.  Generations wrap below TASKSET_GENERATION_LIMIT so
+//  no valid handle is ever equal to TASKSETHANDLE_INVALID.
+//
+#define TASKSET_INDEX_BITS          16
+#define TASKSET_INDEX_MASK          ( ( 1 << TASKSET_INDEX_BITS ) - 1 )
+#define TASKSET_GENERATION_LIMIT    0xFFFF
+#define TASKSET_FREE_NIL            0xFFFFFFFF
+
+#define MAKE_TASKSETHANDLE( uSlot, uGeneration ) \
+    ( (TASKSETHANDLE)( ( (UINT)( uGeneration ) << TASKSET_INDEX_BITS ) | (UINT)( uSlot ) ) )
+#define TASKSETHANDLE_SLOT( hSet )          ( (UINT)( hSet ) & TASKSET_INDEX_MASK )
+#define TASKSETHANDLE_GENERATION( hSet )    ( (UINT)( hSet ) >> TASKSET_INDEX_BITS )
+
+#define MAKE_FREE_HEAD( uSlot, uTag ) \
+    ( (INT64)( ( (UINT64)( uTag ) << 32 ) | (UINT64)(UINT)( uSlot ) ) )
+#define FREE_HEAD_SLOT( llHead )            ( (UINT)( (UINT64)( llHead ) & 0xFFFFFFFF ) )
+#define FREE_HEAD_TAG( llHead )             ( (UINT)( (UINT64)( llHead ) >> 32 ) )
+
+#if TASKSET_CHUNK_SIZE * MAX_TASKSET_CHUNKS > TASKSET_INDEX_MASK + 1
+#error TASKSET_CHUNK_SIZE * MAX_TASKSET_CHUNKS does not fit in a TASKSETHANDLE
+#endif
+
+//
+//  INTERNAL
+//  Free slots move between the global free list and the per-thread caches
+//  in batches of TASKSET_BATCH_SIZE, so a thread only touches the shared
+//  list head once every TASKSET_BATCH_SIZE allocations or frees.
+//
+#define TASKSET_BATCH_SIZE          16
+
+//
+//  INTERNAL
+//  Sets with more than TASKSET_GRAINS_PER_CONTEXT tasks per context run
+//  their tasks in ranges and report each range's completion at once.
+//
+#define TASKSET_GRAINS_PER_CONTEXT  4
+
+#if TASKSET_CHUNK_SIZE % TASKSET_BATCH_SIZE
+#error TASKSET_CHUNK_SIZE must be a multiple of TASKSET_BATCH_SIZE
+#endif
+
+//
+//  INTERNAL
+//  Per-thread cache of free taskset slots.  Holds up to two batches so a
+//  thread that alternates allocating and freeing does not bounce a batch
+//  to and from the global list.  The cache is tagged with the owning 
+//  TaskMgrTbb and its Init epoch and is discarded if either changes.
+//
+//  The cache is a ring of muCount slots starting at muFirst, and slots are
+//  allocated oldest first.  The cache is topped up while it holds less 
+//  than a batch, so a slot freed again right away waits for at least a 
+//  batch of other slots to be used before it is handed out, rather than
+//  coming straight back with the next generation.  With only 16 generation
+//  bits per handle, that stretches the time before a stale handle to a hot
+//  slot can match again from minutes to hours.
+//
+//  NOTE: slots cached by a thread that exits are not returned to the free
+//  list until the next Init.  The scheduler threads live as long as the
+//  TaskMgrTbb, so this only affects app threads that create tasksets.
+//
+struct TaskSetCache
+{
+    TaskMgrTbb*             mpOwner;
+    UINT                    muEpoch;
+    UINT                    muFirst;
+    UINT                    muCount;
+    UINT                    muSlots[ 2 * TASKSET_BATCH_SIZE ];
+};
+
+#define TASKSET_CACHE_SLOT( pCache, uIdx ) \
+    ( (pCache)->muSlots[ ( (pCache)->muFirst + ( uIdx ) ) % ARRAYSIZE( (pCache)->muSlots ) ] )
+
+static TASKMGR_THREAD_LOCAL TaskSetCache tlsSetCache;
+
+//
+//  INTERNAL
+//  Allocates the TaskSetTbb that lives in a slot for the life of the
+//  TaskMgrTbb.
+//
+static TaskSetTbb*
+CreateTaskSetObject()
+{
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    return new TaskSetTbb();
+#else
+    TaskSetTbb*             pSet = new( task::allocate_root() ) TaskSetTbb();
+
+    //  Keep the root task's count above one until the set is launched so a
+    //  wait_for_all before launch blocks instead of returning early.
+    pSet->set_ref_count( 2 );
+
+    return pSet;
+#endif // TASKMGR_SCHEDULER_PORTABLE
+}
+
+//
+//  INTERNAL
+//  Releases the memory of a TaskSetTbb.  Only called at shutdown.
+//
+static VOID
+DestroyTaskSet(
+    TaskSetTbb*             pSet )
+{
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    delete pSet;
+#else
+    //
+    //  Once TaskMgrTbb is done with a tbb object we need to forcibly destroy it.
+    //  There are some refcount issues with tasks in tbb 3.0 which can be 
+    //  inconsistent if a task has never been waited for.  TaskMgrTbb knows the
+    //  correct refcount.
+    pSet->set_ref_count( 0 );
+    pSet->destroy( *pSet );
+#endif // TASKMGR_SCHEDULER_PORTABLE
+}
+
+//
+//  INTERNAL
+//  ParallelFor sizes its ranges so that one range takes about 
+//  PARALLELFOR_TARGET_RANGE_US to run: long enough to hide the cost of 
+//  claiming it, short enough to balance the load across contexts.  Ranges
+//  are also capped so each context gets at least PARALLELFOR_RANGES_PER_CONTEXT
+//  of them.
+//
+#define PARALLELFOR_TARGET_RANGE_US     50
+#define PARALLELFOR_RANGES_PER_CONTEXT  4
+
+//
+//  INTERNAL
+//  Number of entries in the table that remembers the last automatic grain
+//  of each ParallelFor callback.  Callbacks that hash to the same entry 
+//  share a starting grain, which the next call then corrects.
+//
+#define PARALLELFOR_GRAIN_CACHE_SIZE    64
+
+static volatile LONG            glParallelForGrain[ PARALLELFOR_GRAIN_CACHE_SIZE ];
+
+//
+//  INTERNAL
+//  Timer ticks one ParallelFor range should take.  Set by TaskMgrTbb::Init.
+//
+static INT64                    gllParallelForTargetTicks;
+
+//
+//  INTERNAL
+//  ParallelForRange is the shared state of one ParallelFor call.  Every
+//  task in the set claims ranges from muNext until it passes muEnd.  The 
+//  last task to finish stores the grain back in the cache and frees the 
+//  range.
+//
+//  With mbStatic set, as for a ParallelFor with a TaskSetAffinity, task i 
+//  runs only the range starting at muBegin + i * muGrain, so each range
+//  belongs to the same task every call.  Ranges are also static while a
+//  schedule is recorded or replayed, since only task starts are recorded
+//  and not which ranges a task claimed.
+//
+struct ParallelForRange
+{
+    PARALLELFORFUNC         mpFunc;
+    VOID*                   mpvArg;
+    UINT                    muBegin;
+    UINT                    muEnd;
+    volatile UINT           muNext;
+    BOOL                    mbStatic;
+
+    //  Indices claimed per range.  Only changes if mbAutoGrain is set.
+    volatile UINT           muGrain;
+    UINT                    muMaxGrain;
+    BOOL                    mbAutoGrain;
+
+    //  Grain cache entry for mpFunc.
+    volatile LONG*          plCachedGrain;
+
+    //  Number of tasks that have not finished with the range.
+    volatile UINT           muActive;
+};
+
+//
+//  INTERNAL
+//  Taskset callback used by ParallelFor.  Claims and runs ranges until the
+//  index space is exhausted.
+//
+static VOID
+ParallelForTask(
+    VOID*                   pvArg,
+    INT                     iContextId,
+    UINT                    uTask,
+    UINT                    uTaskCount )
+{
+    ParallelForRange*       pRange = (ParallelForRange*)pvArg;
+
+    UNREFERENCED_PARAMETER( uTaskCount );
+
+    if( pRange->mbStatic )
+    {
+        UINT    uBegin = pRange->muBegin + uTask * pRange->muGrain;
+        UINT    uEnd = pRange->muEnd - uBegin > pRange->muGrain ? uBegin + pRange->muGrain : pRange->muEnd;
+
+        if( uBegin < pRange->muEnd )
+        {
+            pRange->mpFunc( pRange->mpvArg, iContextId, uBegin, uEnd );
+        }
+    }
+
+    while( !pRange->mbStatic )
+    {
+        UINT    uGrain = (UINT)AtomicLoad( (volatile LONG*)&pRange->muGrain );
+        UINT    uBegin = (UINT)AtomicLoad( (volatile LONG*)&pRange->muNext );
+        UINT    uEnd;
+
+        //
+        //  Claim [uBegin, uEnd).  A compare-exchange rather than an add so
+        //  muNext never moves past muEnd and cannot wrap.
+        //
+        for( ;; )
+        {
+            if( uBegin >= pRange->muEnd )
+            {
+                break;
+            }
+
+            uEnd = pRange->muEnd - uBegin > uGrain ? uBegin + uGrain : pRange->muEnd;
+
+            UINT    uPrev = (UINT)AtomicCompareExchange( 
+                (volatile LONG*)&pRange->muNext, 
+                (LONG)uEnd, 
+                (LONG)uBegin );
+
+            if( uPrev == uBegin )
+            {
+                break;
+            }
+
+            uBegin = uPrev;
+        }
+
+        if( uBegin >= pRange->muEnd )
+        {
+            break;
+        }
+
+        if( !pRange->mbAutoGrain )
+        {
+            pRange->mpFunc( pRange->mpvArg, iContextId, uBegin, uEnd );
+            continue;
+        }
+
+        INT64   llStart = GetTimerTicks();
+
+        pRange->mpFunc( pRange->mpvArg, iContextId, uBegin, uEnd );
+
+        INT64   llTicks = GetTimerTicks() - llStart;
+        INT64   llGrain;
+
+        //
+        //  Size the next range to take the target time at the cost per 
+        //  index just measured.  A range too fast to measure doubles.
+        //
+        if( llTicks > 0 )
+        {
+            llGrain = gllParallelForTargetTicks * ( uEnd - uBegin ) / llTicks;
+        }
+        else
+        {
+            llGrain = 2 * (INT64)uGrain;
+        }
+
+        if( llGrain < 1 )
+        {
+            llGrain = 1;
+        }
+        else if( llGrain > pRange->muMaxGrain )
+        {
+            llGrain = pRange->muMaxGrain;
+        }
+
+        //  Another task may have measured at the same time; either value
+        //  is a fine estimate.
+        AtomicCompareExchange( (volatile LONG*)&pRange->muGrain, (LONG)llGrain, (LONG)uGrain );
+    }
+
+    if( 0 == AtomicDecrement( (volatile LONG*)&pRange->muActive ) )
+    {
+        if( pRange->mbAutoGrain )
+        {
+            LONG    lCached = AtomicLoad( pRange->plCachedGrain );
+
+            AtomicCompareExchange( 
+                pRange->plCachedGrain, 
+                AtomicLoad( (volatile LONG*)&pRange->muGrain ), 
+                lCached );
+        }
+
+        FrameFree( pRange );
+    }
+}
+
+#ifdef PROFILEGPA
+//
+//  INTERNAL
+//  Copies a taskset name, truncated to MAX_TASKSETNAMELENGTH, into the 
+//  frame arena.  Freed by TaskMgrTbb::FreeTaskSet.
+//
+static CHAR*
+CopySetName(
+    LPCSTR                  szSetName )
+{
+    size_t                  uLength = strlen( szSetName ) + 1;
+
+    if( uLength > MAX_TASKSETNAMELENGTH )
+    {
+        uLength = MAX_TASKSETNAMELENGTH;
+    }
+
+    CHAR*                   pszName = (CHAR*)FrameAlloc( uLength );
+
+    StringCbCopyA( pszName, uLength, szSetName );
+
+    return pszName;
+}
+#endif // PROFILEGPA
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Implementation of TaskSetAffinity
+//
+///////////////////////////////////////////////////////////////////////////////
+
+TaskSetAffinity::TaskSetAffinity()
+    : mpuThreads( NULL )
+    , muSize( 0 )
+{
+}
+
+TaskSetAffinity::~TaskSetAffinity()
+{
+    delete [] mpuThreads;
+}
+
+UINT*
+TaskSetAffinity::Reset(
+    UINT                    uSize )
+{
+    if( uSize != muSize )
+    {
+        delete [] mpuThreads;
+
+        mpuThreads = new UINT[ uSize ];
+        muSize = uSize;
+
+        memset( mpuThreads, 0, uSize * sizeof( UINT ) );
+    }
+
+    return mpuThreads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Implementation of TaskMgrTbb
+//
+///////////////////////////////////////////////////////////////////////////////
+
+TaskMgrTbb::TaskMgrTbb()
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    : miDemoModeTBBThreadCountOverride( TASKSCHEDULER_THREADS_AUTOMATIC )
+#else
+    : miDemoModeTBBThreadCountOverride( task_scheduler_init::automatic )
+#endif
+    , mbPinThreads( FALSE )
+    , muSetChunkCount( 0 )
+    , mlGrowLock( 0 )
+    , mllFreeSetHead( MAKE_FREE_HEAD( TASKSET_FREE_NIL, 0 ) )
+    , muCacheEpoch( 0 )
+    , muContextCount( 0 )
+    , mpTbbContextId( NULL )
+    , mpTbbInit( NULL )
+{
+    memset(
+        mpSetChunks,
+        0x0,
+        sizeof( mpSetChunks ) );
+}
+
+TaskMgrTbb::~TaskMgrTbb()
+{
+}
+
+BOOL
+TaskMgrTbb::Init()
+{
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    if( !gScheduler.Init( miDemoModeTBBThreadCountOverride, mbPinThreads ) )
+    {
+        return FALSE;
+    }
+#else
+    mpTbbContextId = new TbbContextId( mbPinThreads );
+
+    mpTbbInit = new task_scheduler_init( miDemoModeTBBThreadCountOverride );
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    muContextCount = gScheduler.GetContextCount();
+#else
+    if( miDemoModeTBBThreadCountOverride > 0 )
+    {
+        muContextCount = (UINT)miDemoModeTBBThreadCountOverride;
+    }
+    else
+    {
+        muContextCount = (UINT)task_scheduler_init::default_num_threads();
+    }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    gllParallelForTargetTicks = GetTimerFrequency() * PARALLELFOR_TARGET_RANGE_US / 1000000;
+
+    gpContextStats = new ContextStats[ muContextCount ];
+    memset( (VOID*)gpContextStats, 0, muContextCount * sizeof( ContextStats ) );
+    guContextStatsCount = muContextCount;
+    gdNanosecondsPerTick = 1e9 / (DOUBLE)GetTimerFrequency();
+
+    //  One frame arena per context.
+    gpFrameArenas = new FrameArena[ muContextCount ];
+    guFrameArenaCount = muContextCount;
+
+    //  Reset thread override demo variable.
+    miDemoModeTBBThreadCountOverride = -1;
+
+    //  Discard slot caches left over from a previous Init.
+    ++muCacheEpoch;
+
+    //  Start with one chunk so the first frame does not pay for growth.
+    return GrowTaskSets();
+}
+
+VOID
+TaskMgrTbb::Shutdown()
+{
+    BOOL                    bWaited;
+
+    //  Tasks held back by a replay are in no queue, so the wait below would
+    //  never see them finish.  End the replay first; this runs them while
+    //  the taskset table still exists.
+    if( SCHEDULE_REPLAY == glScheduleMode )
+    {
+        EndSchedule();
+    }
+
+    //  
+    //  Wait for any left-over tasksets.  Running tasks can still create 
+    //  tasksets (coroutines create one for every await), so repeat until a
+    //  pass finds nothing incomplete.  Completed sets the application has
+    //  not released are skipped; their handles may be going stale under us.
+    do
+    {
+        bWaited = FALSE;
+
+        for( UINT uChunk = 0; uChunk < muSetChunkCount; ++uChunk )
+        {
+            for( UINT uIdx = 0; uIdx < TASKSET_CHUNK_SIZE; ++uIdx )
+            {
+                TaskSetTbb*     pSet = mpSetChunks[ uChunk ][ uIdx ];
+
+                if( 0 != AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) )
+                {
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+                    gScheduler.WaitForZero( &pSet->muCompletionCount, pSet->muPriority );
+#else
+                    WaitForSet( pSet->mhTaskset );
+#endif // TASKMGR_SCHEDULER_PORTABLE
+                    bWaited = TRUE;
+                }
+            }
+        }
+    } while( bWaited );
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    //  Stop the workers before the table is released; a worker can still 
+    //  be finishing the bookkeeping of the last taskset it completed.
+    gScheduler.Shutdown();
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    //  Write out a recording the application did not end.  Nothing is 
+    //  running any more, so no task start can be recorded after this.
+    if( SCHEDULE_NORMAL != glScheduleMode )
+    {
+        EndSchedule();
+    }
+
+    //
+    //  Release the taskset table.
+    for( UINT uChunk = 0; uChunk < muSetChunkCount; ++uChunk )
+    {
+        for( UINT uIdx = 0; uIdx < TASKSET_CHUNK_SIZE; ++uIdx )
+        {
+            TaskSetTbb*     pSet = mpSetChunks[ uChunk ][ uIdx ];
+
+#ifndef TASKMGR_SCHEDULER_PORTABLE
+            if( pSet->mbLaunched && !pSet->mbHasBeenWaitedOn )
+            {
+                //  TBB asserts if a root task is destroyed before it has
+                //  been waited on.  The set is complete, so this returns
+                //  immediately.
+                pSet->wait_for_all();
+            }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+            DestroyTaskSet( pSet );
+        }
+
+        delete [] mpSetChunks[ uChunk ];
+        mpSetChunks[ uChunk ] = NULL;
+    }
+
+    muSetChunkCount = 0;
+    mllFreeSetHead = MAKE_FREE_HEAD( TASKSET_FREE_NIL, 0 );
+    
+#ifndef TASKMGR_SCHEDULER_PORTABLE
+    delete mpTbbInit;
+    delete mpTbbContextId;
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    guFrameArenaCount = 0;
+    delete [] gpFrameArenas;
+    gpFrameArenas = NULL;
+
+    guContextStatsCount = 0;
+    delete [] gpContextStats;
+    gpContextStats = NULL;
+}
+
+VOID
+TaskMgrTbb::BeginFrame()
+{
+    //  Contexts pick up the new frame on their next allocation.
+    AtomicIncrement( &glFrame );
+}
+
+BOOL
+TaskMgrTbb::GetIdleStats(
+    TASKMGR_IDLE_STATS*     pStats )
+{
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    TaskSchedulerIdleStats  Stats;
+
+    gScheduler.GetIdleStats( &Stats );
+
+    pStats->ullSpins = Stats.ullSpins;
+    pStats->ullSpinHits = Stats.ullSpinHits;
+    pStats->ullParks = Stats.ullParks;
+    pStats->ullSpinMicroseconds = Stats.ullSpinMicroseconds;
+    pStats->ullWakeups = Stats.ullWakeups;
+
+    return TRUE;
+#else
+    memset( pStats, 0, sizeof( *pStats ) );
+
+    return FALSE;
+#endif // TASKMGR_SCHEDULER_PORTABLE
+}
+
+BOOL
+TaskMgrTbb::GetStats(
+    UINT                    uContext,
+    TASKMGR_STATS*          pStats )
+{
+    UINT                    uFirst = uContext;
+    UINT                    uLast = uContext + 1;
+
+    memset( pStats, 0, sizeof( *pStats ) );
+
+    if( TASKMGR_STATS_ALL_CONTEXTS == uContext )
+    {
+        uFirst = 0;
+        uLast = guContextStatsCount;
+    }
+    else if( uContext >= guContextStatsCount )
+    {
+        return FALSE;
+    }
+
+    for( uContext = uFirst; uContext < uLast; ++uContext )
+    {
+        ContextStats*       pContext = &gpContextStats[ uContext ];
+
+        pStats->ullTasks += (UINT64)AtomicLoad64( &pContext->mllTasks );
+        pStats->ullRunMicroseconds += (UINT64)( 
+            (DOUBLE)AtomicLoad64( &pContext->mllRunTicks ) * gdNanosecondsPerTick / 1000.0 );
+
+        for( UINT uBucket = 0; uBucket < TASKMGR_HISTOGRAM_BUCKETS; ++uBucket )
+        {
+            UINT64          ullStart = (UINT64)AtomicLoad64( &pContext->mllStartLatency[ uBucket ] );
+            UINT64          ullRun = (UINT64)AtomicLoad64( &pContext->mllRunLatency[ uBucket ] );
+
+            pStats->StartLatency.ullBuckets[ uBucket ] += ullStart;
+            pStats->StartLatency.ullCount += ullStart;
+            pStats->RunLatency.ullBuckets[ uBucket ] += ullRun;
+            pStats->RunLatency.ullCount += ullRun;
+        }
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+        TaskSchedulerStats  Stats;
+
+        gScheduler.GetContextStats( uContext, &Stats );
+
+        pStats->ullSteals += Stats.ullSteals;
+        pStats->ullFailedSteals += Stats.ullFailedSteals;
+        pStats->ullSpinMicroseconds += Stats.ullSpinMicroseconds;
+        pStats->ullIdleMicroseconds += Stats.ullIdleMicroseconds;
+
+        if( Stats.ullQueueHighWater > pStats->ullQueueHighWater )
+        {
+            pStats->ullQueueHighWater = Stats.ullQueueHighWater;
+        }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+    }
+
+    return TRUE;
+}
+
+UINT64
+TaskMgrTbb::GetHistogramPercentile(
+    const TASKMGR_HISTOGRAM* pHistogram,
+    DOUBLE                  dPercentile )
+{
+    UINT64                  ullTarget = (UINT64)( (DOUBLE)pHistogram->ullCount * dPercentile / 100.0 );
+    UINT64                  ullSeen = 0;
+
+    if( 0 == pHistogram->ullCount )
+    {
+        return 0;
+    }
+
+    if( 0 == ullTarget )
+    {
+        ullTarget = 1;
+    }
+
+    for( UINT uBucket = 0; uBucket < TASKMGR_HISTOGRAM_BUCKETS; ++uBucket )
+    {
+        ullSeen += pHistogram->ullBuckets[ uBucket ];
+
+        if( ullSeen >= ullTarget )
+        {
+            //  Last value of the bucket.
+            if( uBucket < 2 * TASKMGR_HISTOGRAM_SUB_BUCKETS )
+            {
+                return uBucket;
+            }
+
+            UINT            uShift = uBucket / TASKMGR_HISTOGRAM_SUB_BUCKETS - 1;
+            UINT64          ullSub = uBucket % TASKMGR_HISTOGRAM_SUB_BUCKETS + TASKMGR_HISTOGRAM_SUB_BUCKETS;
+
+            return ( ( ullSub + 1 ) << uShift ) - 1;
+        }
+    }
+
+    return 0;
+}
+
+BOOL
+TaskMgrTbb::WriteTrace(
+    LPCSTR                  szPath )
+{
+#ifdef TASKMGR_TRACE
+    return TraceWriteChromeJson( szPath );
+#else
+    UNREFERENCED_PARAMETER( szPath );
+
+    return FALSE;
+#endif // TASKMGR_TRACE
+}
+
+BOOL
+TaskMgrTbb::CancelTaskSet(
+    TASKSETHANDLE           hSet )
+{
+    TaskSetTbb*             pSet = GetTaskSet( hSet );
+
+    if( NULL == pSet || 0 == AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) )
+    {
+        return FALSE;
+    }
+
+    AtomicStore( &pSet->mlCancelled, 1 );
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::SetTaskSetDeadline(
+    TASKSETHANDLE           hSet,
+    UINT64                  ullMicroseconds )
+{
+    TaskSetTbb*             pSet = GetTaskSet( hSet );
+    INT64                   llDeadlineTicks;
+    INT64                   llOldTicks;
+
+    if( NULL == pSet )
+    {
+        return FALSE;
+    }
+
+    llDeadlineTicks = GetTimerTicks() + 
+        (INT64)( (DOUBLE)ullMicroseconds * (DOUBLE)GetTimerFrequency() / 1000000.0 );
+
+    do
+    {
+        llOldTicks = AtomicLoad64( &pSet->mllDeadlineTicks );
+    }
+    while( llOldTicks != AtomicCompareExchange64( &pSet->mllDeadlineTicks, llDeadlineTicks, llOldTicks ) );
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::IsCancelled()
+{
+    TaskSetTbb*             pSet = GetRunningSet();
+
+    return pSet && GenericTask::IsSetCancelled( pSet );
+}
+
+BOOL
+TaskMgrTbb::BeginRecording(
+    OPTIONAL LPCSTR         szPath,
+    UINT                    uFuzzSeed )
+{
+    if( SCHEDULE_NORMAL != glScheduleMode )
+    {
+        return FALSE;
+    }
+
+    gpScheduleEvents = new ScheduleEvent[ MAX_SCHEDULE_EVENTS ];
+    glScheduleEvents = 0;
+    glSetOrdinal = 0;
+    guFuzzSeed = uFuzzSeed;
+    gpszSchedulePath = NULL;
+
+    if( szPath )
+    {
+        size_t              uLength = strlen( szPath ) + 1;
+
+        gpszSchedulePath = new CHAR[ uLength ];
+        memcpy( gpszSchedulePath, szPath, uLength );
+    }
+
+    AtomicStore( &glScheduleMode, SCHEDULE_RECORD );
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::BeginReplay(
+    LPCSTR                  szPath )
+{
+    FILE*                   pFile;
+    ScheduleFileHeader      Header;
+    BOOL                    bRead;
+
+    if( SCHEDULE_NORMAL != glScheduleMode )
+    {
+        return FALSE;
+    }
+
+    pFile = fopen( szPath, "rb" );
+
+    if( NULL == pFile )
+    {
+        printf( "Could not open schedule file %s.\n", szPath );
+        return FALSE;
+    }
+
+    bRead = 1 == fread( &Header, sizeof( Header ), 1, pFile ) &&
+        SCHEDULE_FILE_MAGIC == Header.muMagic &&
+        SCHEDULE_FILE_VERSION == Header.muVersion &&
+        Header.muEvents <= MAX_SCHEDULE_EVENTS;
+
+    if( bRead )
+    {
+        gpScheduleEvents = new ScheduleEvent[ Header.muEvents + 1 ];
+
+        bRead = Header.muEvents == fread( gpScheduleEvents, sizeof( ScheduleEvent ), Header.muEvents, pFile );
+    }
+
+    fclose( pFile );
+
+    if( !bRead )
+    {
+        printf( "Schedule file %s is not a valid recording.\n", szPath );
+
+        delete [] gpScheduleEvents;
+        gpScheduleEvents = NULL;
+
+        return FALSE;
+    }
+
+    if( Header.muContexts != muContextCount )
+    {
+        printf( "Schedule file %s was recorded with %u contexts, replaying with %u.\n",
+            szPath,
+            Header.muContexts,
+            muContextCount );
+    }
+
+    gReplayKeys.resize( Header.muEvents );
+
+    for( UINT uEvent = 0; uEvent < Header.muEvents; ++uEvent )
+    {
+        gReplayKeys[ uEvent ] = GetReplayKey( gpScheduleEvents[ uEvent ].mullOrdinal, gpScheduleEvents[ uEvent ].muTask );
+    }
+
+    std::sort( gReplayKeys.begin(), gReplayKeys.end() );
+
+    glScheduleEvents = (LONG)Header.muEvents;
+    glSetOrdinal = 0;
+    guFuzzSeed = 0;
+    guReplayCursor = 0;
+    gbReplayTurnTaken = FALSE;
+    glReplayContextMisses = 0;
+
+    AtomicStore( &glScheduleMode, SCHEDULE_REPLAY );
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::EndSchedule()
+{
+    BOOL                    bResult = TRUE;
+    LONG                    lMode = glScheduleMode;
+
+    if( SCHEDULE_NORMAL == lMode )
+    {
+        return FALSE;
+    }
+
+    AtomicStore( &glScheduleMode, SCHEDULE_NORMAL );
+
+    if( SCHEDULE_RECORD == lMode )
+    {
+        ScheduleFileHeader  Header;
+
+        Header.muMagic = SCHEDULE_FILE_MAGIC;
+        Header.muVersion = SCHEDULE_FILE_VERSION;
+        Header.muEvents = (UINT)glScheduleEvents;
+        Header.muContexts = muContextCount;
+        Header.muFuzzSeed = guFuzzSeed;
+
+        if( Header.muEvents > MAX_SCHEDULE_EVENTS )
+        {
+            printf( "Schedule recording truncated to %u of %u task starts.\n",
+                MAX_SCHEDULE_EVENTS,
+                Header.muEvents );
+
+            Header.muEvents = MAX_SCHEDULE_EVENTS;
+        }
+
+        if( gpszSchedulePath )
+        {
+            FILE*           pFile = fopen( gpszSchedulePath, "wb" );
+
+            bResult = NULL != pFile &&
+                1 == fwrite( &Header, sizeof( Header ), 1, pFile ) &&
+                Header.muEvents == fwrite( gpScheduleEvents, sizeof( ScheduleEvent ), Header.muEvents, pFile );
+
+            if( pFile && 0 != fclose( pFile ) )
+            {
+                bResult = FALSE;
+            }
+
+            if( !bResult )
+            {
+                printf( "Could not write schedule file %s.\n", gpszSchedulePath );
+            }
+        }
+    }
+    else
+    {
+        if( guReplayCursor < (UINT)glScheduleEvents )
+        {
+            printf( "Schedule replay ended after %u of %u task starts.\n",
+                guReplayCursor,
+                (UINT)glScheduleEvents );
+        }
+
+        if( 0 != glReplayContextMisses )
+        {
+            printf( "Schedule replay ran %u task starts on another context than recorded.\n",
+                (UINT)glReplayContextMisses );
+        }
+
+        //  Nothing waits on tasks still held back any more.  Run them here 
+        //  rather than leave their tasksets incomplete; a task still being
+        //  started elsewhere may yet add to them, so take them under the lock.
+        ReplayTask          Task;
+
+        LockReplay();
+        guReplayCursor = (UINT)glScheduleEvents;
+        UnlockReplay();
+
+        while( NextReplayTask( &Task, FALSE ) )
+        {
+            GenericTask::RunReplayTasks( &Task );
+        }
+
+        gReplayKeys.clear();
+    }
+
+    delete [] gpScheduleEvents;
+    gpScheduleEvents = NULL;
+    glScheduleEvents = 0;
+
+    delete [] gpszSchedulePath;
+    gpszSchedulePath = NULL;
+
+    return bResult;
+}
+
+BOOL
+TaskMgrTbb::CreateTaskSet(
+    TASKSETFUNC             pFunc,
+    VOID*                   pArg,
+    UINT                    uTaskCount,
+    TASKSETHANDLE*          pInDepends,
+    UINT                    uInDepends,
+    OPTIONAL LPCSTR         szSetName,
+    TASKSETHANDLE*          pOutHandle,
+    TASKSETPRIORITY         ePriority,
+    TaskSetAffinity*        pAffinity )
+{
+    TASKSETHANDLE           hSet;
+    TASKSETHANDLE*          pDepends = pInDepends;
+    UINT                    uDepends = uInDepends;
+    TaskSetTbb*             pSet;
+
+    //  Validate incomming parameters
+    if( 0 == uTaskCount || NULL == pFunc || ePriority >= TASKSET_PRIORITY_COUNT )
+    {
+        return FALSE;
+    }
+
+    //
+    //  Every dependency must still be referenced by the caller.  A stale
+    //  handle means the app released it already and its slot may have been 
+    //  reused by an unrelated taskset.
+    //
+    for( UINT uDepend = 0; uDepend < uDepends; ++uDepend )
+    {
+        if( NULL == GetTaskSet( pDepends[ uDepend ] ) )
+        {
+            printf( "Invalid or released dependency handle passed to CreateTaskSet.\n" );
+            return FALSE;
+        }
+    }
+
+    //
+    //  Allocate and setup the internal taskset
+    //
+    hSet = AllocateTaskSet();
+
+    if( TASKSETHANDLE_INVALID == hSet )
+    {
+        return FALSE;
+    }
+
+    pSet = GetTaskSet( hSet );
+
+    //  NOTE: one start count per dependency plus one held by this function
+    //  while the dependencies are wired up, so the set cannot be scheduled
+    //  before CreateTaskSet is done with it.
+    pSet->muStartCount   = uDepends + 1;
+
+    //  NOTE: one refcount is owned by the tasking system the other 
+    //  by the caller.
+    pSet->muRefCount     = 2;
+
+    pSet->mpFunc         = pFunc;
+    pSet->mpvArg         = pArg;
+    pSet->muSize         = uTaskCount;
+    pSet->muPriority     = ePriority;
+    pSet->muCompletionCount = uTaskCount;
+    pSet->mpuAffinity    = pAffinity ? pAffinity->Reset( uTaskCount ) : NULL;
+
+    pSet->muGrain        = GetTaskSetGrain( uTaskCount );
+    pSet->mullOrdinal    = NextSetOrdinal();
+
+#ifdef PROFILEGPA
+    //
+    //  Track task name if profiling is enabled
+    pSet->mpszSetName = CopySetName( szSetName ? szSetName : "Unnamed Task" );
+#elif !defined( TASKMGR_TRACE )
+    UNREFERENCED_PARAMETER( szSetName );
+#endif // PROFILEGPA
+
+#ifdef TASKMGR_TRACE
+    pSet->mpszTraceName = TraceInternName( szSetName ? szSetName : "Unnamed Task" );
+#endif // TASKMGR_TRACE
+
+    //
+    //  Iterate over the dependency list and push this taskset onto the
+    //  successor list of each dependency.  A dependency that has already
+    //  completed has a closed list; count it as satisfied right away.
+    //
+    SuccessorLink*          pLinks = pSet->GetLinks( uDepends );
+
+    for( UINT uDepend = 0; uDepend < uDepends; ++uDepend )
+    {
+        TaskSetTbb*         pDependsOn = GetTaskSet( pDepends[ uDepend ] );
+
+        pLinks[ uDepend ].mpSuccessor = pSet;
+
+        //  A dependency cancelled so far cancels this set too; one 
+        //  cancelled later does so when it completes.
+        if( 0 != AtomicLoad( &pDependsOn->mlCancelled ) )
+        {
+            pSet->mlCancelled = 1;
+        }
+
+        if( !pDependsOn->AddSuccessor( &pLinks[ uDepend ] ) )
+        {
+            AtomicDecrement( (volatile LONG*)&pSet->muStartCount );
+        }
+    }
+
+    //  Set output taskset handle
+    *pOutHandle = hSet;
+
+    //
+    //  Drop the start count held while wiring.  If every dependency has
+    //  completed (or there were none) the taskset is scheduled now.
+    //
+    if( 0 == AtomicDecrement( (volatile LONG*)&pSet->muStartCount ) )
+    {
+        pSet->execute();
+    }
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::ParallelFor(
+    PARALLELFORFUNC         pFunc,
+    VOID*                   pArg,
+    UINT                    uBegin,
+    UINT                    uEnd,
+    UINT                    uGrain,
+    TASKSETHANDLE*          pDepends,
+    UINT                    uDepends,
+    OPTIONAL LPCSTR         szSetName,
+    TASKSETHANDLE*          pOutHandle,
+    TASKSETPRIORITY         ePriority,
+    TaskSetAffinity*        pAffinity )
+{
+    ParallelForRange*       pRange;
+    UINT                    uCount = uEnd > uBegin ? uEnd - uBegin : 0;
+    UINT                    uTaskCount;
+    UINT                    uMaxGrain;
+
+    if( NULL == pFunc )
+    {
+        return FALSE;
+    }
+
+    uMaxGrain = uCount / ( muContextCount * PARALLELFOR_RANGES_PER_CONTEXT );
+
+    if( 0 == uMaxGrain )
+    {
+        uMaxGrain = 1;
+    }
+
+    pRange = new( FrameAlloc( sizeof( ParallelForRange ) ) ) ParallelForRange;
+
+    pRange->mpFunc = pFunc;
+    pRange->mpvArg = pArg;
+    pRange->muBegin = uBegin;
+    pRange->muEnd = uEnd;
+    pRange->muNext = uBegin;
+    pRange->mbStatic = NULL != pAffinity || SCHEDULE_NORMAL != AtomicLoad( &glScheduleMode );
+    pRange->mbAutoGrain = ( PARALLELFOR_GRAIN_AUTO == uGrain ) && !pRange->mbStatic;
+    pRange->plCachedGrain = &glParallelForGrain[ 
+        ( (size_t)pFunc >> 4 ) % PARALLELFOR_GRAIN_CACHE_SIZE ];
+
+    if( pRange->mbAutoGrain )
+    {
+        //  Start from the grain the last call measured, or probe with a
+        //  single index the first time.
+        uGrain = (UINT)AtomicLoad( pRange->plCachedGrain );
+
+        if( 0 == uGrain )
+        {
+            uGrain = 1;
+        }
+        else if( uGrain > uMaxGrain )
+        {
+            uGrain = uMaxGrain;
+        }
+    }
+
+    else if( PARALLELFOR_GRAIN_AUTO == uGrain )
+    {
+        //  Static ranges must not change size from call to call or the
+        //  recorded affinity or schedule would no longer match them.
+        uGrain = uMaxGrain;
+    }
+
+    pRange->muGrain = uGrain;
+    pRange->muMaxGrain = uMaxGrain;
+
+    //
+    //  One task per context is enough since every task keeps claiming 
+    //  ranges, but there is no point in more tasks than ranges.  Static
+    //  ranges get a task each.  An empty range still gets one task so the
+    //  caller has a set to wait on.
+    //
+    uTaskCount = ( uCount + uGrain - 1 ) / uGrain;
+
+    if( uTaskCount > muContextCount && !pRange->mbStatic )
+    {
+        uTaskCount = muContextCount;
+    }
+    else if( 0 == uTaskCount )
+    {
+        uTaskCount = 1;
+    }
+
+    pRange->muActive = uTaskCount;
+
+    if( !CreateTaskSet(
+        ParallelForTask,
+        pRange,
+        uTaskCount,
+        pDepends,
+        uDepends,
+        szSetName,
+        pOutHandle,
+        ePriority,
+        pAffinity ) )
+    {
+        FrameFree( pRange );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL
+TaskMgrTbb::CreateSignalSet(
+    OPTIONAL LPCSTR         szSetName,
+    TASKSETHANDLE*          pOutHandle )
+{
+    TASKSETHANDLE           hSet;
+    TaskSetTbb*             pSet;
+
+    hSet = AllocateTaskSet();
+
+    if( TASKSETHANDLE_INVALID == hSet )
+    {
+        return FALSE;
+    }
+
+    pSet = GetTaskSet( hSet );
+
+    //  NOTE: the start count never reaches zero so the set is never 
+    //  launched.  SignalSet drops the single completion count.
+    pSet->muStartCount   = 1;
+    pSet->muRefCount     = 2;
+    pSet->mpFunc         = NULL;
+    pSet->mpvArg         = NULL;
+    pSet->muSize         = 0;
+    pSet->muPriority     = TASKSET_PRIORITY_NORMAL;
+    pSet->muCompletionCount = 1;
+    pSet->mbSignalSet    = TRUE;
+
+#ifdef PROFILEGPA
+    pSet->mpszSetName = CopySetName( szSetName ? szSetName : "Unnamed Signal" );
+#else
+    UNREFERENCED_PARAMETER( szSetName );
+#endif // PROFILEGPA
+
+    *pOutHandle = hSet;
+
+    return TRUE;
+}
+
+VOID
+TaskMgrTbb::SignalSet(
+    TASKSETHANDLE           hSet )
+{
+    TaskSetTbb*             pSet = GetTaskSet( hSet );
+
+    if( NULL == pSet || !pSet->mbSignalSet )
+    {
+        printf( "Invalid or released signal set passed to SignalSet.\n" );
+        return;
+    }
+
+    CompleteTaskSet( hSet, 1 );
+}
+
+VOID
+TaskMgrTbb::ReleaseHandle(
+    TASKSETHANDLE           hSet )
+{
+    TaskSetTbb*             pSet = GetTaskSet( hSet );
+
+    if( NULL == pSet )
+    {
+        return;
+    }
+
+    //
+    //  Until the slot is reused the generation still matches, so a second
+    //  release of the same handle is caught here instead.
+    //
+    if( 0 != AtomicCompareExchange( &pSet->mlHandleReleased, 1, 0 ) )
+    {
+        printf( "Taskset handle released more than once.\n" );
+        return;
+    }
+
+    ReleaseReference( hSet );
+}
+
+VOID
+TaskMgrTbb::ReleaseReference(
+    TASKSETHANDLE           hSet )
+{
+    TaskSetTbb*             pSet = GetSlot( TASKSETHANDLE_SLOT( hSet ) );
+
+    //
+    //  The slot can be reused as soon as the last reference is gone.  Any
+    //  tbb bookkeeping that may still be in flight for the old taskset is 
+    //  handled when the slot is reallocated.
+    //
+    if( 0 == AtomicDecrement( (volatile LONG*)&pSet->muRefCount ) )
+    {
+        FreeTaskSet( TASKSETHANDLE_SLOT( hSet ) );
+    }
+}
+
+
+VOID
+TaskMgrTbb::ReleaseHandles(
+    TASKSETHANDLE*              phSet,
+    UINT                        uSet )
+{
+    for( UINT uIdx = 0; uIdx < uSet; ++uIdx )
+    {
+        ReleaseHandle( phSet[ uIdx ] );
+    }
+}
+
+VOID
+TaskMgrTbb::WaitForSet(
+    TASKSETHANDLE               hSet )
+{
+    TaskSetTbb*                 pSet = GetTaskSet( hSet );
+
+    //
+    //  A stale handle belongs to a taskset that completed and was released.
+    if( NULL == pSet )
+    {
+        return;
+    }
+
+    //  The wait can run other tasks on this thread, or resume on another.
+    TaskSetTbb*                 pRunningSet = GetRunningSet();
+    ScheduleScope*              pScope = GetScheduleScope();
+
+    //  A replayed task that waits lets the tasks after it start.
+    if( SCHEDULE_REPLAY == AtomicLoad( &glScheduleMode ) )
+    {
+        GenericTask::ReleaseReplayTurn();
+    }
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+    //
+    //  The application thread watches for a replay that stalls; tasks 
+    //  that wait leave it to that thread.
+    if( NULL == pRunningSet && SCHEDULE_REPLAY == AtomicLoad( &glScheduleMode ) )
+    {
+        GenericTask::WaitForReplay( pSet );
+    }
+
+    //
+    //  Help the scheduler run tasks until the set completes, or with 
+    //  TASKMGR_SCHEDULER_FIBERS suspend the calling task's fiber.  The 
+    //  portable scheduler has no wait-once restriction.
+    gScheduler.WaitForZero( &pSet->muCompletionCount, pSet->muPriority );
+#else
+    //
+    //  Yield the main thread to TBB to get our taskset done faster!
+    //  NOTE: tasks can only be waited on once.  After that they will
+    //  deadlock if waited on again.  The first thread to claim the wait 
+    //  calls into tbb; any other thread waiting concurrently (or after)
+    //  spins until the set has completed.  Signal sets have no tbb tasks
+    //  and are always waited on by spinning.
+    if( !pSet->mbSignalSet &&
+        !pSet->mbHasBeenWaitedOn && 
+        0 == AtomicCompareExchange( &pSet->mlWaitClaimed, 1, 0 ) )
+    {
+        pSet->wait_for_all();
+        pSet->mbHasBeenWaitedOn = TRUE;
+    }
+
+    //  Tasks held back by a replay outlive their tbb tasks.
+    if( 0 != AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) )
+    {
+        SpinBackoff         Backoff;
+
+        GenericTask::WaitForReplay( pSet );
+
+        while( 0 != AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) )
+        {
+            Backoff.Pause();
+        }
+    }
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    SetRunningSet( pRunningSet );
+    SetScheduleScope( pScope );
+}
+
+TaskSetTbb*
+TaskMgrTbb::GetTaskSet(
+    TASKSETHANDLE               hSet )
+{
+    UINT                        uSlot = TASKSETHANDLE_SLOT( hSet );
+    UINT                        uChunk = uSlot / TASKSET_CHUNK_SIZE;
+    TaskSetTbb*                 pSet;
+
+    if( TASKSETHANDLE_INVALID == hSet || uChunk >= (UINT)AtomicLoad( (volatile LONG*)&muSetChunkCount ) )
+    {
+        return NULL;
+    }
+
+    pSet = GetSlot( uSlot );
+
+    //  A stale handle may be checked while the slot is being freed.
+    if( (TASKSETHANDLE)AtomicLoad( (volatile LONG*)&pSet->mhTaskset ) != hSet )
+    {
+        return NULL;
+    }
+
+    return pSet;
+}
+
+//
+//  INTERNAL
+//  Returns the calling thread's slot cache, emptying it first if it was 
+//  filled by a different TaskMgrTbb or before the last Init.
+//
+static TaskSetCache*
+GetTaskSetCache(
+    TaskMgrTbb*                 pOwner,
+    UINT                        uEpoch )
+{
+    TaskSetCache*               pCache = &tlsSetCache;
+
+    if( pCache->mpOwner != pOwner || pCache->muEpoch != uEpoch )
+    {
+        pCache->mpOwner = pOwner;
+        pCache->muEpoch = uEpoch;
+        pCache->muFirst = 0;
+        pCache->muCount = 0;
+    }
+
+    return pCache;
+}
+
+TASKSETHANDLE
+TaskMgrTbb::AllocateTaskSet()
+{
+    TaskSetCache*       pCache = GetTaskSetCache( this, muCacheEpoch );
+    TaskSetTbb*         pSet;
+    UINT                uSlot;
+
+    //
+    //  Refill the thread's cache with a batch from the global free list 
+    //  once it holds less than a batch, so the ring always has slots to 
+    //  rotate through (see TaskSetCache).  If the free list is empty, use
+    //  what the cache still holds, or else add a chunk (or wait for another
+    //  thread to finish adding one) and try again.
+    //
+    while( pCache->muCount < TASKSET_BATCH_SIZE )
+    {
+        uSlot = PopTaskSetBatch();
+
+        if( TASKSET_FREE_NIL != uSlot )
+        {
+            for( UINT uIdx = 0; uIdx < TASKSET_BATCH_SIZE; ++uIdx )
+            {
+                TASKSET_CACHE_SLOT( pCache, pCache->muCount++ ) = uSlot;
+                uSlot = GetSlot( uSlot )->muNextFree;
+            }
+        }
+        else if( 0 != pCache->muCount )
+        {
+            break;
+        }
+        else if( !GrowTaskSets() )
+        {
+            printf( "Too many live task sets.\nIncrease MAX_TASKSET_CHUNKS\n" );
+            return TASKSETHANDLE_INVALID;
+        }
+    }
+
+    //  Oldest first, see TaskSetCache.
+    uSlot = TASKSET_CACHE_SLOT( pCache, 0 );
+    pCache->muFirst = ( pCache->muFirst + 1 ) % ARRAYSIZE( pCache->muSlots );
+    --pCache->muCount;
+    pSet = GetSlot( uSlot );
+
+    RearmTaskSet( pSet );
+
+    pSet->mbSignalSet = FALSE;
+    pSet->mpSuccessors = NULL;
+    pSet->mlHandleReleased = 0;
+    AtomicStore( (volatile LONG*)&pSet->mhTaskset, (LONG)MAKE_TASKSETHANDLE( uSlot, pSet->muGeneration ) );
+
+    return pSet->mhTaskset;
+}
 
 VOID
-TaskMgrTbb::ReleaseHandles(
-    TASKSETHANDLE*              phSet,
-    UINT                        uSet )
+TaskMgrTbb::RearmTaskSet(
+    TaskSetTbb*                 pSet )
 {
-    for( UINT uIdx = 0; uIdx < uSet; ++uIdx )
+#ifndef TASKMGR_SCHEDULER_PORTABLE
+    //
+    //  The previous taskset in this slot may have been released before tbb 
+    //  finished retiring its last child, which decrements the root's count
+    //  after the callback (and our completion) has run.  This is at most a
+    //  few instructions away.  The root task is then reused as-is rather
+    //  than destroyed, so nobody ever needs to wait on a stale taskset.
+    //
+    if( pSet->mbLaunched )
     {
-        ReleaseHandle( phSet[ uIdx ] );
+        SpinBackoff         Backoff;
+
+        while( pSet->ref_count() > 1 )
+        {
+            Backoff.Pause();
+        }
     }
+
+    pSet->set_ref_count( 2 );
+#endif // TASKMGR_SCHEDULER_PORTABLE
+
+    pSet->mbLaunched = FALSE;
+    pSet->mbHasBeenWaitedOn = FALSE;
+    pSet->mlWaitClaimed = 0;
+    pSet->mlCancelled = 0;
+    pSet->mllDeadlineTicks = 0;
+}
+
+UINT
+TaskMgrTbb::GetTaskSetGrain(
+    UINT                        uTaskCount )
+{
+    //  Run large sets in ranges of muGrain tasks so each context reports
+    //  its tasks with a few decrements, while still leaving 
+    //  TASKSET_GRAINS_PER_CONTEXT ranges per context to balance the load.
+    UINT                        uGrain = uTaskCount / ( muContextCount * TASKSET_GRAINS_PER_CONTEXT );
+
+    return 0 == uGrain ? 1 : uGrain;
 }
 
 VOID
-TaskMgrTbb::WaitForSet(
-    TASKSETHANDLE               hSet )
+TaskMgrTbb::FreeTaskSet(
+    UINT                        uSlot )
 {
+    TaskSetCache*               pCache = GetTaskSetCache( this, muCacheEpoch );
+    TaskSetTbb*                 pSet = GetSlot( uSlot );
+
     //
-    //  Yield the main thread to TBB to get our taskset done faster!
-    //  NOTE: tasks can only be waited on once.  After that they will
-    //  deadlock if waited on again.
-    if( !mSets[ hSet ]->mbHasBeenWaitedOn )
+    //  Invalidate outstanding handles to this slot before it can be reused.
+    //
+    pSet->muGeneration = ( pSet->muGeneration + 1 ) % TASKSET_GENERATION_LIMIT;
+    AtomicStore( (volatile LONG*)&pSet->mhTaskset, (LONG)TASKSETHANDLE_INVALID );
+
+    if( pSet->mpszSetName )
+    {
+        FrameFree( pSet->mpszSetName );
+        pSet->mpszSetName = NULL;
+    }
+
+    //
+    //  If the cache is full hand its oldest batch back to the global list,
+    //  keeping the slots freed most recently at the back of the ring.
+    //
+    if( ARRAYSIZE( pCache->muSlots ) == pCache->muCount )
     {
-        mSets[ hSet ]->wait_for_all();
-        mSets[ hSet ]->mbHasBeenWaitedOn = TRUE;
+        for( UINT uIdx = 0; uIdx < TASKSET_BATCH_SIZE - 1; ++uIdx )
+        {
+            GetSlot( TASKSET_CACHE_SLOT( pCache, uIdx ) )->muNextFree = TASKSET_CACHE_SLOT( pCache, uIdx + 1 );
+        }
+
+        PushTaskSetBatch( TASKSET_CACHE_SLOT( pCache, 0 ) );
+
+        pCache->muFirst = ( pCache->muFirst + TASKSET_BATCH_SIZE ) % ARRAYSIZE( pCache->muSlots );
+        pCache->muCount -= TASKSET_BATCH_SIZE;
     }
 
+    TASKSET_CACHE_SLOT( pCache, pCache->muCount++ ) = uSlot;
 }
 
-TASKSETHANDLE
-TaskMgrTbb::AllocateTaskSet()
+VOID
+TaskMgrTbb::PushTaskSetBatch(
+    UINT                        uFirstSlot )
 {
-    TaskSetTbb*         pSet = new( task::allocate_root() ) TaskSetTbb();
-    UINT                uSet = muNextFreeSet;
+    TaskSetTbb*                 pFirst = GetSlot( uFirstSlot );
+    INT64                       llHead;
 
     //
-    //  Create a new task set and find a slot in the TaskMgrTbb to put it in.
+    //  Pushes keep the tag; only pops need to change it.
     //
-    //  NOTE: if we have too many tasks pending we will spin on the slot.  If
-    //  spinning occures, see TaskMgrTbb.h and increase MAX_TASKSETS
+    do
+    {
+        llHead = AtomicLoad64( &mllFreeSetHead );
+        pFirst->muNextBatch = FREE_HEAD_SLOT( llHead );
+    }
+    while( llHead != AtomicCompareExchange64( 
+        &mllFreeSetHead, 
+        MAKE_FREE_HEAD( uFirstSlot, FREE_HEAD_TAG( llHead ) ), 
+        llHead ) );
+}
+
+UINT
+TaskMgrTbb::PopTaskSetBatch()
+{
+    INT64                       llHead;
+    UINT                        uSlot;
+
     //
-    pSet->set_ref_count( 2 );
+    //  The tag in the high half of the head changes on every pop, so a head
+    //  that was popped and pushed back between our read and our CAS fails
+    //  the CAS (no ABA).  Reading the next link of a batch another thread 
+    //  just popped is safe because slots are never freed before Shutdown; 
+    //  the CAS simply fails.
+    //
+    for( ;; )
+    {
+        llHead = AtomicLoad64( &mllFreeSetHead );
+        uSlot = FREE_HEAD_SLOT( llHead );
+
+        if( TASKSET_FREE_NIL == uSlot )
+        {
+            return TASKSET_FREE_NIL;
+        }
+
+        INT64           llNext = MAKE_FREE_HEAD( GetSlot( uSlot )->muNextBatch, FREE_HEAD_TAG( llHead ) + 1 );
+
+        if( llHead == AtomicCompareExchange64( &mllFreeSetHead, llNext, llHead ) )
+        {
+            return uSlot;
+        }
+    }
+}
+
+BOOL
+TaskMgrTbb::GrowTaskSets()
+{
+    UINT                        uChunk = muSetChunkCount;
 
     //
-    //  NOTE: Allocating tasksets is not thread-safe due to allocation of the
-    //  slot for the task pointer.  This can be easily made threadsafe with 
-    //  an interlocked op on the muNextFreeSet variable and a spin on the slot.  
-    //  It will cost a small amount of performance.
+    //  Only one thread grows the table.  Others spin until it is done and
+    //  then retry the free list, which by then holds the new chunk.
     //
-    while( NULL != mSets[ uSet ] && 0 != mSets[ uSet ]->muRefCount )
-    { 
-        uSet = ( uSet + 1 ) % MAX_TASKSETS;
+    if( 0 != AtomicCompareExchange( &mlGrowLock, 1, 0 ) )
+    {
+        SpinBackoff         Backoff;
+
+        while( 0 != AtomicLoad( &mlGrowLock ) )
+        {
+            Backoff.Pause();
+        }
+        return TRUE;
     }
-    
-    if( NULL != mSets[ uSet ] )
+
+    //  Another thread may have refilled the free list while we took the lock.
+    if( TASKSET_FREE_NIL != FREE_HEAD_SLOT( mllFreeSetHead ) || uChunk != muSetChunkCount )
     {
-        //  We know the refcount is done, but TBB has an assert that requires
-        //  a task be waited on before being deleted.
-        WaitForSet( uSet );
+        AtomicCompareExchange( &mlGrowLock, 0, 1 );
+        return TRUE;
+    }
 
-        //
-        //  Once TaskMgrTbb is done with a tbb object we need to forcibly destroy it.
-        //  There are some refcount issues with tasks in tbb 3.0 which can be 
-        //  inconsistent if a task has never been waited for.  TaskMgrTbb knows the
-        //  correct refcount.
-        mSets[ uSet ]->set_ref_count( 0 );
-        mSets[ uSet ]->destroy( *mSets[ uSet ] );
-        mSets[ uSet ] = NULL;
+    if( uChunk >= MAX_TASKSET_CHUNKS )
+    {
+        AtomicCompareExchange( &mlGrowLock, 0, 1 );
+        return FALSE;
+    }
+
+    TaskSetTbb**                ppChunk = new TaskSetTbb*[ TASKSET_CHUNK_SIZE ];
+
+    for( UINT uIdx = 0; uIdx < TASKSET_CHUNK_SIZE; ++uIdx )
+    {
+        ppChunk[ uIdx ] = CreateTaskSetObject();
+        ppChunk[ uIdx ]->muNextFree = uChunk * TASKSET_CHUNK_SIZE + uIdx + 1;
+    }
+
+    mpSetChunks[ uChunk ] = ppChunk;
+
+    //  Publish the chunk before any of its slots can be handed out.
+    AtomicIncrement( (volatile LONG*)&muSetChunkCount );
+
+    //
+    //  The slots are already linked in index order; push them as batches,
+    //  last batch first so they are allocated in index order.
+    //
+    for( UINT uBatch = TASKSET_CHUNK_SIZE; uBatch > 0; uBatch -= TASKSET_BATCH_SIZE )
+    {
+        PushTaskSetBatch( uChunk * TASKSET_CHUNK_SIZE + uBatch - TASKSET_BATCH_SIZE );
     }
 
-    mSets[ uSet ] = pSet;
-    muNextFreeSet = ( uSet + 1 ) % MAX_TASKSETS;
+    AtomicCompareExchange( &mlGrowLock, 0, 1 );
 
-    return (TASKSETHANDLE)uSet;
+    return TRUE;
 }
 
 VOID
 TaskMgrTbb::CompleteTaskSet(
-    TASKSETHANDLE           hSet )
+    TASKSETHANDLE           hSet,
+    UINT                    uTasks )
 {
-    TaskSetTbb*             pSet = mSets[ hSet ];
+    TaskSetTbb*             pSet = GetTaskSet( hSet );
 
-    UINT uCount = _InterlockedDecrement( (LONG*)&pSet->muCompletionCount );
+    UINT uCount = AtomicExchangeAdd( (volatile LONG*)&pSet->muCompletionCount, -(LONG)uTasks );
 
-    if( 0 == uCount )
+    if( uTasks == uCount )
     {
+        //  Signal sets have no tasks and no latency.
+        ContextStats*       pStats = GetContextStats();
+
+        //  Nor do sets cancelled before their first task started.
+        INT64               llFirstTaskTicks = AtomicLoad64( &pSet->mllFirstTaskTicks );
+
+        if( pStats && !pSet->mbSignalSet && 0 != llFirstTaskTicks )
+        {
+            RecordLatency( pStats->mllStartLatency, llFirstTaskTicks - pSet->mllReadyTicks );
+            RecordLatency( pStats->mllRunLatency, GetTimerTicks() - llFirstTaskTicks );
+        }
+
         //
-        //  The task set has completed.  We need to look at the successors
-        //  and signal them that this dependency of theirs has completed.
+        //  The task set has completed.  Close the successor list so no new
+        //  successors can attach, then signal every successor that this
+        //  dependency of theirs has completed.
         //
-        pSet->mSuccessorsLock.Lock();
+        SuccessorLink*      pLink = (SuccessorLink*)AtomicExchangePointer( 
+            (VOID* volatile*)&pSet->mpSuccessors, 
+            SUCCESSORS_CLOSED );
 
-        for( UINT uSuccessor = 0; uSuccessor < MAX_SUCCESSORS; ++uSuccessor )
+        while( NULL != pLink )
         {
-            TaskSetTbb* pSuccessor = pSet->Successors[ uSuccessor ];
+            TaskSetTbb*     pSuccessor = pLink->mpSuccessor;
+
+            //
+            //  The link is owned by the successor, which may run, complete
+            //  and be reused as soon as its start count is released.  Read
+            //  the next link first.
+            //
+            pLink = pLink->mpNext;
+
+            if( 0 != AtomicLoad( &pSet->mlCancelled ) )
+            {
+                AtomicStore( &pSuccessor->mlCancelled, 1 );
+            }
 
             //
-            //  A signaled successor must be removed from the Successors list 
-            //  before the mSuccessorsLock can be released.
+            //  If the start count is 0 the successor has had all its 
+            //  dependencies satisified and can be scheduled.
             //
-            pSet->Successors[ uSuccessor ] = NULL;
-            
-            if( NULL != pSuccessor ) 
+            if( 0 == AtomicDecrement( (volatile LONG*)&pSuccessor->muStartCount ) )
             {
-                UINT uStart;
+                pSuccessor->execute();
+            }
+        }
 
-                uStart = _InterlockedDecrement( (LONG*)&pSuccessor->muStartCount );
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+        //  Wake threads parked waiting on the set, and with fibers make 
+        //  sure a worker is awake to resume tasks waiting on it.
+        gScheduler.NotifyZero();
+#endif
 
-                //
-                //  If the start count is 0 the successor has had all its 
-                //  dependencies satisified and can be scheduled.
-                //
-                if( 0 == uStart )
-                {
-                    pSuccessor->execute();
-                }
+        ReleaseReference( hSet );
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Implementation of TaskGraph
+//
+///////////////////////////////////////////////////////////////////////////////
+
+TaskGraph::TaskGraph()
+    : mbBuilt( FALSE )
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( mNodes[ uNode ].mhSet );
+
+        //  The name belongs to the graph, not the frame arena.
+        if( pSet )
+        {
+            pSet->mpszSetName = NULL;
+        }
+
+        gTaskMgr.ReleaseHandle( mNodes[ uNode ].mhSet );
+
+        delete [] mNodes[ uNode ].mpszName;
+    }
+}
+
+BOOL
+TaskGraph::AddNode(
+    TASKSETFUNC             pFunc,
+    VOID*                   pArg,
+    UINT                    uTaskCount,
+    OPTIONAL LPCSTR         szSetName,
+    UINT*                   puNode,
+    TASKSETPRIORITY         ePriority,
+    TaskSetAffinity*        pAffinity )
+{
+    Node                    NewNode;
+
+    if( mbBuilt || 0 == uTaskCount || NULL == pFunc || ePriority >= TASKSET_PRIORITY_COUNT )
+    {
+        return FALSE;
+    }
+
+    NewNode.mpFunc = pFunc;
+    NewNode.mpvArg = pArg;
+    NewNode.muTaskCount = uTaskCount;
+    NewNode.muPriority = ePriority;
+    NewNode.mpAffinity = pAffinity;
+    NewNode.mpszName = NULL;
+    NewNode.muDepends = 0;
+    NewNode.mpSuccessors = NULL;
+    NewNode.mhSet = TASKSETHANDLE_INVALID;
+
+#if defined( PROFILEGPA ) || defined( TASKMGR_TRACE )
+    LPCSTR                  szName = szSetName ? szSetName : "Unnamed Node";
+    size_t                  uLength = strlen( szName ) + 1;
+
+    if( uLength > MAX_TASKSETNAMELENGTH )
+    {
+        uLength = MAX_TASKSETNAMELENGTH;
+    }
+
+    NewNode.mpszName = new CHAR[ uLength ];
+    memcpy( NewNode.mpszName, szName, uLength - 1 );
+    NewNode.mpszName[ uLength - 1 ] = '\0';
+#else
+    UNREFERENCED_PARAMETER( szSetName );
+#endif // PROFILEGPA || TASKMGR_TRACE
+
+    *puNode = (UINT)mNodes.size();
+    mNodes.push_back( NewNode );
+
+    return TRUE;
+}
+
+BOOL
+TaskGraph::AddEdge(
+    UINT                    uDependsOn,
+    UINT                    uNode )
+{
+    Edge                    NewEdge;
+
+    if( mbBuilt || uNode >= mNodes.size() || uDependsOn >= uNode )
+    {
+        return FALSE;
+    }
+
+    NewEdge.muDependsOn = uDependsOn;
+    NewEdge.muNode = uNode;
+
+    mEdges.push_back( NewEdge );
+    ++mNodes[ uNode ].muDepends;
+
+    return TRUE;
+}
+
+BOOL
+TaskGraph::Build()
+{
+    std::vector< UINT >     uLinksUsed( mNodes.size(), 0 );
+
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        Node&               GraphNode = mNodes[ uNode ];
+
+        GraphNode.mhSet = gTaskMgr.AllocateTaskSet();
+
+        if( TASKSETHANDLE_INVALID == GraphNode.mhSet )
+        {
+            //  Give back the slots of the nodes already built, so the next
+            //  Submit starts over instead of leaking them.
+            for( size_t uBuilt = 0; uBuilt < uNode; ++uBuilt )
+            {
+                TaskSetTbb*     pBuilt = gTaskMgr.GetTaskSet( mNodes[ uBuilt ].mhSet );
+
+                //  The name belongs to the graph, not the frame arena.
+                pBuilt->mpszSetName = NULL;
+                gTaskMgr.FreeTaskSet( TASKSETHANDLE_SLOT( mNodes[ uBuilt ].mhSet ) );
+                mNodes[ uBuilt ].mhSet = TASKSETHANDLE_INVALID;
             }
+
+            return FALSE;
+        }
+
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( GraphNode.mhSet );
+
+        //  NOTE: the graph owns the only reference between submissions.
+        //  The set is idle: complete, with its successor list closed.
+        pSet->muRefCount     = 1;
+        pSet->muStartCount   = 0;
+        pSet->muCompletionCount = 0;
+        pSet->mpSuccessors   = SUCCESSORS_CLOSED;
+
+        pSet->mpFunc         = GraphNode.mpFunc;
+        pSet->mpvArg         = GraphNode.mpvArg;
+        pSet->muSize         = GraphNode.muTaskCount;
+        pSet->muPriority     = GraphNode.muPriority;
+        pSet->muGrain        = gTaskMgr.GetTaskSetGrain( GraphNode.muTaskCount );
+        pSet->mpuAffinity    = GraphNode.mpAffinity ? 
+            GraphNode.mpAffinity->Reset( GraphNode.muTaskCount ) : NULL;
+        pSet->mpszSetName    = GraphNode.mpszName;
+#ifdef TASKMGR_TRACE
+        pSet->mpszTraceName  = TraceInternName( GraphNode.mpszName );
+#endif // TASKMGR_TRACE
+    }
+
+    //
+    //  Each edge uses one of the links owned by its successor, as in
+    //  TaskMgrTbb::CreateTaskSet, but the links are built into lists once
+    //  and never pushed again.
+    //
+    for( size_t uEdge = 0; uEdge < mEdges.size(); ++uEdge )
+    {
+        Node&               DependsOn = mNodes[ mEdges[ uEdge ].muDependsOn ];
+        UINT                uNode = mEdges[ uEdge ].muNode;
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( mNodes[ uNode ].mhSet );
+        SuccessorLink*      pLink = &pSet->GetLinks( mNodes[ uNode ].muDepends )[ uLinksUsed[ uNode ]++ ];
+
+        pLink->mpSuccessor = pSet;
+        pLink->mpNext = DependsOn.mpSuccessors;
+        DependsOn.mpSuccessors = pLink;
+    }
+
+    mbBuilt = TRUE;
+
+    return TRUE;
+}
+
+BOOL
+TaskGraph::Submit()
+{
+    if( !mbBuilt && !Build() )
+    {
+        printf( "Not enough free taskset slots for the TaskGraph.\n" );
+        return FALSE;
+    }
+
+    //
+    //  Every node must have completed.  The thread that completed a node
+    //  may still be dropping its reference, which is why the reference is
+    //  added rather than set below.
+    //
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( mNodes[ uNode ].mhSet );
+
+        if( 0 != AtomicLoad( (volatile LONG*)&pSet->muCompletionCount ) )
+        {
+            printf( "TaskGraph submitted before its previous submission completed.\n" );
+            return FALSE;
+        }
+
+        //  The thread that completed the node closes its successor list
+        //  right after the count reaches 0.  Let it, or it would close the
+        //  list restored below.
+        while( SUCCESSORS_CLOSED != AtomicLoadPointer( (VOID* volatile*)&pSet->mpSuccessors ) )
+        {
+            CpuPause();
+        }
+    }
+
+    //
+    //  Reset every node before launching any, so a node that completes
+    //  right away only ever signals reset successors.
+    //
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        Node&               GraphNode = mNodes[ uNode ];
+        TaskSetTbb*         pSet = gTaskMgr.GetTaskSet( GraphNode.mhSet );
+
+        gTaskMgr.RearmTaskSet( pSet );
+
+        pSet->muStartCount   = GraphNode.muDepends;
+        pSet->muCompletionCount = GraphNode.muTaskCount;
+        pSet->mpSuccessors   = GraphNode.mpSuccessors;
+        pSet->mullOrdinal    = NextSetOrdinal();
+
+        //  NOTE: the tasking system holds a reference while the node runs.
+        AtomicIncrement( (volatile LONG*)&pSet->muRefCount );
+    }
+
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        if( 0 == mNodes[ uNode ].muDepends )
+        {
+            gTaskMgr.GetTaskSet( mNodes[ uNode ].mhSet )->execute();
         }
+    }
 
-        pSet->mSuccessorsLock.Unlock();
+    return TRUE;
+}
+
+VOID
+TaskGraph::Wait()
+{
+    for( size_t uNode = 0; uNode < mNodes.size(); ++uNode )
+    {
+        gTaskMgr.WaitForSet( mNodes[ uNode ].mhSet );
+    }
+}
 
-        ReleaseHandle( hSet );
+TASKSETHANDLE
+TaskGraph::GetNodeHandle(
+    UINT                    uNode )
+{
+    if( uNode >= mNodes.size() )
+    {
+        return TASKSETHANDLE_INVALID;
     }
+
+    return mNodes[ uNode ].mhSet;
 }
@@ -5,24 +5,40 @@
     callback mechanism for scheduling tasks to scale across any number of CPU
     cores.
 
+    TaskMgrTbb can also be built on the portable work-stealing scheduler in
+    TaskScheduler.h by defining TASKMGR_SCHEDULER_PORTABLE.  The portable
+    scheduler only needs the C++11 standard library and is always used on
+    platforms other than Windows.  The interface below is the same for both
+    backends.
+
     TaskMgrTbb is a singleton object and is already instantiated for the app as
-    gTaskMgr.  The TaskMgrTbb is single threaded, meaning that tasksets can only
-    be created from one thread.  With minor changes and some performance loss,
-    multiple thread can create task sets (see AllocateTaskSet in TaskMgrTbb.cpp. 
-    The app can control two knobs in the TaskMgrTbb class through MAX_SUCCESSORS 
-    and MAX_TASKSETS defined below.
-
-    MAX_SUCCESSORS is the maximum number of tasksets that can be have depended
-    on another taskset.  For example if you have Tasksets A,B,C and both B and 
-    C can run simultaniously and both depend on A to complete (so A->(B,C)) then
-    A has two successors.  There is a small performance hit for large numbers
-    of successors so the value should be set to something reasonably close to 
-    the maximum the app will use. The default value is 5.
-
-    MAX_TASKSETS is the max number of tasksets that can be live at one  time. 
-    A taskset is live if it has a non-zero reference count.  Increasing the 
-    number of tasksets that can be live increases the memory footprint of the 
-    TaskMgrTbb object.  The default value is 255.
+    gTaskMgr.  Init and Shutdown must be called from the main thread.  All other
+    functions are threadsafe, so tasks can create, wait on and release child 
+    tasksets.  Each thread keeps a small cache of free taskset slots, so 
+    threads creating tasksets at the same time rarely touch shared state.
+    The app can control two knobs in the TaskMgrTbb class through 
+    TASKSET_CHUNK_SIZE and MAX_TASKSET_CHUNKS defined below.
+
+    There is no limit on the number of successors a taskset can have.  For 
+    example if you have Tasksets A,B,C and both B and C can run simultaniously
+    and both depend on A to complete (so A->(B,C)) then A has two successors.
+    Successors are kept in a lock-free list whose nodes are owned by the 
+    successor, so adding a dependency does not allocate in steady state.
+
+    Tasksets live in a table that grows TASKSET_CHUNK_SIZE slots at a time, up
+    to MAX_TASKSET_CHUNKS chunks.  A taskset is live if it has a non-zero 
+    reference count; its slot goes back on a lock-free free list as soon as 
+    the count drops to zero.  Chunks are never freed before Shutdown, so the 
+    memory footprint follows the peak number of live tasksets.  The defaults 
+    allow 256 * 256 = 65536 live tasksets.
+
+    A TASKSETHANDLE carries the slot index in its low 16 bits and the slot's
+    generation in its high 16 bits.  The generation changes every time a slot
+    is reused, so a stale handle (one that has already been released) is
+    detected instead of aliasing whatever taskset reuses the slot.
+
+    Work that has the same shape every frame can be declared once as a 
+    TaskGraph (see below) and submitted with a single call per frame.
 
     Copyright 2010 Intel Corporation
     All Rights Reserved
@@ -40,7 +56,9 @@
 */
 #pragma once
 
-#include <wtypes.h>
+#include "TaskMgrPlatform.h"
+
+#include <vector>
 
 /*! Intel Graphics Performance Analyizer (GPA) allows for CPU tracing of tasks
     in a frame.  Define PROFILEGPA to send task notifications to GPA.  
@@ -70,6 +88,17 @@ typedef VOID (*TASKSETFUNC )( VOID*,
                               UINT,
                               UINT );
 
+//  Callback type for TaskMgrTbb::ParallelFor.  The callback processes the
+//  indices in the half-open range [uBegin, uEnd).
+typedef VOID (*PARALLELFORFUNC )( VOID*,    //  App data pointer
+                                  INT,      //  Context id
+                                  UINT,     //  uBegin
+                                  UINT );   //  uEnd
+
+//  Grain passed to ParallelFor to have the range size picked from the 
+//  measured cost of each index.
+#define PARALLELFOR_GRAIN_AUTO          0
+
 //  Handle to a task set that can be used to express task set
 //  dependecies and task set synchronization.
 typedef UINT        TASKSETHANDLE;
@@ -77,23 +106,127 @@ typedef UINT        TASKSETHANDLE;
 //  Value of a TASKSETHANDLE that indicates an invalid handle
 #define TASKSETHANDLE_INVALID 0xFFFFFFFF
 
+//  Scheduling priority of a task set.  Ready tasks of a higher priority
+//  run before ready tasks of a lower priority.  Background tasksets are 
+//  meant for work that may span frames: a thread waiting on a high or 
+//  normal priority taskset never picks up background tasks, so they cannot
+//  delay the frame's critical path.
+//
+//  NOTE: TBB 3.0 has no task priorities.  On the TBB backend high priority
+//  tasksets run as normal ones and background tasksets are enqueued rather
+//  than spawned, so TBB runs them after the work already in its deques.
+typedef UINT        TASKSETPRIORITY;
+
+#define TASKSET_PRIORITY_HIGH           0
+#define TASKSET_PRIORITY_NORMAL         1
+#define TASKSET_PRIORITY_BACKGROUND     2
+#define TASKSET_PRIORITY_COUNT          3
+
+//  Idle statistics of the threads running tasks, summed over all contexts.
+//  See TaskMgrTbb::GetIdleStats.
+typedef struct _TASKMGR_IDLE_STATS
+{
+    UINT64          ullSpins;           //  Times a thread ran out of work and spun
+    UINT64          ullSpinHits;        //  Spins that found work before parking
+    UINT64          ullParks;           //  Spins that ended with the thread parked
+    UINT64          ullSpinMicroseconds;//  Total time spent spinning
+    UINT64          ullWakeups;         //  Parked threads woken up
+} TASKMGR_IDLE_STATS;
+
+//  Latency histograms use HDR (high dynamic range) style buckets in
+//  nanoseconds: one bucket per value below 2 * TASKMGR_HISTOGRAM_SUB_BUCKETS,
+//  and TASKMGR_HISTOGRAM_SUB_BUCKETS buckets per power of two above that,
+//  so a bucket is never wider than 1/8 of the values in it.  Values above
+//  two minutes land in the last bucket.
+#define TASKMGR_HISTOGRAM_SUB_BUCKETS   8
+#define TASKMGR_HISTOGRAM_BUCKETS       ( 35 * TASKMGR_HISTOGRAM_SUB_BUCKETS )
+
+typedef struct _TASKMGR_HISTOGRAM
+{
+    UINT64          ullCount;           //  Values recorded
+    UINT64          ullBuckets[ TASKMGR_HISTOGRAM_BUCKETS ];
+} TASKMGR_HISTOGRAM;
+
+//  Context passed to TaskMgrTbb::GetStats to sum the statistics of all 
+//  contexts.
+#define TASKMGR_STATS_ALL_CONTEXTS      0xFFFFFFFF
+
+//  Scheduler statistics of a context.  See TaskMgrTbb::GetStats.
+typedef struct _TASKMGR_STATS
+{
+    UINT64          ullTasks;           //  Task callbacks run
+    UINT64          ullSteals;          //  Tasks taken from other contexts
+    UINT64          ullFailedSteals;    //  Steal attempts that found nothing
+    UINT64          ullRunMicroseconds; //  Time spent running tasks
+    UINT64          ullSpinMicroseconds;//  Time spent spinning for work
+    UINT64          ullIdleMicroseconds;//  Time spent parked
+    UINT64          ullQueueHighWater;  //  Most tasks queued on the context
+
+    //  Latency of the tasksets completed on the context, from becoming 
+    //  ready to their first task starting, and from there to completion.
+    TASKMGR_HISTOGRAM   StartLatency;
+    TASKMGR_HISTOGRAM   RunLatency;
+} TASKMGR_STATS;
+
 //
 //  Variables to control the memory size and performance of the TaskMgrTbb 
 //  class.  See header comment for details.
 //
-#define MAX_SUCCESSORS                  5
-#define MAX_TASKSETS                    255
+#define TASKSET_CHUNK_SIZE              256
+#define MAX_TASKSET_CHUNKS              256
 #define MAX_TASKSETNAMELENGTH           512
 
+//  Largest number of task starts TaskMgrTbb::BeginRecording records.
+#define MAX_SCHEDULE_EVENTS             ( 1024 * 1024 )
+
 class TaskSetTbb;
 class GenericTask;
 class TbbContextId;
+class TaskGraph;
+struct SuccessorLink;
+
+/*! Records which context ran each task of a taskset, so that the next 
+    taskset given the same TaskSetAffinity runs each task on the same
+    context again and finds its data in that context's caches.  Contexts
+    that run out of work still take tasks meant for others, so affinity 
+    gives way when the load is imbalanced.
+
+    The application owns the object and keeps it across frames.  It must
+    not be given to a taskset while the last taskset given it may still be
+    running, even one the new taskset depends on: creating the taskset
+    updates the table.  A change in the task count starts the recording 
+    over.
+
+    NOTE: On the TBB backend the mapping is kept with TBB's own affinity
+    ids (see tbb::task::note_affinity) rather than context ids.
+*/
+class TaskSetAffinity
+{
+public:
+    TaskSetAffinity();
+    ~TaskSetAffinity();
+
+private:
+
+    //  Resizes the table to uSize tasks, forgetting the mapping if the
+    //  size changes, and returns it.
+    UINT*
+        Reset( UINT uSize );
+
+    //  Context (plus one, 0 if unknown) that last ran each task, indexed
+    //  by the first index of the task.
+    UINT*                           mpuThreads;
+    UINT                            muSize;
+
+    friend class TaskMgrTbb;
+    friend class TaskGraph;
+};
 
 /*! The TaskMgrTbb allows the user to schedule tasksets that run on top of
-    TBB.  All TaskMgrTbb functions are NOT threadsafe.  TaskMgrTbb is 
-    designed to be called only from the main thread.  Multi-threading is 
-    achieved by creating TaskSets that execte on threads created internally
-    by TBB.
+    TBB.  Init and Shutdown must be called from the main thread; the other
+    TaskMgrTbb functions may also be called from inside running tasks.
+    Multi-threading is achieved by creating TaskSets that execte on threads
+    created internally by TBB.
 */
 class TaskMgrTbb
 {
@@ -114,9 +247,8 @@ public:
         Shutdown();
 
     //  Creates a task set and provides a handle to allow the application
-    //  CreateTaskSet can fail if, by adding this task to the successor lists
-    //  of its dependecies the list exceeds MAX_SUCCESSORS.  To fix, increase
-    //  MAX_SUCCESSORS.
+    //  CreateTaskSet fails if a dependency handle has already been released,
+    //  or if the taskset table is full (see MAX_TASKSET_CHUNKS).
     //
     //  NOTE: A tasket of size 1 is valid.  The most common case is to have 
     //  tasksets of >> 1 so the default tasking primitive is a taskset rather
@@ -141,12 +273,164 @@ public:
         OPTIONAL LPCSTR             szSetName,  //  [Optional] name of the taskset
         //  the name is used for profiling
 
+        OUT TASKSETHANDLE*          pOutHandle, //  [Out] Handle to the new taskset
+
+        TASKSETPRIORITY             ePriority = TASKSET_PRIORITY_NORMAL,
+                                                //  [Optional] scheduling priority
+
+        TaskSetAffinity*            pAffinity = NULL
+                                                //  [Optional] affinity to record
+                                                //  and replay, see TaskSetAffinity
+ );
+
+    //  ParallelFor creates a taskset that calls pFunc on contiguous ranges
+    //  of [uBegin, uEnd).  Rather than one task per index, the set runs one
+    //  task per context and each task claims ranges of uGrain indices until
+    //  none are left, so the scheduling cost does not grow with the index 
+    //  count.  With PARALLELFOR_GRAIN_AUTO the range size is tuned while the
+    //  set runs from the measured cost per index, and remembered per 
+    //  callback for the next call.  The returned handle is waited on and
+    //  released like any other taskset.  With a TaskSetAffinity the ranges are
+    //  fixed instead, one task each, so the same range goes to the same
+    //  context every call.  The same holds while a schedule is recorded or
+    //  replayed, so a replay runs the recorded ranges.
+    BOOL
+    ParallelFor(
+        PARALLELFORFUNC             pFunc,      //  Function pointer to the 
+        //  range callback function
+
+        VOID*                       pArg,       //  App data pointer (can be NULL)
+
+        UINT                        uBegin,     //  First index of the range
+
+        UINT                        uEnd,       //  One past the last index
+
+        UINT                        uGrain,     //  Indices per range, or
+        //  PARALLELFOR_GRAIN_AUTO
+
+        TASKSETHANDLE*              pDepends,   //  Array of TASKSETHANDLEs that 
+        //  this taskset depends on.
+
+        UINT                        uDepends,   //  Count of the depends list
+
+        OPTIONAL LPCSTR             szSetName,  //  [Optional] name of the taskset
+
+        OUT TASKSETHANDLE*          pOutHandle, //  [Out] Handle to the new taskset
+
+        TASKSETPRIORITY             ePriority = TASKSET_PRIORITY_NORMAL,
+                                                //  [Optional] scheduling priority
+
+        TaskSetAffinity*            pAffinity = NULL
+                                                //  [Optional] affinity to record
+                                                //  and replay, see TaskSetAffinity
+ );
+
+    //  CreateSignalSet creates a taskset with no tasks.  It completes, 
+    //  scheduling its successors and releasing its waiters, when the 
+    //  application calls SignalSet on it.  Signal sets let tasksets depend on
+    //  work that is not a taskset, such as a coroutine (see 
+    //  TaskMgrCoroutine.h).  The handle is released like any other.
+    BOOL
+    CreateSignalSet(
+        OPTIONAL LPCSTR             szSetName,  //  [Optional] name of the taskset
+
         OUT TASKSETHANDLE*          pOutHandle  //  [Out] Handle to the new taskset
  );
 
+    //  Completes a taskset created by CreateSignalSet.  Must be called 
+    //  exactly once per signal set.  The tasking system keeps the set alive
+    //  until it is signaled, so the application may release its handle 
+    //  first.
+    VOID
+        SignalSet( TASKSETHANDLE hSet        //  Signal set to complete
+                   );
+
+    //  Marks the start of a new application frame.  Task records and 
+    //  ParallelFor ranges are allocated from per-thread frame arenas that are
+    //  recycled as frames retire; calling BeginFrame once per frame lets the
+    //  arenas rotate in step with the application.
+    VOID
+        BeginFrame();
+
+    //  Fills pStats with the idle statistics of the threads running tasks
+    //  since Init: how often they ran out of work, how long they spun 
+    //  looking for more and how often they parked.  Returns FALSE, with
+    //  pStats zeroed, on the TBB backend, whose workers idle on their own.
+    BOOL
+        GetIdleStats( OUT TASKMGR_IDLE_STATS* pStats );
+
+    //  Writes the task timeline recorded since the last call to szPath as
+    //  Chrome trace JSON, which chrome://tracing and ui.perfetto.dev load.
+    //  Returns FALSE unless TASKMGR_TRACE is defined (see TaskMgrTrace.h).
+    //  Call it between frames, while no tasks are running.
+    BOOL
+        WriteTrace( LPCSTR szPath );
+
+    //  Fills pStats with the statistics of context uContext since Init, or
+    //  their sum if uContext is TASKMGR_STATS_ALL_CONTEXTS.  Each context 
+    //  only writes its own counters, with plain stores, so collecting them
+    //  costs a few cycles per task and they are always on.  They are read
+    //  without stopping the workers and are approximate while tasks run.
+    //
+    //  NOTE: On the TBB backend only the task count, the run time and the
+    //  latency histograms are collected; the other counters are zero.
+    BOOL
+        GetStats( UINT uContext, OUT TASKMGR_STATS* pStats );
+
+    //  Returns the value in nanoseconds below which dPercentile percent of
+    //  the values recorded in a histogram fall, rounded up to the end of
+    //  its bucket.  0 if the histogram is empty.
+    static UINT64
+        GetHistogramPercentile( const TASKMGR_HISTOGRAM* pHistogram, DOUBLE dPercentile );
+
+    //  Number of contexts (threads that run tasks), valid after Init.
+    UINT
+        GetContextCount() { return muContextCount; }
+
+    //  Schedule recording and replay, for chasing ordering bugs in task 
+    //  callbacks.  A taskset created by a task is numbered from that task 
+    //  and the number of tasksets the task created before it, so tasks may
+    //  create and wait on tasksets (and coroutines may await them) in any 
+    //  order.  Tasksets created outside of tasks are numbered in the order
+    //  they are created (and TaskGraph nodes in the order they are 
+    //  submitted), so a recording only replays if the application creates
+    //  those in the same order, for example from one thread.
+    //
+    //  BeginRecording records the order in which tasks start, with the
+    //  context that runs each one, until EndSchedule writes it to szPath
+    //  (if not NULL).  A non-zero uFuzzSeed also shakes up the schedule:
+    //  each task is delayed by a pseudo-random amount derived from the 
+    //  seed, and each range of tasks runs starting at a pseudo-random 
+    //  index, so running under different seeds in CI surfaces ordering 
+    //  bugs, and the recording of a failing run replays it.
+    //
+    //  BeginReplay loads a recording and starts the tasks one at a time in
+    //  the recorded order.  Each task is passed the context id of the 
+    //  thread that runs it, which need not be the recorded one; EndSchedule
+    //  reports how many were not.  A task that waits on a taskset lets the
+    //  next one start.  Tasks missing from
+    //  the recording, and all tasks once it has been played through, run
+    //  as usual.  If a recorded task never starts, because the application
+    //  did not create the same tasksets, a thread waiting on the replay 
+    //  ends it after a while with a message and the rest run as usual.
+    //
+    //  Each of these must be called while no tasks are running.  They 
+    //  return FALSE if a recording or replay is already in progress, the 
+    //  file cannot be read or written, or EndSchedule has nothing to end.
+    BOOL
+        BeginRecording( OPTIONAL LPCSTR szPath, UINT uFuzzSeed );
+
+    BOOL
+        BeginReplay( LPCSTR szPath );
+
+    BOOL
+        EndSchedule();
+
     //  All TASKSETHANDLE must be released when no longer referenced.  
     //  ReleaseHandle will release the Applications reference on the taskset.
     //  It should only be called once per handle returned from CreateTaskSet.
+    //  Releasing a handle again, whether or not its slot has been reused 
+    //  since, is detected and ignored.
     VOID
         ReleaseHandle( TASKSETHANDLE hSet        //  Taskset handle to release
                        );
@@ -160,15 +444,41 @@ public:
                         UINT uSet        //  count of taskset handle array
                         );
 
-    //  WaitForSet will yeild the main thread to the tasking system and return
-    //  only when the taskset specified has completed execution.
+    //  WaitForSet will yeild the calling thread to the tasking system and 
+    //  return only when the taskset specified has completed execution.  
+    //  Waiting on a stale handle returns immediately.  When called from 
+    //  inside a task the waiting task's thread keeps running other tasks.
+    //  If TASKMGR_SCHEDULER_FIBERS is defined a task waiting on a worker 
+    //  thread is suspended instead and may resume on another context.
     VOID
         WaitForSet( TASKSETHANDLE hSet        // Taskset to wait for completion
                     );
 
+    //  CancelTaskSet cancels a taskset: its tasks that have not started are
+    //  skipped, and when it completes each of its successors is cancelled
+    //  in turn, so cancelling the first set of a chain drops the chain.  
+    //  Running tasks finish unless they check IsCancelled.  A cancelled set
+    //  still completes and must be waited on and released as usual.  
+    //  Returns FALSE if the handle is stale or the set has completed.
+    BOOL
+        CancelTaskSet( TASKSETHANDLE hSet );
+
+    //  SetTaskSetDeadline gives a taskset ullMicroseconds from now to run
+    //  its tasks.  Tasks that have not started by then are skipped and the 
+    //  set is cancelled.  Call it right after creating the set.
+    BOOL
+        SetTaskSetDeadline( TASKSETHANDLE hSet, UINT64 ullMicroseconds );
+
+    //  Called from a task callback, returns TRUE if the task's taskset has
+    //  been cancelled or missed its deadline, so long running tasks (LOD, 
+    //  streaming) can stop early.  Costs a thread-local read, plus a timer
+    //  read for sets with a deadline.  Returns FALSE outside of tasks.
+    BOOL
+        IsCancelled();
+
 
     //  DEMO ONLY: set variable before calling init to the
-    //  number of threads tbb should create.  Changing this value will
+    //  number of threads tbb (or the portable scheduler) should create.  Changing this value will
     //  result in inaccurate performance timings.
     //
     //  TBB should be allowed to use all available cores.  For samples, only
@@ -176,26 +486,107 @@ public:
     //  systems occupy a set of cores, tbb thread count should be reduced by
     //  the number of fully utilized cores.
     INT miDemoModeTBBThreadCountOverride;
+
+    //  Set to TRUE before calling Init to pin each context's thread to a
+    //  processor.  Contexts are placed so that nearby context ids share 
+    //  caches and a NUMA node (see TaskMgrTopology.h), and the portable 
+    //  scheduler steals from the nearest contexts first whether or not 
+    //  threads are pinned.  Pinning helps on multi-socket machines that run
+    //  nothing else; leave it off when the cores are shared.
+    BOOL mbPinThreads;
 private:
 
     friend class GenericTask;
+    friend class TaskSetTbb;
+    friend class TaskGraph;
 
     //  INTERNAL:
-    //  Allocate a free slot in the mSets list
+    //  Allocate a free slot in the taskset table.  Returns 
+    //  TASKSETHANDLE_INVALID if the table is full.
     TASKSETHANDLE
         AllocateTaskSet();
 
     //  INTERNAL:
-    //  Called by the tasking system when a task in a set completes.
+    //  Prepare a slot's taskset to be launched again.
+    VOID
+        RearmTaskSet( TaskSetTbb* pSet );
+
+    //  INTERNAL:
+    //  Number of tasks a GenericTask of a uTaskCount task set runs before
+    //  reporting them complete.
+    UINT
+        GetTaskSetGrain( UINT uTaskCount );
+
+    //  INTERNAL:
+    //  Drop one reference to a taskset, freeing its slot with the last one.
+    //  Used for the tasking system's own reference, which ReleaseHandle 
+    //  must not drop.
+    VOID
+        ReleaseReference( TASKSETHANDLE hSet );
+
+    //  INTERNAL:
+    //  Return a slot whose reference count dropped to zero to the free list.
+    VOID
+        FreeTaskSet( UINT uSlot );
+
+    //  INTERNAL:
+    //  Push a batch of TASKSET_BATCH_SIZE slots, linked through 
+    //  muNextFree, onto the global free list.
+    VOID
+        PushTaskSetBatch( UINT uFirstSlot );
+
+    //  INTERNAL:
+    //  Pop a batch from the global free list.  Returns the first slot of
+    //  the batch, or 0xFFFFFFFF if the list is empty.
+    UINT
+        PopTaskSetBatch();
+
+    //  INTERNAL:
+    //  Add a chunk of slots to the free list.  Returns FALSE if the table
+    //  already has MAX_TASKSET_CHUNKS chunks.
+    BOOL
+        GrowTaskSets();
+
+    //  INTERNAL:
+    //  Returns the taskset a handle refers to, or NULL if the handle is
+    //  invalid or stale.
+    TaskSetTbb*
+        GetTaskSet( TASKSETHANDLE hSet );
+
+    //  INTERNAL:
+    //  Returns the taskset in a slot.
+    TaskSetTbb*
+        GetSlot( UINT uSlot ) 
+        { 
+            return mpSetChunks[ uSlot / TASKSET_CHUNK_SIZE ][ uSlot % TASKSET_CHUNK_SIZE ]; 
+        }
+
+    //  INTERNAL:
+    //  Called by the tasking system when uTasks tasks in a set complete.
     VOID
-        CompleteTaskSet( TASKSETHANDLE hSet );
+        CompleteTaskSet( TASKSETHANDLE hSet, UINT uTasks );
+
+
+    //  Table of tasksets, TASKSET_CHUNK_SIZE slots per chunk.
+    TaskSetTbb** mpSetChunks[ MAX_TASKSET_CHUNKS ];
+
+    //  Number of chunks in mpSetChunks.
+    volatile UINT muSetChunkCount;
 
+    //  Non-zero while a thread is adding a chunk.
+    volatile LONG mlGrowLock;
 
-    //  Array containing the tbb task parents.
-    TaskSetTbb* mSets[ MAX_TASKSETS ];
+    //  Head of the lock-free list of free slot batches.  The low 32 bits 
+    //  are the first slot of the top batch, the high 32 bits a tag bumped 
+    //  on every pop to defeat ABA.
+    volatile INT64 mllFreeSetHead;
 
-    //  Helper array index of next free task slot.
-    UINT muNextFreeSet;
+    //  Bumped by Init so per-thread slot caches from a previous Init are
+    //  discarded.
+    UINT muCacheEpoch;
+
+    //  Number of contexts (threads that run tasks), set by Init.
+    UINT muContextCount;
 
     //  Pointer to the observer class that assigned context ids.
     TbbContextId* mpTbbContextId;
@@ -209,3 +600,103 @@ private:
 //  Forward decl of the TaskMgrTbb instance defined in TaskMgrTbb.cpp
 //
 extern TaskMgrTbb   gTaskMgr;
+
+/*! A TaskGraph is a set of tasksets (nodes) and the dependencies between
+    them (edges) that is declared once and then submitted every frame.  The
+    graph keeps its taskset slots and successor lists between submissions,
+    so Submit only resets the counters of every node and launches the nodes
+    without dependencies: it does not allocate, take a lock or wire up any
+    dependency.
+
+    A node can only depend on nodes added before it, so a graph cannot have
+    cycles.  The graph is set up by the first Submit; nodes and edges cannot
+    be added after that.  A graph must have completed (see Wait) before it 
+    is submitted again or destroyed, and must be destroyed before 
+    TaskMgrTbb::Shutdown.
+*/
+class TaskGraph
+{
+public:
+    TaskGraph();
+    ~TaskGraph();
+
+    //  Adds a node that runs uTaskCount tasks of pFunc, like a taskset 
+    //  created by TaskMgrTbb::CreateTaskSet.  Returns the node's index in
+    //  puNode.
+    BOOL
+    AddNode(
+        TASKSETFUNC                 pFunc,      //  Function pointer to the 
+        //  Taskset callback function
+
+        VOID*                       pArg,       //  App data pointer (can be NULL)
+
+        UINT                        uTaskCount, //  Number of tasks to create 
+
+        OPTIONAL LPCSTR             szSetName,  //  [Optional] name of the node
+        //  the name is used for profiling
+
+        OUT UINT*                   puNode,     //  [Out] Index of the new node
+
+        TASKSETPRIORITY             ePriority = TASKSET_PRIORITY_NORMAL,
+                                                //  [Optional] scheduling priority
+
+        TaskSetAffinity*            pAffinity = NULL
+                                                //  [Optional] affinity to record
+                                                //  and replay, see TaskSetAffinity
+ );
+
+    //  Makes node uNode wait for node uDependsOn, which must have been 
+    //  added first.
+    BOOL
+        AddEdge( UINT uDependsOn, UINT uNode );
+
+    //  Launches every node of the graph.  Fails if the previous submission
+    //  has not completed.
+    BOOL
+        Submit();
+
+    //  Waits until every node of the last submission has completed.
+    VOID
+        Wait();
+
+    //  Returns the taskset handle of a node, valid once the graph has been
+    //  submitted.  Tasksets created after a Submit can depend on the node 
+    //  and the handle can be waited on, but it belongs to the graph and 
+    //  must not be released.
+    TASKSETHANDLE
+        GetNodeHandle( UINT uNode );
+
+private:
+
+    //  Allocates the tasksets of the nodes and links them.
+    BOOL
+        Build();
+
+    struct Node
+    {
+        TASKSETFUNC                 mpFunc;
+        VOID*                       mpvArg;
+        UINT                        muTaskCount;
+        TASKSETPRIORITY             muPriority;
+        TaskSetAffinity*            mpAffinity;
+        CHAR*                       mpszName;
+
+        //  Number of nodes this node waits for.
+        UINT                        muDepends;
+
+        //  Links of this node's successors.  Restored at every Submit.
+        SuccessorLink*              mpSuccessors;
+
+        TASKSETHANDLE               mhSet;
+    };
+
+    struct Edge
+    {
+        UINT                        muDependsOn;
+        UINT                        muNode;
+    };
+
+    std::vector< Node >             mNodes;
+    std::vector< Edge >             mEdges;
+    BOOL                            mbBuilt;
+};
@@ -0,0 +1,364 @@
+/*!
+    \file TaskMgrTopology.cpp
+
+    Implementation of the processor topology used to place TaskMgrTbb
+    contexts.  See TaskMgrTopology.h.
+*/
+#include "TaskMgrTopology.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined( __linux__ )
+#include <dirent.h>
+#include <sched.h>
+#define TOPOLOGY_SYSFS
+#endif
+
+#ifdef TOPOLOGY_SYSFS
+
+//
+//  Maximum number of cache indices read per processor.
+//
+#define SYSFS_MAX_CACHE_INDEX           16
+
+//
+//  INTERNAL
+//  Reads the first line of a sysfs file.  Returns FALSE if it does not
+//  exist.
+//
+static BOOL
+ReadSysfsLine(
+    const CHAR*             pszPath,
+    CHAR*                   pszLine,
+    size_t                  uLineSize )
+{
+    FILE*                   pFile = fopen( pszPath, "r" );
+
+    if( NULL == pFile )
+    {
+        return FALSE;
+    }
+
+    BOOL                    bRead = NULL != fgets( pszLine, (INT)uLineSize, pFile );
+
+    fclose( pFile );
+
+    return bRead;
+}
+
+//
+//  INTERNAL
+//  Returns the lowest processor of a sysfs cpu list ("0-3,8-11"), or
+//  uDefault if the file cannot be read.
+//
+static UINT
+ReadFirstCpu(
+    const CHAR*             pszPath,
+    UINT                    uDefault )
+{
+    CHAR                    szLine[ 256 ];
+
+    if( !ReadSysfsLine( pszPath, szLine, sizeof( szLine ) ) )
+    {
+        return uDefault;
+    }
+
+    return (UINT)strtoul( szLine, NULL, 10 );
+}
+
+//
+//  INTERNAL
+//  Returns TRUE if uCpu is in a sysfs cpu list.
+//
+static BOOL
+CpuListContains(
+    const CHAR*             pszList,
+    UINT                    uCpu )
+{
+    const CHAR*             pszRange = pszList;
+
+    while( *pszRange >= '0' && *pszRange <= '9' )
+    {
+        CHAR*               pszEnd;
+        UINT                uFirst = (UINT)strtoul( pszRange, &pszEnd, 10 );
+        UINT                uLast = uFirst;
+
+        if( '-' == *pszEnd )
+        {
+            uLast = (UINT)strtoul( pszEnd + 1, &pszEnd, 10 );
+        }
+
+        if( uCpu >= uFirst && uCpu <= uLast )
+        {
+            return TRUE;
+        }
+
+        pszRange = ',' == *pszEnd ? pszEnd + 1 : pszEnd;
+    }
+
+    return FALSE;
+}
+
+//
+//  INTERNAL
+//  Returns the NUMA node of a processor, or 0 if the system has no node
+//  information.
+//
+static UINT
+ReadCpuNode(
+    UINT                    uCpu )
+{
+    DIR*                    pDir = opendir( "/sys/devices/system/node" );
+    UINT                    uNode = 0;
+
+    if( NULL == pDir )
+    {
+        return 0;
+    }
+
+    for( struct dirent* pEntry = readdir( pDir ); pEntry; pEntry = readdir( pDir ) )
+    {
+        CHAR                szPath[ 256 ];
+        CHAR                szList[ 4096 ];
+        UINT                uCandidate;
+
+        if( 1 != sscanf( pEntry->d_name, "node%u", &uCandidate ) )
+        {
+            continue;
+        }
+
+        snprintf( szPath, sizeof( szPath ), "/sys/devices/system/node/node%u/cpulist", uCandidate );
+
+        if( ReadSysfsLine( szPath, szList, sizeof( szList ) ) &&
+            CpuListContains( szList, uCpu ) )
+        {
+            uNode = uCandidate;
+            break;
+        }
+    }
+
+    closedir( pDir );
+
+    return uNode;
+}
+
+#endif // TOPOLOGY_SYSFS
+
+//
+//  INTERNAL
+//  Placement order: by node, then L3 group, then L2 group.
+//
+static bool
+ComparePlacement(
+    const TopologyCpu&      First,
+    const TopologyCpu&      Second )
+{
+    if( First.muNode != Second.muNode ) return First.muNode < Second.muNode;
+    if( First.muL3 != Second.muL3 ) return First.muL3 < Second.muL3;
+    if( First.muL2 != Second.muL2 ) return First.muL2 < Second.muL2;
+
+    return First.muCpu < Second.muCpu;
+}
+
+TaskMgrTopology::TaskMgrTopology()
+{
+}
+
+BOOL
+TaskMgrTopology::Discover()
+{
+    mCpus.clear();
+
+#if defined( TOPOLOGY_SYSFS )
+    cpu_set_t               Allowed;
+
+    if( 0 != sched_getaffinity( 0, sizeof( Allowed ), &Allowed ) )
+    {
+        return FALSE;
+    }
+
+    for( UINT uCpu = 0; uCpu < CPU_SETSIZE; ++uCpu )
+    {
+        if( !CPU_ISSET( uCpu, &Allowed ) )
+        {
+            continue;
+        }
+
+        CHAR                szPath[ 256 ];
+        TopologyCpu         Cpu;
+
+        Cpu.muCpu = uCpu;
+        Cpu.muNode = ReadCpuNode( uCpu );
+        Cpu.muL2 = uCpu;
+
+        //  Without an L3 the package stands in for it.
+        snprintf( szPath, sizeof( szPath ), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", uCpu );
+        Cpu.muL3 = ReadFirstCpu( szPath, 0 );
+
+        for( UINT uIndex = 0; uIndex < SYSFS_MAX_CACHE_INDEX; ++uIndex )
+        {
+            CHAR            szLevel[ 16 ];
+
+            snprintf( szPath, sizeof( szPath ), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", uCpu, uIndex );
+
+            if( !ReadSysfsLine( szPath, szLevel, sizeof( szLevel ) ) )
+            {
+                break;
+            }
+
+            snprintf( szPath, sizeof( szPath ), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", uCpu, uIndex );
+
+            switch( atoi( szLevel ) )
+            {
+            case 2:
+                Cpu.muL2 = ReadFirstCpu( szPath, uCpu );
+                break;
+
+            case 3:
+                Cpu.muL3 = ReadFirstCpu( szPath, Cpu.muL3 );
+                break;
+            }
+        }
+
+        mCpus.push_back( Cpu );
+    }
+#elif defined( _WIN32 )
+    DWORD_PTR               uProcessMask;
+    DWORD_PTR               uSystemMask;
+    DWORD                   uLength = 0;
+
+    if( !GetProcessAffinityMask( GetCurrentProcess(), &uProcessMask, &uSystemMask ) )
+    {
+        return FALSE;
+    }
+
+    GetLogicalProcessorInformation( NULL, &uLength );
+
+    std::vector< SYSTEM_LOGICAL_PROCESSOR_INFORMATION > Info(
+        uLength / sizeof( SYSTEM_LOGICAL_PROCESSOR_INFORMATION ) );
+
+    if( Info.empty() || !GetLogicalProcessorInformation( &Info[ 0 ], &uLength ) )
+    {
+        return FALSE;
+    }
+
+    for( UINT uCpu = 0; uCpu < sizeof( DWORD_PTR ) * 8; ++uCpu )
+    {
+        DWORD_PTR           uCpuMask = (DWORD_PTR)1 << uCpu;
+        TopologyCpu         Cpu;
+
+        if( 0 == ( uProcessMask & uCpuMask ) )
+        {
+            continue;
+        }
+
+        Cpu.muCpu = uCpu;
+        Cpu.muNode = 0;
+        Cpu.muL3 = 0;
+        Cpu.muL2 = uCpu;
+
+        for( size_t uInfo = 0; uInfo < Info.size(); ++uInfo )
+        {
+            if( 0 == ( Info[ uInfo ].ProcessorMask & uCpuMask ) )
+            {
+                continue;
+            }
+
+            //  The lowest processor in the mask names the group.
+            UINT            uFirst = 0;
+
+            while( 0 == ( Info[ uInfo ].ProcessorMask & ( (DWORD_PTR)1 << uFirst ) ) )
+            {
+                ++uFirst;
+            }
+
+            if( RelationNumaNode == Info[ uInfo ].Relationship )
+            {
+                Cpu.muNode = Info[ uInfo ].NumaNode.NodeNumber;
+            }
+            else if( RelationProcessorPackage == Info[ uInfo ].Relationship && 0 == Cpu.muL3 )
+            {
+                Cpu.muL3 = uFirst;
+            }
+            else if( RelationCache == Info[ uInfo ].Relationship )
+            {
+                if( 2 == Info[ uInfo ].Cache.Level )
+                {
+                    Cpu.muL2 = uFirst;
+                }
+                else if( 3 == Info[ uInfo ].Cache.Level )
+                {
+                    Cpu.muL3 = uFirst;
+                }
+            }
+        }
+
+        mCpus.push_back( Cpu );
+    }
+#endif
+
+    std::sort( mCpus.begin(), mCpus.end(), ComparePlacement );
+
+    return !mCpus.empty();
+}
+
+UINT
+TaskMgrTopology::GetDistance(
+    UINT                    uContextA,
+    UINT                    uContextB ) const
+{
+    if( mCpus.empty() )
+    {
+        return TOPOLOGY_DISTANCE_REMOTE;
+    }
+
+    const TopologyCpu&      CpuA = mCpus[ uContextA % mCpus.size() ];
+    const TopologyCpu&      CpuB = mCpus[ uContextB % mCpus.size() ];
+
+    if( CpuA.muNode != CpuB.muNode )
+    {
+        return TOPOLOGY_DISTANCE_REMOTE;
+    }
+
+    if( CpuA.muL3 != CpuB.muL3 )
+    {
+        return TOPOLOGY_DISTANCE_NODE;
+    }
+
+    if( CpuA.muL2 != CpuB.muL2 )
+    {
+        return TOPOLOGY_DISTANCE_L3;
+    }
+
+    return TOPOLOGY_DISTANCE_L2;
+}
+
+BOOL
+TaskMgrTopology::PinThread(
+    UINT                    uContext ) const
+{
+    if( mCpus.empty() )
+    {
+        return FALSE;
+    }
+
+    UINT                    uCpu = mCpus[ uContext % mCpus.size() ].muCpu;
+
+#if defined( TOPOLOGY_SYSFS )
+    cpu_set_t               Mask;
+
+    CPU_ZERO( &Mask );
+    CPU_SET( uCpu, &Mask );
+
+    //  On Linux a pid of 0 sets the affinity of the calling thread.
+    return 0 == sched_setaffinity( 0, sizeof( Mask ), &Mask );
+#elif defined( _WIN32 )
+    return 0 != SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)1 << uCpu );
+#else
+    UNREFERENCED_PARAMETER( uCpu );
+
+    return FALSE;
+#endif
+}
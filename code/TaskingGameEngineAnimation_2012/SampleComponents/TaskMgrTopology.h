@@ -0,0 +1,72 @@
+/*!
+    \file TaskMgrTopology.h
+
+    Processor topology for TaskMgrTbb.  Discovers which logical processors
+    share an L2 cache, an L3 cache and a NUMA node, and orders the
+    processors so that neighbours in the order share as much as possible:
+    by node, then L3 group, then L2 group.  Context i of the tasking system
+    is placed on the i-th processor of that order, so contexts with nearby
+    ids (which split neighbouring index ranges of a taskset between them)
+    share caches, and the portable scheduler steals from the contexts
+    closest to the thief first.
+
+    The topology is read from /sys/devices/system on Linux and from
+    GetLogicalProcessorInformation on Windows (first processor group only).
+    Elsewhere, or if discovery fails, every processor is treated as equally
+    far from every other one and pinning is not available.
+*/
+#pragma once
+
+#include "TaskMgrPlatform.h"
+
+#include <vector>
+
+//
+//  Distances returned by TaskMgrTopology::GetDistance, nearest first.
+//
+#define TOPOLOGY_DISTANCE_L2            0   //  Same L2 cache
+#define TOPOLOGY_DISTANCE_L3            1   //  Same L3 cache
+#define TOPOLOGY_DISTANCE_NODE          2   //  Same NUMA node
+#define TOPOLOGY_DISTANCE_REMOTE        3   //  Different NUMA node
+#define TOPOLOGY_DISTANCE_COUNT         4
+
+/*! A logical processor and the ids of the cache and node groups it
+    belongs to.  Group ids are the lowest processor number in the group.
+*/
+struct TopologyCpu
+{
+    UINT                    muCpu;
+    UINT                    muNode;
+    UINT                    muL3;
+    UINT                    muL2;
+};
+
+class TaskMgrTopology
+{
+public:
+    TaskMgrTopology();
+
+    //  Reads the topology of the processors the process may run on.
+    //  Returns FALSE, leaving the topology empty, if it is not available.
+    BOOL
+        Discover();
+
+    //  Number of processors found by Discover; 0 if it failed.
+    UINT
+        GetCpuCount() const { return (UINT)mCpus.size(); }
+
+    //  Returns how far apart the processors of contexts uContextA and
+    //  uContextB are, as a TOPOLOGY_DISTANCE_* value.  Contexts beyond the
+    //  processor count wrap around.
+    UINT
+        GetDistance( UINT uContextA, UINT uContextB ) const;
+
+    //  Pins the calling thread to the processor of context uContext.
+    BOOL
+        PinThread( UINT uContext ) const;
+
+private:
+
+    //  Processors in placement order.
+    std::vector< TopologyCpu >  mCpus;
+};
@@ -0,0 +1,362 @@
+/*!
+    \file TaskMgrTrace.cpp
+
+    Implementation of the TaskMgrTbb timeline tracer.  See TaskMgrTrace.h.
+*/
+#include "TaskMgrTrace.h"
+
+#ifdef TASKMGR_TRACE
+
+#include <stdio.h>
+#include <string.h>
+
+#if !defined( _WIN32 )
+#include <chrono>
+#if defined( __i386__ ) || defined( __x86_64__ )
+#include <x86intrin.h>
+#define TRACE_TSC
+#endif
+#elif defined( _M_IX86 ) || defined( _M_X64 )
+#define TRACE_TSC
+#endif
+
+//
+//  Number of distinct names TraceInternName can hold.  Must be a power of
+//  two.
+//
+#define TRACE_MAX_NAMES                 1024
+
+//
+//  INTERNAL
+//  A recorded event.
+//
+struct TraceRecord
+{
+    UINT64                  mullStart;
+    UINT64                  mullEnd;
+    const CHAR*             mpszName;
+    UINT                    muItem;
+    INT                     miContext;
+    BOOL                    mbInstant;
+};
+
+//
+//  INTERNAL
+//  Events of one thread.  mlHead counts the events recorded and is only
+//  written by the owning thread, which publishes each event by storing it.
+//  mlTail is only written by TraceWriteChromeJson.  Both wrap.
+//
+struct TraceRing
+{
+    TraceRecord             mRecords[ TRACE_RING_EVENTS ];
+    volatile LONG           mlHead;
+    LONG                    mlTail;
+    UINT                    muThread;
+    TraceRing*              mpNext;
+};
+
+static TASKMGR_THREAD_LOCAL TraceRing*  tlsTraceRing;
+
+//
+//  INTERNAL
+//  Every ring ever created, newest first.  Rings are kept until the
+//  process exits so events of threads that have exited can still be
+//  written.
+//
+static TraceRing* volatile  gpTraceRings;
+static volatile LONG        glTraceThreads;
+
+//
+//  INTERNAL
+//  Timestamp and clock time of the first event, used to convert
+//  timestamps to microseconds.
+//
+static volatile INT64       gllTraceOriginTicks;
+static INT64                gllTraceOriginNanoseconds;
+
+//
+//  INTERNAL
+//  Open addressed table of interned names.
+//
+static CHAR* volatile       gpszTraceNames[ TRACE_MAX_NAMES ];
+
+//
+//  INTERNAL
+//  Returns the system clock in nanoseconds.
+//
+static INT64
+TraceGetNanoseconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER           llTicks;
+    LARGE_INTEGER           llFrequency;
+
+    QueryPerformanceCounter( &llTicks );
+    QueryPerformanceFrequency( &llFrequency );
+
+    return (INT64)( (DOUBLE)llTicks.QuadPart * 1e9 / (DOUBLE)llFrequency.QuadPart );
+#else
+    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+UINT64
+TraceGetTicks()
+{
+#ifdef TRACE_TSC
+    return __rdtsc();
+#else
+    return (UINT64)TraceGetNanoseconds();
+#endif
+}
+
+//
+//  INTERNAL
+//  Returns the calling thread's ring, creating it on first use.
+//
+static TraceRing*
+TraceGetRing()
+{
+    TraceRing*              pRing = tlsTraceRing;
+
+    if( pRing )
+    {
+        return pRing;
+    }
+
+    pRing = new TraceRing;
+    pRing->mlHead = 0;
+    pRing->mlTail = 0;
+    pRing->muThread = (UINT)AtomicIncrement( &glTraceThreads );
+
+    if( 0 == AtomicCompareExchange64( &gllTraceOriginTicks, (INT64)TraceGetTicks(), 0 ) )
+    {
+        gllTraceOriginNanoseconds = TraceGetNanoseconds();
+    }
+
+    for( ;; )
+    {
+        TraceRing*          pHead = (TraceRing*)AtomicLoadPointer( (VOID* volatile*)&gpTraceRings );
+
+        pRing->mpNext = pHead;
+
+        if( pHead == AtomicCompareExchangePointer( (VOID* volatile*)&gpTraceRings, pRing, pHead ) )
+        {
+            break;
+        }
+    }
+
+    tlsTraceRing = pRing;
+
+    return pRing;
+}
+
+//
+//  INTERNAL
+//  Appends an event to the calling thread's ring.
+//
+static VOID
+TraceRecordEvent(
+    const CHAR*             pszName,
+    UINT                    uItem,
+    INT                     iContext,
+    UINT64                  ullStart,
+    UINT64                  ullEnd,
+    BOOL                    bInstant )
+{
+    TraceRing*              pRing = TraceGetRing();
+    UINT                    uHead = (UINT)pRing->mlHead;
+    TraceRecord*            pRecord = &pRing->mRecords[ uHead & ( TRACE_RING_EVENTS - 1 ) ];
+
+    pRecord->mullStart = ullStart;
+    pRecord->mullEnd = ullEnd;
+    pRecord->mpszName = pszName;
+    pRecord->muItem = uItem;
+    pRecord->miContext = iContext;
+    pRecord->mbInstant = bInstant;
+
+    AtomicStore( &pRing->mlHead, (LONG)( uHead + 1 ) );
+}
+
+VOID
+TraceSpan(
+    const CHAR*             pszName,
+    UINT                    uItem,
+    INT                     iContext,
+    UINT64                  ullStart )
+{
+    TraceRecordEvent( pszName, uItem, iContext, ullStart, TraceGetTicks(), FALSE );
+}
+
+VOID
+TraceInstant(
+    const CHAR*             pszName,
+    UINT                    uItem,
+    INT                     iContext )
+{
+    UINT64                  ullNow = TraceGetTicks();
+
+    TraceRecordEvent( pszName, uItem, iContext, ullNow, ullNow, TRUE );
+}
+
+const CHAR*
+TraceInternName(
+    LPCSTR                  szName )
+{
+    UINT                    uHash = 2166136261u;
+    CHAR*                   pszCopy = NULL;
+
+    for( const CHAR* pszChar = szName; *pszChar; ++pszChar )
+    {
+        uHash = ( uHash ^ (BYTE)*pszChar ) * 16777619u;
+    }
+
+    for( UINT uProbe = 0; uProbe < TRACE_MAX_NAMES; ++uProbe )
+    {
+        UINT                uSlot = ( uHash + uProbe ) & ( TRACE_MAX_NAMES - 1 );
+        CHAR*               pszName = (CHAR*)AtomicLoadPointer( (VOID* volatile*)&gpszTraceNames[ uSlot ] );
+
+        if( NULL == pszName )
+        {
+            if( NULL == pszCopy )
+            {
+                size_t      uLength = strlen( szName ) + 1;
+
+                pszCopy = new CHAR[ uLength ];
+                memcpy( pszCopy, szName, uLength );
+            }
+
+            pszName = (CHAR*)AtomicCompareExchangePointer(
+                (VOID* volatile*)&gpszTraceNames[ uSlot ],
+                pszCopy,
+                NULL );
+
+            if( NULL == pszName )
+            {
+                return pszCopy;
+            }
+        }
+
+        //  Filled, possibly by a thread interning the same name.
+        if( 0 == strcmp( pszName, szName ) )
+        {
+            delete [] pszCopy;
+            return pszName;
+        }
+    }
+
+    delete [] pszCopy;
+
+    return "Too many names";
+}
+
+//
+//  INTERNAL
+//  Writes a name as a JSON string.
+//
+static VOID
+TraceWriteJsonString(
+    FILE*                   pFile,
+    const CHAR*             pszName )
+{
+    fputc( '"', pFile );
+
+    for( const CHAR* pszChar = pszName; *pszChar; ++pszChar )
+    {
+        if( '"' == *pszChar || '\\' == *pszChar )
+        {
+            fputc( '\\', pFile );
+            fputc( *pszChar, pFile );
+        }
+        else if( (BYTE)*pszChar < 0x20 )
+        {
+            fprintf( pFile, "\\u%04x", (UINT)(BYTE)*pszChar );
+        }
+        else
+        {
+            fputc( *pszChar, pFile );
+        }
+    }
+
+    fputc( '"', pFile );
+}
+
+BOOL
+TraceWriteChromeJson(
+    LPCSTR                  szPath )
+{
+    FILE*                   pFile = fopen( szPath, "w" );
+    BOOL                    bFirst = TRUE;
+
+    if( NULL == pFile )
+    {
+        printf( "Could not open trace file %s.\n", szPath );
+        return FALSE;
+    }
+
+    //
+    //  Convert timestamps to microseconds with the rate measured between
+    //  the first event and now.
+    //
+    INT64                   llOriginTicks = AtomicLoad64( &gllTraceOriginTicks );
+    DOUBLE                  dTicks = (DOUBLE)( TraceGetTicks() - (UINT64)llOriginTicks );
+    DOUBLE                  dNanoseconds = (DOUBLE)( TraceGetNanoseconds() - gllTraceOriginNanoseconds );
+    DOUBLE                  dMicrosecondsPerTick = dTicks > 0 ? dNanoseconds / dTicks / 1000.0 : 0.0;
+
+    fprintf( pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+
+    for( TraceRing* pRing = (TraceRing*)AtomicLoadPointer( (VOID* volatile*)&gpTraceRings );
+         pRing;
+         pRing = pRing->mpNext )
+    {
+        UINT                uHead = (UINT)AtomicLoad( &pRing->mlHead );
+        UINT                uCount = uHead - (UINT)pRing->mlTail;
+
+        if( uCount > TRACE_RING_EVENTS )
+        {
+            uCount = TRACE_RING_EVENTS;
+        }
+
+        fprintf( pFile,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}",
+            bFirst ? "" : ",\n",
+            pRing->muThread,
+            pRing->muThread );
+
+        bFirst = FALSE;
+
+        for( UINT uEvent = uHead - uCount; uEvent != uHead; ++uEvent )
+        {
+            TraceRecord*    pRecord = &pRing->mRecords[ uEvent & ( TRACE_RING_EVENTS - 1 ) ];
+            DOUBLE          dStart = (DOUBLE)(INT64)( pRecord->mullStart - (UINT64)llOriginTicks ) * dMicrosecondsPerTick;
+
+            fprintf( pFile, ",\n{\"name\":" );
+            TraceWriteJsonString( pFile, pRecord->mpszName );
+
+            if( pRecord->mbInstant )
+            {
+                fprintf( pFile, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f", dStart );
+            }
+            else
+            {
+                fprintf( pFile, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f",
+                    dStart,
+                    (DOUBLE)( pRecord->mullEnd - pRecord->mullStart ) * dMicrosecondsPerTick );
+            }
+
+            fprintf( pFile, ",\"pid\":1,\"tid\":%u,\"args\":{\"item\":%u,\"context\":%d}}",
+                pRing->muThread,
+                pRecord->muItem,
+                pRecord->miContext );
+        }
+
+        pRing->mlTail = (LONG)uHead;
+    }
+
+    fprintf( pFile, "\n]}\n" );
+
+    return 0 == fclose( pFile );
+}
+
+#endif // TASKMGR_TRACE
@@ -0,0 +1,75 @@
+/*!
+    \file TaskMgrTrace.h
+
+    Built-in timeline tracer for TaskMgrTbb, enabled by defining
+    TASKMGR_TRACE.  Every thread that records an event gets a ring buffer of
+    TRACE_RING_EVENTS events that only it writes, so recording an event
+    takes a timestamp and a few stores, with no lock and no interlocked
+    operation.  When a ring is full the oldest events are overwritten.
+
+    Each task is recorded as a span with its taskset's name, its task index
+    and the context that ran it.  The portable scheduler also records when
+    a thread steals a task or sleeps, so the timeline shows scheduling gaps
+    and who steals from whom.  Timestamps are read from the TSC on x86 and
+    from the system clock elsewhere.
+
+    TaskMgrTbb::WriteTrace writes the recorded events as Chrome trace JSON,
+    which chrome://tracing and the Perfetto UI (ui.perfetto.dev) both load.
+    Without TASKMGR_TRACE the macros below compile to nothing.
+*/
+#pragma once
+
+#include "TaskMgrPlatform.h"
+
+//
+//  Events kept per thread.  Must be a power of two.
+//
+#define TRACE_RING_EVENTS               ( 64 * 1024 )
+
+#ifdef TASKMGR_TRACE
+
+//
+//  Returns the current trace timestamp.
+//
+UINT64
+    TraceGetTicks();
+
+//
+//  Records a span from ullStart until now on the calling thread.
+//  pszName must stay valid until the trace is written; use names from
+//  TraceInternName or string literals.
+//
+VOID
+    TraceSpan( const CHAR* pszName, UINT uItem, INT iContext, UINT64 ullStart );
+
+//
+//  Records an instant event on the calling thread.
+//
+VOID
+    TraceInstant( const CHAR* pszName, UINT uItem, INT iContext );
+
+//
+//  Returns a copy of szName that lives until the process exits.  Equal
+//  names return the same copy.
+//
+const CHAR*
+    TraceInternName( LPCSTR szName );
+
+//
+//  Writes the events recorded since the last call as Chrome trace JSON and
+//  discards them.  Must not be called while tasks are running.
+//
+BOOL
+    TraceWriteChromeJson( LPCSTR szPath );
+
+#define TraceBeginSpan( ullStart )                      UINT64 ullStart = TraceGetTicks();
+#define TraceEndSpan( name, item, context, ullStart )   TraceSpan( (name), (item), (context), (ullStart) );
+#define TraceEvent( name, item, context )               TraceInstant( (name), (item), (context) );
+
+#else
+
+#define TraceBeginSpan( ullStart )
+#define TraceEndSpan( name, item, context, ullStart )
+#define TraceEvent( name, item, context )
+
+#endif // TASKMGR_TRACE
@@ -0,0 +1,1251 @@
+/*!
+    \file TaskScheduler.cpp
+
+    Implementation of the portable work-stealing scheduler used by TaskMgrTbb
+    when TASKMGR_SCHEDULER_PORTABLE is defined.  See TaskScheduler.h.
+*/
+#include "TaskScheduler.h"
+#include "TaskMgrTrace.h"
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ucontext.h>
+#endif
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define TASKSCHEDULER_FUTEX
+#endif
+
+#include <limits.h>
+#include <stdio.h>
+
+//
+//  Number of empty FindTask passes an idle thread spins before it parks.
+//  Each context starts at IDLE_SPIN_PASSES and doubles or halves its limit,
+//  within [IDLE_SPIN_PASSES_MIN, IDLE_SPIN_PASSES_MAX], as its spins find
+//  work or end in parking.
+//
+#define IDLE_SPIN_PASSES                64
+#define IDLE_SPIN_PASSES_MIN            8
+#define IDLE_SPIN_PASSES_MAX            1024
+
+//
+//  The CpuPause count between passes doubles every IDLE_PASSES_PER_BACKOFF
+//  passes, up to IDLE_MAX_PAUSES, so a long spin touches the other 
+//  contexts' deques less often.
+//
+#define IDLE_PASSES_PER_BACKOFF         16
+#define IDLE_MAX_PAUSES                 32
+
+//
+//  Number of empty passes after which an idle thread takes tasks out of
+//  other contexts' mailboxes.
+//
+#define AFFINITY_STEAL_PASSES           16
+
+//
+//  Lowest priority a worker looks at, and the lowest priority a thread
+//  waiting on non-background work looks at.
+//
+#define LOWEST_PRIORITY                 ( TASKSCHEDULER_PRIORITY_COUNT - 1 )
+#define LOWEST_WAIT_PRIORITY            ( TASKSCHEDULER_PRIORITY_COUNT - 2 )
+
+//
+//  Context id of the calling thread.  Assigned by TaskScheduler::Init for
+//  the main thread and by WorkerMain for the worker threads.
+//
+static thread_local INT         tlsContextId = TASKSCHEDULER_CONTEXT_INVALID;
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+
+//
+//  With fibers, code after a fiber switch may be running on a different
+//  thread.  Thread-local variables are read through this function so the
+//  compiler cannot reuse a thread-local address computed before the switch.
+//
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__(( noinline ))
+#endif
+static INT
+ReadContextId()
+{
+    return tlsContextId;
+}
+
+//
+//  A fiber tasks run on: a Win32 fiber or a ucontext with its own stack.
+//
+struct SchedulerFiber
+{
+    SchedulerFiber()
+#ifdef _WIN32
+        : mpFiber( NULL )
+#else
+        : mpStack( NULL )
+#endif
+    {
+    }
+
+    ~SchedulerFiber()
+    {
+#ifdef _WIN32
+        //  The thread fiber is converted back, not deleted.
+#else
+        delete [] mpStack;
+#endif
+    }
+
+#ifdef _WIN32
+    static VOID CALLBACK
+    Entry( LPVOID pvScheduler )
+    {
+        ( (TaskScheduler*)pvScheduler )->FiberMain();
+    }
+
+    LPVOID                      mpFiber;
+#else
+    //  makecontext only passes int arguments, so the scheduler pointer is
+    //  split in two.
+    static VOID
+    Entry( UINT uHigh, UINT uLow )
+    {
+        ( (TaskScheduler*)( ( (UINT64)uHigh << 32 ) | uLow ) )->FiberMain();
+    }
+
+    ucontext_t                  mContext;
+    CHAR*                       mpStack;
+#endif
+};
+
+//
+//  A fiber suspended in WaitForZero until *puCounter reaches zero.
+//
+struct FiberWait
+{
+    volatile UINT*              puCounter;
+    SchedulerFiber*             mpFiber;
+};
+
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+TaskScheduler::TaskScheduler()
+    : mpWorkers( NULL )
+    , muContextCount( 0 )
+    , mbPinThreads( FALSE )
+    , mbShutdown( FALSE )
+    , muInjectCount( 0 )
+    , muWakeCursor( 0 )
+    , muZeroEpoch( 0 )
+    , muSleepingWorkers( 0 )
+    , muSpinningWorkers( 0 )
+    , muParkedWaiters( 0 )
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    , muWaitCount( 0 )
+#endif
+{
+}
+
+TaskScheduler::~TaskScheduler()
+{
+}
+
+BOOL
+TaskScheduler::Init(
+    INT                         iThreadCount,
+    BOOL                        bPinThreads )
+{
+    if( iThreadCount <= 0 )
+    {
+        iThreadCount = (INT)std::thread::hardware_concurrency();
+
+        if( iThreadCount <= 0 )
+        {
+            iThreadCount = 1;
+        }
+    }
+
+    muContextCount = (UINT)iThreadCount;
+    mpWorkers = new Worker[ muContextCount ];
+    mbShutdown = FALSE;
+
+    //  Without a topology every other context is at TOPOLOGY_DISTANCE_REMOTE.
+    mTopology.Discover();
+    mbPinThreads = bPinThreads;
+
+    for( UINT uContext = 0; uContext < muContextCount; ++uContext )
+    {
+        //  Any non-zero seed works for the xorshift victim selection.
+        mpWorkers[ uContext ].muRandom = 0x9E3779B9u * ( uContext + 1 );
+
+        //  Sort the other contexts into victim tiers by distance.
+        Worker&                 Self = mpWorkers[ uContext ];
+
+        for( UINT uDistance = 0; uDistance < TOPOLOGY_DISTANCE_COUNT; ++uDistance )
+        {
+            for( UINT uVictim = 0; uVictim < muContextCount; ++uVictim )
+            {
+                if( uVictim != uContext && 
+                    uDistance == mTopology.GetDistance( uContext, uVictim ) )
+                {
+                    Self.mVictims.push_back( uVictim );
+                }
+            }
+
+            Self.muVictimEnd[ uDistance ] = (UINT)Self.mVictims.size();
+        }
+
+        mpWorkers[ uContext ].muMailCount = 0;
+        mpWorkers[ uContext ].muWakeWord = 0;
+        mpWorkers[ uContext ].mbSleeping = FALSE;
+        mpWorkers[ uContext ].mbWaiting = FALSE;
+        mpWorkers[ uContext ].muSpinLimit = IDLE_SPIN_PASSES;
+        mpWorkers[ uContext ].mullSpins = 0;
+        mpWorkers[ uContext ].mullSpinHits = 0;
+        mpWorkers[ uContext ].mullParks = 0;
+        mpWorkers[ uContext ].mullSpinMicroseconds = 0;
+        mpWorkers[ uContext ].mullWakeups = 0;
+        mpWorkers[ uContext ].mullSteals = 0;
+        mpWorkers[ uContext ].mullFailedSteals = 0;
+        mpWorkers[ uContext ].mullIdleMicroseconds = 0;
+        mpWorkers[ uContext ].mullQueueHighWater = 0;
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+        mpWorkers[ uContext ].mpThreadFiber = NULL;
+        mpWorkers[ uContext ].mpCurrentFiber = NULL;
+        mpWorkers[ uContext ].mpReleaseFiber = NULL;
+        mpWorkers[ uContext ].mpPublishWait = NULL;
+#endif
+    }
+
+    //  The calling thread is context 0 and helps execute tasks when it waits.
+    tlsContextId = 0;
+
+    if( mbPinThreads && !mTopology.PinThread( 0 ) )
+    {
+        printf( "Failed to pin the main thread; threads are not pinned.\n" );
+        mbPinThreads = FALSE;
+    }
+
+    for( UINT uContext = 1; uContext < muContextCount; ++uContext )
+    {
+        mThreads.push_back( std::thread( &TaskScheduler::WorkerMain, this, uContext ) );
+    }
+
+    return TRUE;
+}
+
+VOID
+TaskScheduler::Shutdown()
+{
+    mbShutdown = TRUE;
+
+    for( UINT uContext = 0; uContext < muContextCount; ++uContext )
+    {
+        Wake( mpWorkers[ uContext ].muWakeWord, 1 );
+    }
+
+    for( size_t uThread = 0; uThread < mThreads.size(); ++uThread )
+    {
+        mThreads[ uThread ].join();
+    }
+    mThreads.clear();
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    //  Fibers still waiting were abandoned by the application; like tasks
+    //  that never started, they are leaked.
+    mWaits.clear();
+    muWaitCount = 0;
+#endif
+
+    delete [] mpWorkers;
+    mpWorkers = NULL;
+    muContextCount = 0;
+
+    tlsContextId = TASKSCHEDULER_CONTEXT_INVALID;
+}
+
+INT
+TaskScheduler::GetContextId()
+{
+    return tlsContextId;
+}
+
+VOID
+TaskScheduler::GetIdleStats(
+    TaskSchedulerIdleStats*     pStats ) const
+{
+    pStats->ullSpins = 0;
+    pStats->ullSpinHits = 0;
+    pStats->ullParks = 0;
+    pStats->ullSpinMicroseconds = 0;
+    pStats->ullWakeups = 0;
+
+    for( UINT uContext = 0; uContext < muContextCount; ++uContext )
+    {
+        const Worker&           Context = mpWorkers[ uContext ];
+
+        pStats->ullSpins += Context.mullSpins.load( std::memory_order_relaxed );
+        pStats->ullSpinHits += Context.mullSpinHits.load( std::memory_order_relaxed );
+        pStats->ullParks += Context.mullParks.load( std::memory_order_relaxed );
+        pStats->ullSpinMicroseconds += Context.mullSpinMicroseconds.load( std::memory_order_relaxed );
+        pStats->ullWakeups += Context.mullWakeups.load( std::memory_order_relaxed );
+    }
+}
+
+VOID
+TaskScheduler::GetContextStats(
+    UINT                        uContext,
+    TaskSchedulerStats*         pStats ) const
+{
+    const Worker&               Context = mpWorkers[ uContext ];
+
+    pStats->ullSteals = Context.mullSteals.load( std::memory_order_relaxed );
+    pStats->ullFailedSteals = Context.mullFailedSteals.load( std::memory_order_relaxed );
+    pStats->ullSpinMicroseconds = Context.mullSpinMicroseconds.load( std::memory_order_relaxed );
+    pStats->ullIdleMicroseconds = Context.mullIdleMicroseconds.load( std::memory_order_relaxed );
+    pStats->ullQueueHighWater = Context.mullQueueHighWater.load( std::memory_order_relaxed );
+}
+
+VOID
+TaskScheduler::Spawn(
+    SchedulerTask*              pTask,
+    UINT                        uPriority )
+{
+    INT                         iContext = tlsContextId;
+
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        PushOwn( mpWorkers[ iContext ], pTask, uPriority );
+    }
+    else
+    {
+        std::lock_guard< std::mutex > Lock( mInjectLock );
+        mInjectQueues[ uPriority ].push_back( pTask );
+        ++muInjectCount;
+    }
+
+    NotifySpawn( TASKSCHEDULER_CONTEXT_INVALID );
+}
+
+VOID
+TaskScheduler::SpawnTo(
+    SchedulerTask*              pTask,
+    UINT                        uPriority,
+    INT                         iContext )
+{
+    if( TASKSCHEDULER_CONTEXT_INVALID == iContext || 
+        (UINT)iContext >= muContextCount )
+    {
+        Spawn( pTask, uPriority );
+        return;
+    }
+
+    Worker&                     Target = mpWorkers[ iContext ];
+
+    //  The calling context is awake and checks its own deque right after
+    //  its mailbox, so mail to itself needs neither the lock nor a wake.
+    if( iContext == tlsContextId )
+    {
+        PushOwn( Target, pTask, uPriority );
+        return;
+    }
+
+    {
+        std::lock_guard< std::mutex > Lock( Target.mMailboxLock );
+        Target.mMailboxes[ uPriority ].push_back( pTask );
+        ++Target.muMailCount;
+    }
+
+    NotifySpawn( iContext );
+}
+
+VOID
+TaskScheduler::PushOwn(
+    Worker&                     Self,
+    SchedulerTask*              pTask,
+    UINT                        uPriority )
+{
+    UINT64                      ullDepth;
+
+    Self.mQueues[ uPriority ].Push( pTask );
+
+    ullDepth = (UINT64)Self.mQueues[ uPriority ].Size();
+
+    if( ullDepth > Self.mullQueueHighWater.load( std::memory_order_relaxed ) )
+    {
+        Self.mullQueueHighWater.store( ullDepth, std::memory_order_relaxed );
+    }
+}
+
+VOID
+TaskScheduler::NotifySpawn(
+    INT                         iContext )
+{
+    //
+    //  The push must be visible before we look for sleepers, otherwise a
+    //  worker that is about to sleep could miss it.  Pairs with the fences
+    //  in Sleep and ParkWaiter.
+    //
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    //
+    //  Mail is meant for one context: wake it if it is parked.  If it is
+    //  awake it will find the mail, and the task is treated like any other
+    //  in case the context stays busy.
+    //
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        if( WakeWorker( (UINT)iContext ) )
+        {
+            return;
+        }
+
+        if( mpWorkers[ iContext ].mbWaiting.load( std::memory_order_relaxed ) )
+        {
+            WakeWaiters();
+            return;
+        }
+    }
+
+    //
+    //  A spinning worker will find the task; it wakes another worker in 
+    //  turn if it was the last one spinning.  If every worker is busy, a 
+    //  parked waiter may be the only thread left to run it.
+    //
+    if( 0 == muSpinningWorkers.load( std::memory_order_relaxed ) )
+    {
+        if( 0 != muSleepingWorkers.load( std::memory_order_relaxed ) )
+        {
+            WakeWorkers( 1 );
+        }
+        else if( 0 != muParkedWaiters.load( std::memory_order_relaxed ) )
+        {
+            WakeWaiters();
+        }
+    }
+}
+
+VOID
+TaskScheduler::WaitForZero(
+    volatile UINT*              puCounter,
+    UINT                        uPriority )
+{
+    INT                         iContext = tlsContextId;
+    UINT                        uIdle = 0;
+    UINT                        uLowestPriority = LOWEST_WAIT_PRIORITY;
+
+    if( uPriority > uLowestPriority )
+    {
+        uLowestPriority = uPriority;
+    }
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    //
+    //  Worker threads always run tasks on a fiber.  Suspend it until the
+    //  counter reaches zero and let the worker carry on with another fiber.
+    //  FinishSwitch on that fiber publishes the wait.
+    //
+    if( iContext > 0 )
+    {
+        if( 0 != AtomicLoad( (volatile LONG*)puCounter ) )
+        {
+            Worker&             Self = mpWorkers[ iContext ];
+            FiberWait           Wait;
+
+            Wait.puCounter = puCounter;
+            Wait.mpFiber = Self.mpCurrentFiber;
+
+            Self.mpPublishWait = &Wait;
+            SwitchFiber( (UINT)iContext, AcquireFiber( (UINT)iContext ) );
+            FinishSwitch();
+        }
+
+        return;
+    }
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+    while( 0 != AtomicLoad( (volatile LONG*)puCounter ) )
+    {
+        SchedulerTask*          pTask = NULL;
+
+        if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+        {
+            pTask = FindTask( (UINT)iContext, uLowestPriority, uIdle >= AFFINITY_STEAL_PASSES );
+
+            if( pTask && 0 != uIdle )
+            {
+                EndSpin( mpWorkers[ iContext ], TRUE );
+            }
+            else if( !pTask && 0 == uIdle )
+            {
+                BeginSpin( mpWorkers[ iContext ] );
+            }
+        }
+
+        if( pTask )
+        {
+            RunTask( pTask );
+            uIdle = 0;
+        }
+        else if( uIdle < ( TASKSCHEDULER_CONTEXT_INVALID != iContext ? 
+                           mpWorkers[ iContext ].muSpinLimit : IDLE_SPIN_PASSES ) )
+        {
+            SpinPause( uIdle++ );
+        }
+        else
+        {
+            if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+            {
+                EndSpin( mpWorkers[ iContext ], FALSE );
+            }
+
+            ParkWaiter( puCounter, iContext, uLowestPriority );
+            uIdle = 0;
+        }
+    }
+
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext && 0 != uIdle )
+    {
+        EndSpin( mpWorkers[ iContext ], TRUE );
+    }
+}
+
+BOOL
+TaskScheduler::RunOneTask(
+    UINT                        uPriority )
+{
+    INT                         iContext = tlsContextId;
+    SchedulerTask*              pTask;
+
+    if( TASKSCHEDULER_CONTEXT_INVALID == iContext )
+    {
+        return FALSE;
+    }
+
+    pTask = FindTask( (UINT)iContext, uPriority > LOWEST_WAIT_PRIORITY ? uPriority : LOWEST_WAIT_PRIORITY, TRUE );
+
+    if( NULL == pTask )
+    {
+        return FALSE;
+    }
+
+    RunTask( pTask );
+
+    return TRUE;
+}
+
+VOID
+TaskScheduler::WorkerMain(
+    UINT                        uContext )
+{
+    tlsContextId = (INT)uContext;
+
+    if( mbPinThreads )
+    {
+        mTopology.PinThread( uContext );
+    }
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    Worker&                     Self = mpWorkers[ uContext ];
+
+    //
+    //  Run the worker loop on a fiber.  Control only comes back to the 
+    //  thread's own context at shutdown.
+    //
+    Self.mpThreadFiber = new SchedulerFiber();
+#ifdef _WIN32
+    Self.mpThreadFiber->mpFiber = ConvertThreadToFiber( NULL );
+#endif
+    Self.mpCurrentFiber = Self.mpThreadFiber;
+
+    SwitchFiber( uContext, AcquireFiber( uContext ) );
+    FinishSwitch();
+
+    for( size_t uFiber = 0; uFiber < Self.mFreeFibers.size(); ++uFiber )
+    {
+#ifdef _WIN32
+        DeleteFiber( Self.mFreeFibers[ uFiber ]->mpFiber );
+#endif
+        delete Self.mFreeFibers[ uFiber ];
+    }
+    Self.mFreeFibers.clear();
+
+#ifdef _WIN32
+    ConvertFiberToThread();
+#endif
+    delete Self.mpThreadFiber;
+    Self.mpThreadFiber = NULL;
+#else
+    WorkerLoop();
+#endif // TASKMGR_SCHEDULER_FIBERS
+}
+
+VOID
+TaskScheduler::WorkerLoop()
+{
+    UINT                        uIdle = 0;
+
+    while( !mbShutdown.load( std::memory_order_relaxed ) )
+    {
+#ifdef TASKMGR_SCHEDULER_FIBERS
+        UINT                    uContext = (UINT)ReadContextId();
+
+        //  Finish tasks that were waiting before starting new ones.
+        SchedulerFiber*         pFiber = FindReadyFiber();
+
+        if( pFiber )
+        {
+            if( 0 != uIdle )
+            {
+                EndSpin( mpWorkers[ uContext ], TRUE );
+                --muSpinningWorkers;
+            }
+
+            mpWorkers[ uContext ].mpReleaseFiber = mpWorkers[ uContext ].mpCurrentFiber;
+            SwitchFiber( uContext, pFiber );
+            FinishSwitch();
+            uIdle = 0;
+            continue;
+        }
+#else
+        UINT                    uContext = (UINT)tlsContextId;
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+        SchedulerTask*          pTask = FindTask( uContext, LOWEST_PRIORITY, uIdle >= AFFINITY_STEAL_PASSES );
+        Worker&                 Self = mpWorkers[ uContext ];
+
+        if( pTask )
+        {
+            if( 0 != uIdle )
+            {
+                //
+                //  Stop spinning.  If this was the last spinning worker 
+                //  there may be more work than threads looking for it; wake
+                //  a parked worker to take over the spinning.
+                //
+                EndSpin( Self, TRUE );
+
+                if( 0 == --muSpinningWorkers &&
+                    0 != muSleepingWorkers.load( std::memory_order_relaxed ) )
+                {
+                    WakeWorkers( 1 );
+                }
+            }
+
+            RunTask( pTask );
+            uIdle = 0;
+        }
+        else if( 0 == uIdle )
+        {
+            BeginSpin( Self );
+            ++muSpinningWorkers;
+            ++uIdle;
+        }
+        else if( uIdle < Self.muSpinLimit )
+        {
+            SpinPause( uIdle++ );
+        }
+        else
+        {
+            EndSpin( Self, FALSE );
+            Sleep( uContext );
+            uIdle = 0;
+        }
+    }
+
+    if( 0 != uIdle )
+    {
+        --muSpinningWorkers;
+    }
+}
+
+SchedulerTask*
+TaskScheduler::FindTask(
+    UINT                        uContext,
+    UINT                        uLowestPriority,
+    BOOL                        bStealMail )
+{
+    Worker&                     Self = mpWorkers[ uContext ];
+    SchedulerTask*              pTask = NULL;
+
+    //
+    //  Within each distance tier, steal starting at a random victim so 
+    //  thieves spread out instead of all hammering the same context.
+    //
+    UINT                        uRandom = Self.muRandom;
+
+    uRandom ^= uRandom << 13;
+    uRandom ^= uRandom >> 17;
+    uRandom ^= uRandom << 5;
+    Self.muRandom = uRandom;
+
+    for( UINT uPriority = 0; uPriority <= uLowestPriority; ++uPriority )
+    {
+        pTask = TakeMail( Self, uPriority );
+
+        if( pTask )
+        {
+            return pTask;
+        }
+
+        pTask = Self.mQueues[ uPriority ].Pop();
+
+        if( pTask )
+        {
+            return pTask;
+        }
+
+        //  Steal from the other contexts, nearest first.
+        UINT    uTierBegin = 0;
+
+        for( UINT uDistance = 0; uDistance < TOPOLOGY_DISTANCE_COUNT; ++uDistance )
+        {
+            UINT    uTierSize = Self.muVictimEnd[ uDistance ] - uTierBegin;
+
+            for( UINT uTry = 0; uTry < uTierSize; ++uTry )
+            {
+                UINT    uVictim = Self.mVictims[ uTierBegin + ( uRandom + uTry ) % uTierSize ];
+
+                pTask = mpWorkers[ uVictim ].mQueues[ uPriority ].Steal();
+
+                if( pTask )
+                {
+                    TraceEvent( "Steal", uVictim, (INT)uContext );
+                    Self.mullSteals.store( Self.mullSteals.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                    return pTask;
+                }
+
+                Self.mullFailedSteals.store( Self.mullFailedSteals.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+            }
+
+            uTierBegin = Self.muVictimEnd[ uDistance ];
+        }
+
+        //  The load is imbalanced; run tasks meant for other contexts.
+        if( bStealMail )
+        {
+            for( size_t uVictim = 0; uVictim < Self.mVictims.size(); ++uVictim )
+            {
+                pTask = TakeMail( mpWorkers[ Self.mVictims[ uVictim ] ], uPriority );
+
+                if( pTask )
+                {
+                    TraceEvent( "Steal Mail", Self.mVictims[ uVictim ], (INT)uContext );
+                    Self.mullSteals.store( Self.mullSteals.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                    return pTask;
+                }
+            }
+        }
+
+        //  Finally pick up work submitted from unregistered threads.
+        if( 0 != muInjectCount.load( std::memory_order_relaxed ) )
+        {
+            std::lock_guard< std::mutex > Lock( mInjectLock );
+
+            if( !mInjectQueues[ uPriority ].empty() )
+            {
+                pTask = mInjectQueues[ uPriority ].front();
+                mInjectQueues[ uPriority ].pop_front();
+                --muInjectCount;
+
+                return pTask;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+SchedulerTask*
+TaskScheduler::TakeMail(
+    Worker&                     Mailbox,
+    UINT                        uPriority )
+{
+    SchedulerTask*              pTask = NULL;
+
+    if( 0 == Mailbox.muMailCount.load( std::memory_order_relaxed ) )
+    {
+        return NULL;
+    }
+
+    std::lock_guard< std::mutex > Lock( Mailbox.mMailboxLock );
+
+    if( !Mailbox.mMailboxes[ uPriority ].empty() )
+    {
+        pTask = Mailbox.mMailboxes[ uPriority ].front();
+        Mailbox.mMailboxes[ uPriority ].pop_front();
+        --Mailbox.muMailCount;
+    }
+
+    return pTask;
+}
+
+VOID
+TaskScheduler::RunTask(
+    SchedulerTask*              pTask )
+{
+    while( pTask )
+    {
+        SchedulerTask*          pNext = pTask->execute();
+
+        delete pTask;
+        pTask = pNext;
+    }
+}
+
+VOID
+TaskScheduler::BeginSpin(
+    Worker&                     Self )
+{
+    Self.mSpinStart = std::chrono::steady_clock::now();
+    Self.mullSpins.store( Self.mullSpins.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+}
+
+VOID
+TaskScheduler::EndSpin(
+    Worker&                     Self,
+    BOOL                        bHit )
+{
+    UINT64                      ullMicroseconds = (UINT64)std::chrono::duration_cast< std::chrono::microseconds >( 
+        std::chrono::steady_clock::now() - Self.mSpinStart ).count();
+
+    Self.mullSpinMicroseconds.store( 
+        Self.mullSpinMicroseconds.load( std::memory_order_relaxed ) + ullMicroseconds, 
+        std::memory_order_relaxed );
+
+    if( bHit )
+    {
+        Self.mullSpinHits.store( Self.mullSpinHits.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+
+        if( Self.muSpinLimit < IDLE_SPIN_PASSES_MAX )
+        {
+            Self.muSpinLimit *= 2;
+        }
+    }
+    else
+    {
+        Self.mullParks.store( Self.mullParks.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+
+        if( Self.muSpinLimit > IDLE_SPIN_PASSES_MIN )
+        {
+            Self.muSpinLimit /= 2;
+        }
+    }
+}
+
+VOID
+TaskScheduler::SpinPause(
+    UINT                        uPass )
+{
+    UINT                        uPauses = 1u << ( uPass / IDLE_PASSES_PER_BACKOFF );
+
+    if( uPauses > IDLE_MAX_PAUSES || 0 == uPauses )
+    {
+        uPauses = IDLE_MAX_PAUSES;
+    }
+
+    for( UINT uPause = 0; uPause < uPauses; ++uPause )
+    {
+        CpuPause();
+    }
+}
+
+VOID
+TaskScheduler::Sleep(
+    UINT                        uContext )
+{
+    Worker&                     Self = mpWorkers[ uContext ];
+    UINT                        uEpoch = Self.muWakeWord.load();
+
+    //  Stop counting as a spinner only once we count as a sleeper, so a
+    //  spawner always sees one or the other.
+    Self.mbSleeping.store( TRUE );
+    ++muSleepingWorkers;
+    --muSpinningWorkers;
+
+    //  Pairs with the fence in Spawn.  Recheck for work now that spawners
+    //  can see us as a sleeper.
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    //  A waiting fiber that became ready is picked up by WorkerLoop.
+    if( HasReadyFiber() )
+    {
+        Self.mbSleeping.store( FALSE );
+        --muSleepingWorkers;
+        return;
+    }
+#endif
+
+    SchedulerTask*              pTask = FindTask( uContext, LOWEST_PRIORITY, TRUE );
+
+    if( pTask )
+    {
+        Self.mbSleeping.store( FALSE );
+        --muSleepingWorkers;
+        RunTask( pTask );
+        return;
+    }
+
+    std::chrono::steady_clock::time_point   ParkStart = std::chrono::steady_clock::now();
+
+    TraceBeginSpan( ullTraceStart );
+
+    while( uEpoch == Self.muWakeWord.load() && !mbShutdown.load() )
+    {
+        Park( Self.muWakeWord, uEpoch );
+    }
+
+    TraceEndSpan( "Sleep", 0, (INT)uContext, ullTraceStart );
+
+    Self.mbSleeping.store( FALSE );
+    --muSleepingWorkers;
+
+    EndPark( Self, ParkStart );
+}
+
+VOID
+TaskScheduler::ParkWaiter(
+    volatile UINT*              puCounter,
+    INT                         iContext,
+    UINT                        uLowestPriority )
+{
+    UINT                        uEpoch = muZeroEpoch.load();
+
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        mpWorkers[ iContext ].mbWaiting.store( TRUE );
+    }
+
+    ++muParkedWaiters;
+
+    //  Pairs with the fences in Spawn and NotifyZero.  Recheck the counter
+    //  and for work now that they can see us parked.
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if( 0 == AtomicLoad( (volatile LONG*)puCounter ) )
+    {
+        --muParkedWaiters;
+        EndWait( iContext );
+        return;
+    }
+
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        SchedulerTask*          pTask = FindTask( (UINT)iContext, uLowestPriority, TRUE );
+
+        if( pTask )
+        {
+            --muParkedWaiters;
+            EndWait( iContext );
+            RunTask( pTask );
+            return;
+        }
+    }
+
+    std::chrono::steady_clock::time_point   ParkStart = std::chrono::steady_clock::now();
+
+    TraceBeginSpan( ullTraceStart );
+
+    Park( muZeroEpoch, uEpoch );
+
+    TraceEndSpan( "Wait", 0, iContext, ullTraceStart );
+
+    --muParkedWaiters;
+    EndWait( iContext );
+
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        EndPark( mpWorkers[ iContext ], ParkStart );
+    }
+}
+
+VOID
+TaskScheduler::EndWait(
+    INT                         iContext )
+{
+    if( TASKSCHEDULER_CONTEXT_INVALID != iContext )
+    {
+        mpWorkers[ iContext ].mbWaiting.store( FALSE );
+    }
+}
+
+VOID
+TaskScheduler::EndPark(
+    Worker&                     Self,
+    std::chrono::steady_clock::time_point ParkStart )
+{
+    UINT64                      ullMicroseconds = (UINT64)std::chrono::duration_cast< std::chrono::microseconds >( 
+        std::chrono::steady_clock::now() - ParkStart ).count();
+
+    Self.mullIdleMicroseconds.store( 
+        Self.mullIdleMicroseconds.load( std::memory_order_relaxed ) + ullMicroseconds, 
+        std::memory_order_relaxed );
+    Self.mullWakeups.store( Self.mullWakeups.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+}
+
+VOID
+TaskScheduler::WakeWorkers(
+    UINT                        uCount )
+{
+    UINT                        uStart = muWakeCursor++;
+
+    for( UINT uPass = 0; uPass < muContextCount && 0 != uCount; ++uPass )
+    {
+        if( WakeWorker( ( uStart + uPass ) % muContextCount ) )
+        {
+            --uCount;
+        }
+    }
+}
+
+BOOL
+TaskScheduler::WakeWorker(
+    UINT                        uContext )
+{
+    Worker&                     Target = mpWorkers[ uContext ];
+    BOOL                        bSleeping = TRUE;
+
+    if( !Target.mbSleeping.compare_exchange_strong( bSleeping, FALSE ) )
+    {
+        return FALSE;
+    }
+
+    Wake( Target.muWakeWord, 1 );
+
+    return TRUE;
+}
+
+VOID
+TaskScheduler::WakeWaiters()
+{
+    Wake( muZeroEpoch, UINT_MAX );
+}
+
+VOID
+TaskScheduler::Park(
+    std::atomic< UINT >&        Word,
+    UINT                        uExpected )
+{
+#ifdef TASKSCHEDULER_FUTEX
+    //  Returns at once if Word has already changed.
+    syscall( SYS_futex, (UINT*)&Word, FUTEX_WAIT_PRIVATE, uExpected, NULL, NULL, 0 );
+#else
+    std::unique_lock< std::mutex > Lock( mSleepLock );
+
+    while( uExpected == Word.load() && !mbShutdown.load() )
+    {
+        mWakeCondition.wait( Lock );
+    }
+#endif // TASKSCHEDULER_FUTEX
+}
+
+VOID
+TaskScheduler::Wake(
+    std::atomic< UINT >&        Word,
+    UINT                        uCount )
+{
+#ifdef TASKSCHEDULER_FUTEX
+    ++Word;
+    syscall( SYS_futex, (UINT*)&Word, FUTEX_WAKE_PRIVATE, uCount > INT_MAX ? INT_MAX : uCount, NULL, NULL, 0 );
+#else
+    {
+        std::lock_guard< std::mutex > Lock( mSleepLock );
+        ++Word;
+    }
+
+    //  Workers and waiters share the condition variable, so a targeted 
+    //  notify could wake the wrong kind of thread.
+    UNREFERENCED_PARAMETER( uCount );
+    mWakeCondition.notify_all();
+#endif // TASKSCHEDULER_FUTEX
+}
+
+VOID
+TaskScheduler::NotifyZero()
+{
+    //
+    //  The counter write must be visible before we look for parked 
+    //  threads.  Pairs with the fences in Sleep and ParkWaiter.
+    //
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if( 0 != muParkedWaiters.load( std::memory_order_relaxed ) )
+    {
+        WakeWaiters();
+    }
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    if( 0 != muWaitCount.load( std::memory_order_relaxed ) &&
+        0 != muSleepingWorkers.load( std::memory_order_relaxed ) )
+    {
+        WakeWorkers( 1 );
+    }
+#endif // TASKMGR_SCHEDULER_FIBERS
+}
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+
+VOID
+TaskScheduler::FiberMain()
+{
+    FinishSwitch();
+
+    WorkerLoop();
+
+    //
+    //  Shutdown.  Return to the worker thread's own context, which frees
+    //  this fiber along with the rest of the worker's fibers.
+    //
+    UINT                        uContext = (UINT)ReadContextId();
+    Worker&                     Self = mpWorkers[ uContext ];
+
+    Self.mpReleaseFiber = Self.mpCurrentFiber;
+    SwitchFiber( uContext, Self.mpThreadFiber );
+}
+
+SchedulerFiber*
+TaskScheduler::AcquireFiber(
+    UINT                        uContext )
+{
+    Worker&                     Self = mpWorkers[ uContext ];
+    SchedulerFiber*             pFiber;
+
+    if( !Self.mFreeFibers.empty() )
+    {
+        pFiber = Self.mFreeFibers.back();
+        Self.mFreeFibers.pop_back();
+
+        return pFiber;
+    }
+
+    pFiber = new SchedulerFiber();
+
+#ifdef _WIN32
+    pFiber->mpFiber = CreateFiber( 
+        TASKSCHEDULER_FIBER_STACK_SIZE, 
+        SchedulerFiber::Entry, 
+        this );
+#else
+    pFiber->mpStack = new CHAR[ TASKSCHEDULER_FIBER_STACK_SIZE ];
+
+    getcontext( &pFiber->mContext );
+    pFiber->mContext.uc_stack.ss_sp = pFiber->mpStack;
+    pFiber->mContext.uc_stack.ss_size = TASKSCHEDULER_FIBER_STACK_SIZE;
+    pFiber->mContext.uc_link = NULL;
+
+    makecontext( 
+        &pFiber->mContext, 
+        (void (*)())SchedulerFiber::Entry, 
+        2, 
+        (UINT)( (UINT64)this >> 32 ),
+        (UINT)( (UINT64)this & 0xFFFFFFFF ) );
+#endif
+
+    return pFiber;
+}
+
+VOID
+TaskScheduler::SwitchFiber(
+    UINT                        uContext,
+    SchedulerFiber*             pFiber )
+{
+    Worker&                     Self = mpWorkers[ uContext ];
+    SchedulerFiber*             pCurrent = Self.mpCurrentFiber;
+
+    Self.mpCurrentFiber = pFiber;
+
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER( pCurrent );
+    SwitchToFiber( pFiber->mpFiber );
+#else
+    swapcontext( &pCurrent->mContext, &pFiber->mContext );
+#endif
+}
+
+VOID
+TaskScheduler::FinishSwitch()
+{
+    Worker&                     Self = mpWorkers[ ReadContextId() ];
+
+    if( Self.mpReleaseFiber )
+    {
+        Self.mFreeFibers.push_back( Self.mpReleaseFiber );
+        Self.mpReleaseFiber = NULL;
+    }
+
+    if( Self.mpPublishWait )
+    {
+        {
+            std::lock_guard< std::mutex > Lock( mWaitLock );
+            mWaits.push_back( Self.mpPublishWait );
+            ++muWaitCount;
+        }
+
+        Self.mpPublishWait = NULL;
+    }
+}
+
+SchedulerFiber*
+TaskScheduler::FindReadyFiber()
+{
+    if( 0 == muWaitCount.load( std::memory_order_relaxed ) )
+    {
+        return NULL;
+    }
+
+    std::lock_guard< std::mutex > Lock( mWaitLock );
+
+    for( size_t uWait = 0; uWait < mWaits.size(); ++uWait )
+    {
+        if( 0 == AtomicLoad( (volatile LONG*)mWaits[ uWait ]->puCounter ) )
+        {
+            //  The FiberWait lives on the waiting fiber's stack; read it 
+            //  before the fiber can resume.
+            SchedulerFiber*     pFiber = mWaits[ uWait ]->mpFiber;
+
+            mWaits[ uWait ] = mWaits.back();
+            mWaits.pop_back();
+            --muWaitCount;
+
+            return pFiber;
+        }
+    }
+
+    return NULL;
+}
+
+BOOL
+TaskScheduler::HasReadyFiber()
+{
+    if( 0 == muWaitCount.load( std::memory_order_relaxed ) )
+    {
+        return FALSE;
+    }
+
+    std::lock_guard< std::mutex > Lock( mWaitLock );
+
+    for( size_t uWait = 0; uWait < mWaits.size(); ++uWait )
+    {
+        if( 0 == AtomicLoad( (volatile LONG*)mWaits[ uWait ]->puCounter ) )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+#endif // TASKMGR_SCHEDULER_PORTABLE
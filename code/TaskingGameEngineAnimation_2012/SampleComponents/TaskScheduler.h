@@ -0,0 +1,592 @@
+/*!
+    \file TaskScheduler.h
+
+    TaskScheduler is the portable scheduler backend for TaskMgrTbb.  It is
+    only compiled when TASKMGR_SCHEDULER_PORTABLE is defined (see
+    TaskMgrPlatform.h) and only depends on the C++11 standard library, so
+    TaskMgrTbb can run on platforms the bundled TBB binaries do not support.
+
+    The scheduler owns one worker thread per core, less one for the thread
+    that calls Init.  That thread is registered as context 0 and executes
+    tasks whenever it waits, the same way TBB's master thread does.  Each
+    context owns a Chase-Lev work-stealing deque: the owner pushes and pops
+    at the bottom, idle threads steal from the top of a random victim.
+    Threads that are not registered with the scheduler submit through a
+    locked injection queue instead.
+
+    Every task is spawned at one of TASKSCHEDULER_PRIORITY_COUNT priorities,
+    0 being the highest.  Each context has one deque per priority and looks
+    for work at a higher priority anywhere before it looks at a lower one.
+    The lowest priority is a background lane: a thread that is waiting in
+    WaitForZero only runs background tasks while it waits on a background
+    counter, so a long background task cannot delay a latency-critical wait.
+
+    If TASKMGR_SCHEDULER_FIBERS is defined the worker threads run tasks on
+    fibers.  A task that calls WaitForZero on a worker thread suspends its
+    fiber instead of blocking the thread; the worker continues on a fresh
+    fiber and the suspended one is resumed, by any worker, once its counter
+    reaches zero.  The thread that called Init never runs on a fiber and 
+    still helps execute tasks while it waits.  A task that waits may resume
+    on a different context, so it must call GetContextId again after the 
+    wait.
+
+    A worker that runs out of work spins for a while, stealing with 
+    CpuPause backoff between passes, and then parks on a futex (a condition
+    variable where futexes are not available).  The number of passes adapts
+    per worker: it grows while spinning keeps finding work and shrinks while
+    it ends in parking.  A spawn only wakes a parked worker if no worker is
+    spinning, and a spinning worker that finds work wakes one more, so the
+    number of threads woken follows the number of ready tasks.  Threads
+    waiting in WaitForZero spin the same way and then park until a counter
+    reaches zero or new work is spawned.
+
+    Contexts are placed on the processor topology (see TaskMgrTopology.h):
+    a thief tries the contexts that share its L2 cache first, then its L3,
+    then its NUMA node, and only then the other nodes.  If Init is asked to
+    pin threads, context i runs on the i-th processor of the placement 
+    order.
+
+    A task can be spawned to a particular context with SpawnTo, which puts
+    it in that context's mailbox.  A context checks its own mailbox before
+    its deque.  Other contexts only take tasks out of a mailbox once they
+    have been idle for AFFINITY_STEAL_PASSES passes, so affinity holds 
+    unless the load is imbalanced.  Each worker parks on a word of its own,
+    so mail wakes only the context it is addressed to.  Mail a context 
+    sends itself goes straight to its own deque.
+
+    Like tbb::task, a SchedulerTask is heap allocated by the spawner and
+    deleted by the scheduler once its execute function returns.
+*/
+#pragma once
+
+#include "TaskMgrPlatform.h"
+
+#ifdef TASKMGR_SCHEDULER_PORTABLE
+
+#include "TaskMgrTopology.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Value passed to TaskScheduler::Init to create one thread per hardware thread.
+#define TASKSCHEDULER_THREADS_AUTOMATIC     -1
+
+//  Context id reported to threads that are not registered with the scheduler.
+#define TASKSCHEDULER_CONTEXT_INVALID       -1
+
+//  Number of task priorities; priority 0 is the highest and 
+//  TASKSCHEDULER_PRIORITY_COUNT - 1 the background lane.
+#define TASKSCHEDULER_PRIORITY_COUNT        3
+
+/*! Idle statistics, summed over all contexts.  See 
+    TaskScheduler::GetIdleStats.
+*/
+struct TaskSchedulerIdleStats
+{
+    UINT64          ullSpins;           //  Times a thread ran out of work and spun
+    UINT64          ullSpinHits;        //  Spins that found work before parking
+    UINT64          ullParks;           //  Spins that ended with the thread parked
+    UINT64          ullSpinMicroseconds;//  Total time spent spinning
+    UINT64          ullWakeups;         //  Parked threads woken by spawns or 
+                                        //  completions
+};
+
+/*! Work-stealing statistics of one context.  See 
+    TaskScheduler::GetContextStats.
+*/
+struct TaskSchedulerStats
+{
+    UINT64          ullSteals;          //  Tasks taken from other contexts' 
+                                        //  deques or mailboxes
+    UINT64          ullFailedSteals;    //  Steals from a deque that found nothing
+    UINT64          ullSpinMicroseconds;//  Time spent spinning for work
+    UINT64          ullIdleMicroseconds;//  Time spent parked
+    UINT64          ullQueueHighWater;  //  Most tasks seen in one of the 
+                                        //  context's deques
+};
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+//  Stack size of the fibers tasks run on.
+#define TASKSCHEDULER_FIBER_STACK_SIZE      ( 256 * 1024 )
+
+struct SchedulerFiber;
+struct FiberWait;
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+/*! Base class for units of work run by TaskScheduler.  The interface mirrors
+    tbb::task so TaskMgrTbb can share its task classes between backends.
+*/
+class SchedulerTask
+{
+public:
+    virtual ~SchedulerTask() {}
+
+    //  execute is called once, on whichever thread popped or stole the
+    //  task.  A non-NULL return value is run immediately on the same thread
+    //  without going through the deque (scheduler bypass).
+    virtual SchedulerTask*
+        execute() = 0;
+};
+
+/*! Chase-Lev work-stealing deque with a growable circular buffer.  Push and
+    Pop may only be called by the owning thread; Steal may be called by any
+    thread.  Retired buffers are kept until the queue is destroyed because
+    a thief may still be reading from them.
+*/
+template< typename T >
+class WorkStealingQueue
+{
+public:
+    WorkStealingQueue()
+        : miTop( 0 )
+        , miBottom( 0 )
+    {
+        mpBuffer.store( new Buffer( INITIAL_CAPACITY, NULL ), std::memory_order_relaxed );
+    }
+
+    ~WorkStealingQueue()
+    {
+        Buffer* pBuffer = mpBuffer.load( std::memory_order_relaxed );
+
+        while( pBuffer )
+        {
+            Buffer* pPrev = pBuffer->mpPrev;
+            delete pBuffer;
+            pBuffer = pPrev;
+        }
+    }
+
+    VOID
+    Push( T* pItem )
+    {
+        INT64       iBottom = miBottom.load( std::memory_order_relaxed );
+        INT64       iTop = miTop.load( std::memory_order_acquire );
+        Buffer*     pBuffer = mpBuffer.load( std::memory_order_relaxed );
+
+        if( iBottom - iTop > pBuffer->miMask )
+        {
+            pBuffer = Grow( pBuffer, iTop, iBottom );
+        }
+
+        pBuffer->Put( iBottom, pItem );
+        miBottom.store( iBottom + 1, std::memory_order_release );
+    }
+
+    T*
+    Pop()
+    {
+        INT64       iBottom = miBottom.load( std::memory_order_relaxed ) - 1;
+        Buffer*     pBuffer = mpBuffer.load( std::memory_order_relaxed );
+        T*          pItem = NULL;
+
+        miBottom.store( iBottom, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        INT64       iTop = miTop.load( std::memory_order_relaxed );
+
+        if( iTop <= iBottom )
+        {
+            pItem = pBuffer->Get( iBottom );
+
+            if( iTop == iBottom )
+            {
+                //  Last item; race the thieves for it.
+                if( !miTop.compare_exchange_strong(
+                        iTop,
+                        iTop + 1,
+                        std::memory_order_seq_cst,
+                        std::memory_order_relaxed ) )
+                {
+                    pItem = NULL;
+                }
+                miBottom.store( iBottom + 1, std::memory_order_relaxed );
+            }
+        }
+        else
+        {
+            miBottom.store( iBottom + 1, std::memory_order_relaxed );
+        }
+
+        return pItem;
+    }
+
+    T*
+    Steal()
+    {
+        INT64       iTop = miTop.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        INT64       iBottom = miBottom.load( std::memory_order_acquire );
+
+        if( iTop < iBottom )
+        {
+            Buffer* pBuffer = mpBuffer.load( std::memory_order_acquire );
+            T*      pItem = pBuffer->Get( iTop );
+
+            if( !miTop.compare_exchange_strong(
+                    iTop,
+                    iTop + 1,
+                    std::memory_order_seq_cst,
+                    std::memory_order_relaxed ) )
+            {
+                //  Lost the race to the owner or another thief.
+                return NULL;
+            }
+
+            return pItem;
+        }
+
+        return NULL;
+    }
+
+    //  Approximate number of items in the queue.
+    INT64
+    Size() const
+    {
+        INT64       iBottom = miBottom.load( std::memory_order_relaxed );
+        INT64       iTop = miTop.load( std::memory_order_relaxed );
+
+        return iBottom > iTop ? iBottom - iTop : 0;
+    }
+
+private:
+
+    enum { INITIAL_CAPACITY = 256 };
+
+    struct Buffer
+    {
+        Buffer( INT64 iCapacity, Buffer* pPrev )
+            : miMask( iCapacity - 1 )
+            , mpItems( new std::atomic< T* >[ (size_t)iCapacity ] )
+            , mpPrev( pPrev )
+        {}
+
+        ~Buffer()
+        {
+            delete [] mpItems;
+        }
+
+        T*
+        Get( INT64 iIdx ) const
+        {
+            return mpItems[ iIdx & miMask ].load( std::memory_order_relaxed );
+        }
+
+        VOID
+        Put( INT64 iIdx, T* pItem )
+        {
+            mpItems[ iIdx & miMask ].store( pItem, std::memory_order_relaxed );
+        }
+
+        INT64                   miMask;
+        std::atomic< T* >*      mpItems;
+        Buffer*                 mpPrev;
+    };
+
+    Buffer*
+    Grow( Buffer* pOld, INT64 iTop, INT64 iBottom )
+    {
+        Buffer*     pNew = new Buffer( ( pOld->miMask + 1 ) * 2, pOld );
+
+        for( INT64 iIdx = iTop; iIdx < iBottom; ++iIdx )
+        {
+            pNew->Put( iIdx, pOld->Get( iIdx ) );
+        }
+
+        mpBuffer.store( pNew, std::memory_order_release );
+
+        return pNew;
+    }
+
+    //  top is written by thieves, bottom by the owner; keep them on
+    //  separate cache lines.
+    std::atomic< INT64 >                miTop;
+    CHAR                                mPadTop[ 64 - sizeof( std::atomic< INT64 > ) ];
+    std::atomic< INT64 >                miBottom;
+    std::atomic< Buffer* >              mpBuffer;
+    CHAR                                mPadBottom[ 64 - sizeof( std::atomic< INT64 > ) - sizeof( std::atomic< Buffer* > ) ];
+};
+
+/*! The TaskScheduler runs SchedulerTasks on a pool of std::threads.
+    Init, Shutdown and the thread count are controlled by TaskMgrTbb; the
+    application never uses the scheduler directly.
+*/
+class TaskScheduler
+{
+public:
+    TaskScheduler();
+    ~TaskScheduler();
+
+    //  Create the worker threads and register the calling thread as
+    //  context 0.  iThreadCount is the total number of threads, including
+    //  the calling thread, or TASKSCHEDULER_THREADS_AUTOMATIC.  If 
+    //  bPinThreads is TRUE every context, including the calling thread, is
+    //  pinned to its processor.
+    BOOL
+        Init( INT iThreadCount, BOOL bPinThreads );
+
+    //  Stop and join all worker threads.  Tasks that have not started are
+    //  leaked; the caller must wait for outstanding work first.
+    VOID
+        Shutdown();
+
+    //  Queue a task for execution at uPriority.  May be called from any
+    //  thread.
+    VOID
+        Spawn( SchedulerTask* pTask, UINT uPriority );
+
+    //  Queue a task for execution at uPriority on context uContext.  Other
+    //  contexts only run it if they run out of work.  Same as Spawn if 
+    //  uContext is TASKSCHEDULER_CONTEXT_INVALID.
+    VOID
+        SpawnTo( SchedulerTask* pTask, UINT uPriority, INT iContext );
+
+    //  Execute tasks on the calling thread until *puCounter reaches zero.
+    //  uPriority is the priority of the work being waited on; background
+    //  tasks are only run if it is the background priority.  Threads not
+    //  registered with the scheduler yield instead of helping.
+    VOID
+        WaitForZero( volatile UINT* puCounter, UINT uPriority );
+
+    //  Execute one task on the calling thread, chosen as WaitForZero would.
+    //  Returns FALSE if there was none, or the thread is not registered.
+    BOOL
+        RunOneTask( UINT uPriority );
+
+    //  Called when a counter that may be passed to WaitForZero reaches 
+    //  zero, so a worker is awake to resume fibers waiting on it.  A no-op
+    //  unless TASKMGR_SCHEDULER_FIBERS is defined.
+    VOID
+        NotifyZero();
+
+    //  Number of contexts (threads that execute tasks), including context 0.
+    UINT
+        GetContextCount() const { return muContextCount; }
+
+    //  Sums the idle statistics of all contexts since Init.  The counters
+    //  are read without stopping the workers, so they are approximate 
+    //  while tasks are running.
+    VOID
+        GetIdleStats( TaskSchedulerIdleStats* pStats ) const;
+
+    //  Returns the work-stealing statistics of context uContext since Init,
+    //  read the same way as GetIdleStats.
+    VOID
+        GetContextStats( UINT uContext, TaskSchedulerStats* pStats ) const;
+
+    //  Returns the context id of the calling thread, in [0, GetContextCount()),
+    //  or TASKSCHEDULER_CONTEXT_INVALID if the thread is not registered.
+    static INT
+        GetContextId();
+
+private:
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    friend struct SchedulerFiber;
+#endif
+
+    struct Worker
+    {
+        WorkStealingQueue< SchedulerTask >  mQueues[ TASKSCHEDULER_PRIORITY_COUNT ];
+        UINT                                muRandom;   // victim selection state
+
+        //  Tasks spawned to this context by SpawnTo.
+        std::mutex                          mMailboxLock;
+        std::deque< SchedulerTask* >        mMailboxes[ TASKSCHEDULER_PRIORITY_COUNT ];
+        std::atomic< UINT >                 muMailCount;
+
+        //  A worker in Sleep parks until muWakeWord changes.  mbSleeping is
+        //  set while it sleeps and cleared by the thread that wakes it, so
+        //  every sleeper is counted by one wake only.  mbWaiting is set 
+        //  while the context is parked in ParkWaiter.
+        std::atomic< UINT >                 muWakeWord;
+        std::atomic< BOOL >                 mbSleeping;
+        std::atomic< BOOL >                 mbWaiting;
+
+        //  The other contexts, nearest first.  The contexts at distance d
+        //  (a TOPOLOGY_DISTANCE_* value) end at muVictimEnd[ d ].
+        std::vector< UINT >                 mVictims;
+        UINT                                muVictimEnd[ TOPOLOGY_DISTANCE_COUNT ];
+
+        //  Number of empty passes the context spins before it parks; 
+        //  adapted by EndSpin.
+        UINT                                muSpinLimit;
+
+        //  Start of the current spin, valid while the context is spinning.
+        std::chrono::steady_clock::time_point   mSpinStart;
+
+        //  Idle statistics.  Written by the owning context only.
+        std::atomic< UINT64 >               mullSpins;
+        std::atomic< UINT64 >               mullSpinHits;
+        std::atomic< UINT64 >               mullParks;
+        std::atomic< UINT64 >               mullSpinMicroseconds;
+        std::atomic< UINT64 >               mullWakeups;
+
+        //  Work-stealing statistics.  Written by the owning context only.
+        std::atomic< UINT64 >               mullSteals;
+        std::atomic< UINT64 >               mullFailedSteals;
+        std::atomic< UINT64 >               mullIdleMicroseconds;
+        std::atomic< UINT64 >               mullQueueHighWater;
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+        //  The worker thread's own context and the fiber it is running.
+        SchedulerFiber*                     mpThreadFiber;
+        SchedulerFiber*                     mpCurrentFiber;
+
+        //  Fibers not running a task, ready to be switched to.
+        std::vector< SchedulerFiber* >      mFreeFibers;
+
+        //  Set before switching away from a fiber and handled by FinishSwitch
+        //  on the fiber switched to.  A fiber cannot be reused or resumed 
+        //  until the switch away from it has completed.
+        SchedulerFiber*                     mpReleaseFiber;
+        FiberWait*                          mpPublishWait;
+#endif
+    };
+
+    VOID
+        WorkerMain( UINT uContext );
+
+    //  Runs tasks until Shutdown.  Re-reads the context id on every pass
+    //  since with fibers the loop can migrate between worker threads.
+    VOID
+        WorkerLoop();
+
+    //  Find a task for the given context at priority uLowestPriority or
+    //  higher.  For each priority, highest first: own mailbox, own queue,
+    //  then steal from other contexts, nearest first, then (if 
+    //  bStealMail) take mail of other contexts, then the injection queue.
+    SchedulerTask*
+        FindTask( UINT uContext, UINT uLowestPriority, BOOL bStealMail );
+
+    //  Removes the oldest task of priority uPriority from a mailbox.
+    SchedulerTask*
+        TakeMail( Worker& Mailbox, UINT uPriority );
+
+    //  Pushes a task on the calling context's own deque.
+    VOID
+        PushOwn( Worker& Self, SchedulerTask* pTask, UINT uPriority );
+
+    //  Wakes a thread, if needed, after a task has been queued.  iContext
+    //  is the context the task was mailed to, or TASKSCHEDULER_CONTEXT_INVALID.
+    VOID
+        NotifySpawn( INT iContext );
+
+    VOID
+        RunTask( SchedulerTask* pTask );
+
+    //  Start and end a context's spin.  EndSpin adapts the context's spin
+    //  limit: bHit is TRUE if the spin found work, FALSE if it is about to
+    //  park.
+    VOID
+        BeginSpin( Worker& Self );
+
+    VOID
+        EndSpin( Worker& Self, BOOL bHit );
+
+    //  Backs off between the empty passes of a spin.
+    VOID
+        SpinPause( UINT uPass );
+
+    //  Put the calling worker to sleep until new work is spawned.
+    VOID
+        Sleep( UINT uContext );
+
+    //  Park the calling thread, which is waiting in WaitForZero, until a
+    //  counter reaches zero or new work is spawned.
+    VOID
+        ParkWaiter( volatile UINT* puCounter, INT iContext, UINT uLowestPriority );
+
+    //  Clears the mbWaiting flag ParkWaiter set on context iContext.
+    VOID
+        EndWait( INT iContext );
+
+    //  Counts a wakeup of a context and the time it spent parked.
+    VOID
+        EndPark( Worker& Self, std::chrono::steady_clock::time_point ParkStart );
+
+    //  Wake up to uCount parked workers.
+    VOID
+        WakeWorkers( UINT uCount );
+
+    //  Wake context uContext if it is parked in Sleep.  Returns FALSE if
+    //  it was not.
+    BOOL
+        WakeWorker( UINT uContext );
+
+    //  Wake every thread parked in WaitForZero.
+    VOID
+        WakeWaiters();
+
+    //  Block while Word equals uExpected, or until a Wake on Word.
+    VOID
+        Park( std::atomic< UINT >& Word, UINT uExpected );
+
+    //  Change Word and wake up to uCount threads parked on it.
+    VOID
+        Wake( std::atomic< UINT >& Word, UINT uCount );
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    //  Body of every task fiber.
+    VOID
+        FiberMain();
+
+    //  Returns a free fiber of the given context, creating one if needed.
+    SchedulerFiber*
+        AcquireFiber( UINT uContext );
+
+    //  Switch the calling worker from its current fiber to pFiber.
+    VOID
+        SwitchFiber( UINT uContext, SchedulerFiber* pFiber );
+
+    //  Completes the switch to the calling fiber: releases the fiber that
+    //  switched to it and publishes its wait, if any.
+    VOID
+        FinishSwitch();
+
+    //  Removes and returns a waiting fiber whose counter reached zero.
+    SchedulerFiber*
+        FindReadyFiber();
+
+    BOOL
+        HasReadyFiber();
+#endif // TASKMGR_SCHEDULER_FIBERS
+
+    Worker*                         mpWorkers;
+    UINT                            muContextCount;
+    TaskMgrTopology                 mTopology;
+    BOOL                            mbPinThreads;
+    std::vector< std::thread >      mThreads;
+
+    std::atomic< BOOL >             mbShutdown;
+
+    //  Tasks submitted from threads that are not scheduler contexts.
+    std::mutex                      mInjectLock;
+    std::deque< SchedulerTask* >    mInjectQueues[ TASKSCHEDULER_PRIORITY_COUNT ];
+    std::atomic< UINT >             muInjectCount;
+
+    //  Parked workers wait for their own muWakeWord to change, parked 
+    //  waiters for muZeroEpoch.  The lock and condition variable are only
+    //  used where Park has no futex.  WakeWorkers starts its search for a
+    //  sleeper at muWakeCursor, which moves on with every search.
+    std::mutex                      mSleepLock;
+    std::condition_variable         mWakeCondition;
+    std::atomic< UINT >             muWakeCursor;
+    std::atomic< UINT >             muZeroEpoch;
+    std::atomic< UINT >             muSleepingWorkers;
+    std::atomic< UINT >             muSpinningWorkers;
+    std::atomic< UINT >             muParkedWaiters;
+
+#ifdef TASKMGR_SCHEDULER_FIBERS
+    //  Fibers suspended in WaitForZero.
+    std::mutex                      mWaitLock;
+    std::vector< FiberWait* >       mWaits;
+    std::atomic< UINT >             muWaitCount;
+#endif
+};
+
+#endif // TASKMGR_SCHEDULER_PORTABLE
@@ -20,6 +20,7 @@
 */
 
 #include "TaskMgrTBB.h"
+#include "FramePipeline.h"
 
 //  Includes for DXT
 #include "DXUT.h"
@@ -31,19 +32,28 @@
 
 const UINT                  MAX_BONE_MATRICES   = 200;  // Max bone matrices in constant buffer.
 const UINT                  MAX_MODELS          = 150;  // Max number of giants to render.
+const UINT                  MODEL_GROUP_SIZE    = SDKMESH_POSE_LANES;
+                                                    // Giants animated together.
+const UINT                  MAX_MODEL_GROUPS    =
+    ( MAX_MODELS + MODEL_GROUP_SIZE - 1 ) / MODEL_GROUP_SIZE;
 
 struct AnimatedModel
 {
-    CDXUTSDKMesh            Mesh;
+    CDXUTSDKMesh*           pMesh;          // shared by every model, read only.
+                                            // Poses live in gModelGroups.
     DOUBLE                  dTimeOffset;    // random offset to current time to 
                                             // have a unique animation per model.
 
-    D3DXMATRIXA16           AnimatedBones[ 2 ][ MAX_BONE_MATRICES ];
+    D3DXMATRIXA16           AnimatedBones[ FRAME_PIPELINE_SLOTS ][ 2 ][ MAX_BONE_MATRICES ];
+                                            // bones of each mesh, one copy per 
+                                            // frame in flight.
 };
 
 struct PerFrameAnimationInfo
 {
-    DOUBLE                  dTime;          // Current animation time
+    DOUBLE                  dTime;          // Animation time of the frame
+    UINT                    uSlot;          // Frame pipeline slot to write
+    UINT                    uModels;        // Number of models animated
 };
 
 //--------------------------------------------------------------------------------------
@@ -57,12 +67,21 @@ CDXUTDialog                 gSampleUI;              // dialog for sample specifi
 CDXUTTextHelper*            gpTxtHelper = NULL;     // used to render text
 BOOL                        gbShowHelp = FALSE;     // true if user selected help text
 
-PerFrameAnimationInfo       gAnimationInfo;         // Animation taskset data
+PerFrameAnimationInfo       gAnimationInfo[ FRAME_PIPELINE_SLOTS ];
+                                                    // Animation taskset data
+                                                    // of each frame in flight
 AnimatedModel               gModels[ MAX_MODELS ];  // Array of animated models
-
-TASKSETHANDLE               ghAnimateSet = TASKSETHANDLE_INVALID; 
-                                                    // handle to the current
-                                                    // animation taskset
+SDKMESH_POSE_GROUP          gModelGroups[ MAX_MODEL_GROUPS ];
+                                                    // poses of each group of
+                                                    // MODEL_GROUP_SIZE models
+
+FramePipeline               gFramePipeline;         // overlaps animation of a
+                                                    // frame with rendering of
+                                                    // earlier ones
+TaskSetAffinity             gAnimateAffinity[ FRAME_PIPELINE_SLOTS ];
+                                                    // keeps each group on the
+                                                    // same thread; one per slot
+                                                    // as frames overlap
 
 ID3D11InputLayout*          gpVertexLayout11 = NULL;// vertex decl of the soldier model
 ID3D11VertexShader*         gpVertexShader = NULL;  // VS of the soldier model
@@ -128,6 +147,9 @@ BOOL                        gbForceCPUBound = FALSE;// TRUE to force the sample
 
 #define IDC_FORCECPUBOUND       15
 
+#define IDC_LATENCYSLIDERTEXT   16
+#define IDC_LATENCYSLIDER       17
+
 //--------------------------------------------------------------------------------------
 // Update UI state based on user settings
 //--------------------------------------------------------------------------------------
@@ -177,14 +199,15 @@ RenderText( FLOAT fElapsedTime )
     // Draw help
     if( gbShowHelp )
     {
-        gpTxtHelper->SetInsertionPos( 2, nBackBufferHeight - 20 * 9 );
+        gpTxtHelper->SetInsertionPos( 2, nBackBufferHeight - 20 * 10 );
         gpTxtHelper->SetForegroundColor( D3DXCOLOR( 1.0f, 0.75f, 0.0f, 1.0f ) );
         gpTxtHelper->DrawTextLine( L"Controls:" );
 
-        gpTxtHelper->SetInsertionPos( 20, nBackBufferHeight - 20 * 8 );
+        gpTxtHelper->SetInsertionPos( 20, nBackBufferHeight - 20 * 9 );
         gpTxtHelper->DrawTextLine(  L"Change animating model count via the 'Model Count' scrollbar\n"
                                     L"Toggle Tasking: Check 'Enable Tasking' checkbox\n"
                                     L"Make Sample CPU Bound: Check 'Force CPU Bound' checkbox\n"
+                                    L"Let animation run ahead of rendering: 'Frame Latency' scrollbar\n"
                                     L"Rotate model: Left mouse button\n"
                                     L"Rotate light: Right mouse button\n"
                                     L"Rotate camera: Middle mouse button\n"
@@ -203,8 +226,9 @@ RenderText( FLOAT fElapsedTime )
         {
             wsprintf( 
                 wszSampleParams,
-                L"%d giants animating with tasking, rendered with immediate context\n",
-                guModels );
+                L"%d giants animating with tasking %d frame(s) ahead, rendered with immediate context\n",
+                guModels,
+                gFramePipeline.GetLatency() );
 
         }
         else
@@ -232,9 +256,21 @@ OnD3D11DestroyDevice(
     DXUTGetGlobalResourceCache().OnDestroyDevice();
     SAFE_DELETE( gpTxtHelper );
 
+    //  Animation tasks still in flight use the meshes.
+    gFramePipeline.Flush();
+
+    for( UINT uGroup = 0; uGroup < ARRAYSIZE( gModelGroups ); ++uGroup )
+    {
+        CDXUTSDKMesh::DestroyPoseGroup( &gModelGroups[ uGroup ] );
+    }
+
     for( UINT uModel = 0; uModel < ARRAYSIZE( gModels ); ++uModel )
     {
-        gModels[ uModel ].Mesh.Destroy();
+        if( gModels[ uModel ].pMesh )
+        {
+            DXUTGetGlobalSDKMeshCache().Release( gModels[ uModel ].pMesh );
+            gModels[ uModel ].pMesh = NULL;
+        }
     }
 
     SAFE_RELEASE( gpVertexLayout11 );
@@ -265,7 +301,8 @@ OnD3D11ReleasingSwapChain(
 //--------------------------------------------------------------------------------------
 void
 RenderModels(
-    ID3D11DeviceContext*        pd3dContext )
+    ID3D11DeviceContext*        pd3dContext,
+    PerFrameAnimationInfo*      pInfo )
 {
     HRESULT hr;
        
@@ -294,7 +331,7 @@ RenderModels(
         NULL, 
         &mWorld );
     
-    uGridWidth  = max( 1, (UINT)( sqrt( (FLOAT)guModels ) + .5f ) );
+    uGridWidth  = max( 1, (UINT)( sqrt( (FLOAT)pInfo->uModels ) + .5f ) );
 
     pd3dContext->PSSetConstantBuffers( giCBPSPerFrameBind, 1, &gpcbPSPerFrame );
 
@@ -304,14 +341,14 @@ RenderModels(
     
     fGridCenter = (FLOAT)( uGridWidth / 2 );
 
-    for( UINT uModel = 0; uModel < guModels; ++uModel )
+    for( UINT uModel = 0; uModel < pInfo->uModels; ++uModel )
     {
         D3DXMATRIX mPreTranslate;
 
         D3DXMatrixIdentity( &mPreTranslate );
         D3DXMatrixIdentity( &mScale );
-        D3DXVECTOR3 vCenter = gModels[ uModel ].Mesh.GetMeshBBoxCenter( 1 );        
-        D3DXVECTOR3 vExtents = gModels[ uModel ].Mesh.GetMeshBBoxExtents( 1 );
+        D3DXVECTOR3 vCenter = gModels[ uModel ].pMesh->GetMeshBBoxCenter( 1 );        
+        D3DXVECTOR3 vExtents = gModels[ uModel ].pMesh->GetMeshBBoxExtents( 1 );
 
         D3DXMatrixTranslation(
             &mPreTranslate,
@@ -358,7 +395,7 @@ RenderModels(
         pd3dContext->PSSetSamplers( 0, 1, &gpSamLinear );
 
         // Render each mesh
-        for( UINT uMesh = 0; uMesh < gModels[ uModel ].Mesh.GetNumMeshes(); ++uMesh )
+        for( UINT uMesh = 0; uMesh < gModels[ uModel ].pMesh->GetNumMeshes(); ++uMesh )
         {
             SDKMESH_MATERIAL*       pMat;
             
@@ -369,8 +406,8 @@ RenderModels(
             //IA setup
             pd3dContext->IASetInputLayout( gpVertexLayout11 );
             
-            pVB[ 0 ] = gModels[ uModel ].Mesh.GetVB11( uMesh, 0 );
-            uStride = ( UINT )gModels[ uModel ].Mesh.GetVertexStride( uMesh, 0 );
+            pVB[ 0 ] = gModels[ uModel ].pMesh->GetVB11( uMesh, 0 );
+            uStride = ( UINT )gModels[ uModel ].pMesh->GetVertexStride( uMesh, 0 );
             uOffset = 0;
 
             pd3dContext->IASetVertexBuffers( 
@@ -381,8 +418,8 @@ RenderModels(
                 &uOffset );
 
             pd3dContext->IASetIndexBuffer( 
-                gModels[ uModel ].Mesh.GetIB11( uMesh ), 
-                gModels[ uModel ].Mesh.GetIBFormat11( uMesh ), 
+                gModels[ uModel ].pMesh->GetIB11( uMesh ), 
+                gModels[ uModel ].pMesh->GetIBFormat11( uMesh ), 
                 0 );
 
             //  Set bone matrices into the constant buffer and bind to the context.
@@ -396,8 +433,8 @@ RenderModels(
 
             memcpy(
                 Resource.pData,
-                &gModels[ uModel ].AnimatedBones[ uMesh ],
-                sizeof( D3DXMATRIX ) * gModels[ uModel ].Mesh.GetNumInfluences( uMesh ) );
+                &gModels[ uModel ].AnimatedBones[ pInfo->uSlot ][ uMesh ],
+                sizeof( D3DXMATRIX ) * gModels[ uModel ].pMesh->GetNumInfluences( uMesh ) );
                  
             pd3dContext->Unmap( 
                 gpBoneBuffer, 
@@ -408,20 +445,20 @@ RenderModels(
                 1,
                 &gpBoneBuffer );
 
-            for( UINT uSubSet = 0; uSubSet < gModels[ uModel ].Mesh.GetNumSubsets( uMesh ); ++uSubSet )
+            for( UINT uSubSet = 0; uSubSet < gModels[ uModel ].pMesh->GetNumSubsets( uMesh ); ++uSubSet )
             {
                 SDKMESH_SUBSET*         pSubset = NULL;
                 D3D11_PRIMITIVE_TOPOLOGY PrimType;
 
                 // Get the uSubSet
-                pSubset = gModels[ uModel ].Mesh.GetSubset( 
+                pSubset = gModels[ uModel ].pMesh->GetSubset( 
                     uMesh, 
                     uSubSet );
 
                 PrimType = CDXUTSDKMesh::GetPrimitiveType11( ( SDKMESH_PRIMITIVE_TYPE )pSubset->PrimitiveType );
                 pd3dContext->IASetPrimitiveTopology( PrimType );
 
-                pMat = gModels[ uModel ].Mesh.GetMaterial( pSubset->MaterialID );
+                pMat = gModels[ uModel ].pMesh->GetMaterial( pSubset->MaterialID );
 
                 //  Set material properties into the context.
                 if( pMat )
@@ -485,11 +522,7 @@ OnD3D11FrameRender(
     {
         gD3DSettingsDlg.OnRender( fElapsedTime );
         gbIsInDeviceSelector = TRUE;
-		if( ghAnimateSet != TASKSETHANDLE_INVALID )
-		{
-			gTaskMgr.ReleaseHandle( ghAnimateSet );
-			ghAnimateSet = TASKSETHANDLE_INVALID;
-		}
+        gFramePipeline.Flush();
         return;
     }
     else
@@ -520,16 +553,15 @@ OnD3D11FrameRender(
     
     pd3dImmediateContext->Unmap( gpcbPSPerFrame, 0 );
     
-    //  When tasking is enabled, wait for the animation tasks to complete.
-    if( ghAnimateSet != TASKSETHANDLE_INVALID )
+    //  Wait for the animation of the frame to render.  With tasking the 
+    //  animation of later frames keeps running while this one is drawn.
+    UINT                        uSlot = gFramePipeline.BeginRender();
+
+    if( FRAME_PIPELINE_NO_SLOT != uSlot )
     {
-        gTaskMgr.WaitForSet( ghAnimateSet );
-        gTaskMgr.ReleaseHandle( ghAnimateSet );
-        ghAnimateSet = TASKSETHANDLE_INVALID;
+        RenderModels( pd3dImmediateContext, &gAnimationInfo[ uSlot ] );
     }
 
-    RenderModels( pd3dImmediateContext );
-
     //  Setup immediate context for UI rendering
     ProfileBeginTask( "Render UI");
     DXUTSetupD3D11Views( pd3dImmediateContext );
@@ -721,22 +753,26 @@ OnD3D11CreateDevice(
 
     for( UINT uModel = 0; uModel < ARRAYSIZE( gModels ); ++uModel )
     {
-        // Load the mesh
-         V_RETURN( gModels[ uModel ].Mesh.Create( 
+        //  Load the mesh and its animation, which only the first model does
+        V_RETURN( DXUTGetGlobalSDKMeshCache().Acquire( 
             pd3dDevice, 
             L"Giant\\GraspingWalkLow_TGA.sdkmesh", 
-            true ) );
-
-        V_RETURN( gModels[ uModel ].Mesh.LoadAnimation( L"Giant\\GraspingWalkLow_TGA.sdkmesh_anim" ) );
-        
-        D3DXMATRIX mIdentity;
-        D3DXMatrixIdentity( &mIdentity );
-        gModels[ uModel ].Mesh.TransformBindPose( &mIdentity );
+            L"Giant\\GraspingWalkLow_TGA.sdkmesh_anim",
+            true,
+            &gModels[ uModel ].pMesh ) );
 
         //  setup random animation offset
         gModels[ uModel ].dTimeOffset = 3.0 * (DOUBLE)rand() / RAND_MAX;
     }
 
+    //  Every giant shares the one mesh, so its pose groups are all made 
+    //  from it.
+    for( UINT uGroup = 0; uGroup < ARRAYSIZE( gModelGroups ); ++uGroup )
+    {
+        V_RETURN( gModels[ uGroup * MODEL_GROUP_SIZE ].pMesh->CreatePoseGroup( 
+            &gModelGroups[ uGroup ] ) );
+    }
+
     // Create a bone matrix buffer
     // It will be updated more than once per frame (in a typical game) so make it dynamic
     D3D11_BUFFER_DESC vbdesc =
@@ -853,6 +889,13 @@ OnGUIEvent(
                 gbForceCPUBound = pBox->GetChecked();
                 break;
             }
+        case IDC_LATENCYSLIDER:
+            {
+                CDXUTSlider* pSlider = (CDXUTSlider*)pControl;
+
+                gFramePipeline.SetLatency( pSlider->GetValue() );
+                break;
+            }
     }
     
     UpdateUI();
@@ -917,38 +960,66 @@ MsgProc(
 }
 
 //--------------------------------------------------------------------------------------
-// Animate each model based on the current time plus its offset
+// Animate the models of a group together, each at the current time plus its offset, with
+// each bone of every model in one pass of the SIMD kernels.  The shared mesh is only 
+// read; the poses are written to the group's own buffers.
 //--------------------------------------------------------------------------------------
 void
-AnimateModel(
+AnimateModelGroup(
     VOID*                       pvInfo,
     INT                         iContext,
-    UINT                        uModel,
-    UINT                        uTaskCount )
+    UINT                        uGroup )
 {
     D3DXMATRIXA16               mIdentity;
     PerFrameAnimationInfo*      pInfo = (PerFrameAnimationInfo*)pvInfo;
+    UINT                        uFirst = uGroup * MODEL_GROUP_SIZE;
+    UINT                        uCount = min( MODEL_GROUP_SIZE, pInfo->uModels - uFirst );
+    CDXUTSDKMesh*               pMesh = gModels[ uFirst ].pMesh;
+    DOUBLE                      dTimes[ MODEL_GROUP_SIZE ];
+    D3DXMATRIX*                 pBones[ MODEL_GROUP_SIZE ];
 
     D3DXMatrixIdentity( &mIdentity );
-    
-    gModels[ uModel ].Mesh.TransformMesh( 
-        &mIdentity, 
-        pInfo->dTime + gModels[ uModel ].dTimeOffset );
 
-    for( UINT uMesh = 0; uMesh < gModels[ uModel ].Mesh.GetNumMeshes(); ++uMesh )
+    for( UINT uLane = 0; uLane < uCount; ++uLane )
     {
-        for( UINT uMat = 0; uMat < gModels[ uModel ].Mesh.GetNumInfluences( uMesh ); ++uMat )
-        {
-            const D3DXMATRIX    *pMat;
+        dTimes[ uLane ] = pInfo->dTime + gModels[ uFirst + uLane ].dTimeOffset;
+    }
 
-            pMat = gModels[ uModel ].Mesh.GetMeshInfluenceMatrix( 
-                    uMesh, 
-                    uMat );
+    pMesh->TransformMeshGroup( 
+        &gModelGroups[ uGroup ],
+        &mIdentity,
+        dTimes,
+        uCount );
 
-            D3DXMatrixTranspose(
-                &gModels[ uModel ].AnimatedBones[ uMesh ][ uMat ],
-                pMat );
+    for( UINT uMesh = 0; uMesh < pMesh->GetNumMeshes(); ++uMesh )
+    {
+        for( UINT uLane = 0; uLane < uCount; ++uLane )
+        {
+            pBones[ uLane ] = gModels[ uFirst + uLane ].AnimatedBones[ pInfo->uSlot ][ uMesh ];
         }
+
+        pMesh->GetTransposedInfluenceMatricesGroup( 
+            uMesh, 
+            &gModelGroups[ uGroup ],
+            pBones,
+            uCount );
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Animate the model groups in [uBegin, uEnd).  Called by the tasking system with ranges
+// of groups sized from the measured animation cost.
+//--------------------------------------------------------------------------------------
+void
+AnimateModelGroups(
+    VOID*                       pvInfo,
+    INT                         iContext,
+    UINT                        uBegin,
+    UINT                        uEnd )
+{
+    for( UINT uGroup = uBegin; uGroup < uEnd; ++uGroup )
+    {
+        AnimateModelGroup( pvInfo, iContext, uGroup );
     }
 }
 //--------------------------------------------------------------------------------------
@@ -966,32 +1037,55 @@ OnFrameMove(
 
     // Update the camera's position based on user input 
     gCamera.FrameMove( fElapsedTime );
-    
-    gAnimationInfo.dTime = dTime;
+
+    //  Animate the frame into its own pipeline slot so earlier frames can
+    //  still be rendered from theirs.
+    TASKSETHANDLE               hPrevious = gFramePipeline.GetLastSimulation();
+    UINT                        uSlot = gFramePipeline.BeginSimulation();
+    PerFrameAnimationInfo*      pInfo = &gAnimationInfo[ uSlot ];
+    TASKSETHANDLE               hAnimateSet = TASKSETHANDLE_INVALID;
+    UINT                        uGroups;
+
+    pInfo->dTime = dTime;
+    pInfo->uSlot = uSlot;
+    pInfo->uModels = guModels;
+    uGroups = ( guModels + MODEL_GROUP_SIZE - 1 ) / MODEL_GROUP_SIZE;
 
     if( gbUseTasking )
     {
-        gTaskMgr.CreateTaskSet(
-            AnimateModel,
-            &gAnimationInfo,
-            guModels,
-            NULL,
+        gTaskMgr.BeginFrame();
+
+        //  TransformMeshGroup updates each group's poses in place, so a 
+        //  frame's animation waits for the previous frame's.
+        gTaskMgr.ParallelFor(
+            AnimateModelGroups,
+            pInfo,
             0,
+            uGroups,
+            PARALLELFOR_GRAIN_AUTO,
+            TASKSETHANDLE_INVALID != hPrevious ? &hPrevious : NULL,
+            TASKSETHANDLE_INVALID != hPrevious ? 1 : 0,
             "Animate Models",
-            &ghAnimateSet );
+            &hAnimateSet,
+            TASKSET_PRIORITY_HIGH,
+            &gAnimateAffinity[ uSlot ] );
     } 
     else  // Not using tasking
     {
-        for( UINT uModel = 0; uModel < guModels; ++uModel )
+        if( TASKSETHANDLE_INVALID != hPrevious )
         {
-            AnimateModel( 
-                &gAnimationInfo,
-                0, 
-                uModel,
-                ARRAYSIZE( gModels ) );
+            gTaskMgr.WaitForSet( hPrevious );
         }
+
+        AnimateModelGroups( 
+            pInfo,
+            0, 
+            0,
+            uGroups );
     }
 
+    gFramePipeline.EndSimulation( hAnimateSet );
+
     ProfileEndTask();
 }
 
@@ -1066,6 +1160,15 @@ InitApp()
         0, iY += 26, 170, 23, 
         !!gbForceCPUBound );
 
+    gSampleUI.AddStatic( 
+        IDC_LATENCYSLIDERTEXT, L"Frame Latency", 
+        0, iY += 26, 170, 23 );
+
+    gSampleUI.AddSlider( 
+        IDC_LATENCYSLIDER, 
+        0, iY += 26, 160, 23, 
+        0, FRAME_PIPELINE_MAX_LATENCY, gFramePipeline.GetLatency() );
+
     UpdateUI();
 
     //  initialize the task manager
@@ -1108,6 +1211,7 @@ WinMain(
 
     DXUTMainLoop(); // Enter into the DXUT render loop
 
+    gFramePipeline.Flush();
     gTaskMgr.Shutdown();
 
     return DXUTGetExitCode();